@@ -22,28 +22,45 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifndef BTWASM
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+#ifndef BTSERVER
 #include <SDL.h>
+#endif
 #ifdef BTWASM
 #include <emscripten.h>
 #endif
+#include "trig-tables.h" /* generated, see gen-trig-tables.c */
 
 #define UNUSED __attribute__((unused))
 
 #define SCREEN_XDIM 1200
 #define SCREEN_YDIM 675
 
+#ifndef BTSERVER
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_Surface *surface;
 
 /*------------------------------------------*/
 
-#define DEBUG_MARKERS 0
-
 struct SDL_Color color[] = {
 	{ 50, 255, 50, 255, },
 	{ 0, 128, 0, 255, },
@@ -53,6 +70,7 @@ struct SDL_Color color[] = {
 	{ 0, 0, 0, 255, },
 	{ 255, 165, 0, 255 },
 };
+#endif
 
 #define LIGHT_GREEN 0 
 #define GREEN 1 
@@ -63,34 +81,18 @@ struct SDL_Color color[] = {
 #define ORANGE 6
 
 #define TANK_COLOR LIGHT_GREEN
+#define PLAYER_TANK_COLOR WHITE
 #define TERRAIN_COLOR GREEN 
 #define OBSTACLE_COLOR GREEN 
 #define SPARK_COLOR YELLOW
+#define SHELL_COLOR ORANGE
 #define RADAR_COLOR RED
 #define RADAR_BLIP_COLOR WHITE
 #define RETICLE_COLOR LIGHT_GREEN
 
 #define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-enum tank_mode {
-	TANK_MODE_IDLE,
-	TANK_MODE_AVOIDING_OBSTACLE,
-	TANK_MODE_DRIVING,
-	TANK_MODE_COMPUTE_STEERING, /* figuring which way to turn */
-	TANK_MODE_STEERING,		/* turning */
-	TANK_MODE_AIMING,
-	TANK_MODE_SHOOTING,
-	TANK_MODE_SHOOTING_COOLDOWN,
-};
-
-static struct tank_brain {
-	enum tank_mode mode;
-	int dest_x, dest_z;
-	int desired_orientation;
-	int cooldown;
-	int obstacle_timer;
 #define TANK_DEST_ARRIVE_DIST (10 << 8)
-} tank_brain = { 0 };
 
 struct bz_vertex {
 	int32_t x, y, z; /* 3d coord */
@@ -105,19 +107,6 @@ struct bz_model {
 	int prescale_numerator, prescale_denominator;
 };
 
-struct bz_object {
-	int32_t x, y, z;
-	int scale;
-	int orientation;
-	int alive;
-	int vx, vy, vz;
-	int parent_obj;
-#define NO_PARENT_OBJ (-2)
-#define PLAYER_PARENT_OBJ (-1)
-	uint16_t color;
-	unsigned char model;
-};
-
 static struct bz_vertex bz_cube_verts[] = {
 	{ -10,  20,  10, 0, 0 },
 	{  10,  20,  10, 0, 0 },
@@ -436,12 +425,55 @@ static const int nmodels = ARRAYSIZE(bz_model);
 #define CHUNK1_MODEL 9
 #define CHUNK2_MODEL 10 
 
-#define MAX_BZ_OBJECTS 100
-static struct bz_object bzo[MAX_BZ_OBJECTS] = { 0 };
-static int nbz_objects = 0;
-static unsigned int xorshift_state = 0;
-static int bz_kills = 0;
-static int bz_deaths = 0;
+/* Entities live in one structure-of-arrays table per kind rather than in a
+ * single array of mixed objects, so that each system walks only the table it
+ * cares about.  Within each table the fields touched every tick come first,
+ * fields only needed for drawing come last.
+ */
+#define MAX_STATICS 16384
+struct bz_static_table {
+	int n;
+	int32_t x[MAX_STATICS], z[MAX_STATICS]; /* read by every collision test */
+	int32_t y[MAX_STATICS];
+	int orientation[MAX_STATICS];
+	uint16_t color[MAX_STATICS];
+	unsigned char model[MAX_STATICS];
+	int16_t chunk[MAX_STATICS]; /* chunk cache slot it was generated for, or -1 */
+};
+
+#define MAX_TANKS 4096
+struct bz_tank_table {
+	int n;
+	int32_t x[MAX_TANKS], z[MAX_TANKS];
+	int orientation[MAX_TANKS];
+	int alive[MAX_TANKS];
+	int32_t id[MAX_TANKS]; /* stable across removals, unlike the table index */
+	/* Each tank's brain, a suspended tank_behavior() */
+	uint16_t resume[MAX_TANKS]; /* where tank_behavior() picks up again */
+	int16_t counter[MAX_TANKS]; /* tank_behavior()'s only local that survives a yield */
+	uint32_t wake_tick[MAX_TANKS]; /* asleep until sim_tick reaches this */
+	uint32_t ai_tick[MAX_TANKS]; /* sim_tick when the brain last ran */
+	int32_t timer[MAX_TANKS]; /* wake up timer while asleep, otherwise -1 */
+	int32_t y[MAX_TANKS];
+	uint16_t color[MAX_TANKS];
+	int32_t awake_slot[MAX_TANKS]; /* in the world's awake list, or -1 while asleep */
+};
+
+#define MAX_SHELLS 4096
+struct bz_shell_table {
+	int n;
+	int32_t x[MAX_SHELLS], z[MAX_SHELLS];
+	int32_t vx[MAX_SHELLS], vz[MAX_SHELLS];
+	int alive[MAX_SHELLS];
+	int32_t timer[MAX_SHELLS]; /* expires the shell at the end of its flight */
+	int32_t parent[MAX_SHELLS]; /* id of the tank which fired it, or PLAYER_PARENT() */
+#define PLAYER_PARENT(p) (-1 - (p)) /* parent of player p's shells */
+#define SHELL_PLAYER(parent) (-1 - (parent)) /* and back, for parent < 0 */
+	int32_t id[MAX_SHELLS]; /* stable across removals, like a tank's id */
+	int32_t y[MAX_SHELLS];
+	int orientation[MAX_SHELLS];
+};
+
 
 /* Approximate replica of the arcade game map */
 static const struct bz_map_entry {
@@ -469,22 +501,78 @@ static const struct bz_map_entry {
 	{ 251, 253, PYRAMID_MODEL },
 };
 
+/* A scenario sets up an arena in place of the arcade game's single tank, for
+ * playing or benchmarking under a given load.  See load_scenario().
+ */
+struct scenario_object {
+	int32_t x, z; /* in units of 256, from the centre of the arcade map */
+	int orientation;
+	int model;
+};
+
+struct scenario {
+	int tanks; /* enemy tanks to keep in the arena, or -1 to leave it to --tanks */
+	int respawn_ticks, tank_cooldown_ticks, explosions_per_second, no_terrain;
+	int nobstacles, ntanks;
+	struct scenario_object *obstacle, *tank;
+};
+
+static struct scenario *scenario; /* --scenario, shared by every world like the map */
+
 #define CAMERA_GROUND_LEVEL (6 * 256)
-static struct camera {
+struct camera {
 	int32_t x, y, z;
 	int32_t vx, vy, vz;
 	int orientation;
 	int eyedist;
-} camera;
+};
+
+/* A player is a tank driven by a person, seen from inside: the camera is
+ * their eye.  Slots are never moved, so a player's index is their id.
+ */
+#define MAX_PLAYERS 32
+struct bz_player {
+	struct camera camera;
+	uint32_t keypress_latches; /* BUTTON_* bits for this tick */
+	int active; /* in the game; free slots are skipped */
+	int kills, deaths;
+	int has_been_hit; /* this tick */
+};
 
-#define MAX_SPARKS 100
-#define SPARKS_PER_EXPLOSION (MAX_SPARKS / 4)
+/* Sparks and debris chunks are particles.  They have pools of their own, so
+ * an explosion can never take a slot needed by a tank or a shell, and each pool
+ * is a structure of arrays aligned for SIMD so particles are integrated and
+ * culled SIMD_WIDTH at a time.  Lanes past n in the last vector hold stale
+ * values, which are masked out of the integration so that they stay put
+ * (left to fall, they would overflow in a long enough game) and are never
+ * looked at.
+ */
+typedef int32_t v4i32 __attribute__((vector_size(16), may_alias));
+#define SIMD_WIDTH 4
+#define SIMD_ALIGN __attribute__((aligned(16)))
+
+#define SPARKS_PER_EXPLOSION 25
 #define SPARK_GRAVITY (-10)
 #define TANK_CHUNK_COUNT (10)
-static struct bz_spark {
-	int x, y, z, life, vx, vy, vz;
-} spark[MAX_SPARKS] = { 0 };
-static int nsparks = 0;
+
+#define MAX_SPARKS 32768
+struct bz_spark_pool {
+	int n;
+	int32_t x[MAX_SPARKS] SIMD_ALIGN, y[MAX_SPARKS] SIMD_ALIGN, z[MAX_SPARKS] SIMD_ALIGN;
+	int32_t vx[MAX_SPARKS] SIMD_ALIGN, vy[MAX_SPARKS] SIMD_ALIGN, vz[MAX_SPARKS] SIMD_ALIGN;
+	int32_t expiry[MAX_SPARKS] SIMD_ALIGN; /* sim_tick at which the spark dies */
+};
+
+#define MAX_DEBRIS 8192
+struct bz_debris_pool {
+	int n;
+	int32_t x[MAX_DEBRIS] SIMD_ALIGN, y[MAX_DEBRIS] SIMD_ALIGN, z[MAX_DEBRIS] SIMD_ALIGN;
+	int32_t vx[MAX_DEBRIS] SIMD_ALIGN, vy[MAX_DEBRIS] SIMD_ALIGN, vz[MAX_DEBRIS] SIMD_ALIGN;
+	int32_t expiry[MAX_DEBRIS] SIMD_ALIGN; /* sim_tick at which the chunk dies */
+	int32_t orientation[MAX_DEBRIS] SIMD_ALIGN, spin[MAX_DEBRIS] SIMD_ALIGN;
+	uint16_t color[MAX_DEBRIS];
+	unsigned char model[MAX_DEBRIS];
+};
 
 #define BUTTON_UP (1 << 0)
 #define BUTTON_DOWN (1 << 1)
@@ -492,1329 +580,6092 @@ static int nsparks = 0;
 #define BUTTON_LEFT (1 << 3)
 #define BUTTON_FIRE (1 << 4)
 #define BUTTON_QUIT (1 << 5)
-static uint32_t keypress_latches = 0;
-
-static int button_pressed(int button)
-{
-	return !!(keypress_latches & button);
-}
 
 static uint64_t boot_microseconds = 0;
 
+/* The monotonic clock, so that intervals survive the time of day being set */
 static void rtc_init(void)
 {
 	struct timespec now;
-	timespec_get(&now, TIME_UTC);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	boot_microseconds = now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 static uint64_t rtc_get_us_since_boot(void)
 {
 	struct timespec now;
-	timespec_get(&now, TIME_UTC);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	uint64_t now_microseconds = now.tv_sec * 1000000 + now.tv_nsec / 1000;
 	return now_microseconds;
 }
 
-static uint64_t rtc_get_ms_since_boot(void)
-{
-	return rtc_get_us_since_boot()/1000;
-}
-
-/* George Marsaglia's xorshift PRNG algorithm,
- * see: https://en.wikipedia.org/wiki/Xorshift#Example_implementation */
-/* The state word must be initialized to non-zero */
-unsigned int xorshift(unsigned int *state)
-{
-	/* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
-	unsigned int x = *state;
-	x ^= x << 13;
-	x ^= x >> 17;
-	x ^= x << 5;
-	*state = x;
-	return x;
-}
-
-/* 128 sine values * 256 */
-static const int16_t sine_array[] = {
-	0, 12, 25, 37, 49, 62, 74, 86, 97, 109, 120, 131, 142, 152, 162, 171, 181, 189, 197, 205, 212,
-	219, 225, 231, 236, 241, 244, 248, 251, 253, 254, 255, 256, 255, 254, 253, 251, 248, 244, 241,
-	236, 231, 225, 219, 212, 205, 197, 189, 181, 171, 162, 152, 142, 131, 120, 109, 97, 86, 74, 62,
-	49, 37, 25, 12, 0, -12, -25, -37, -49, -62, -74, -86, -97, -109, -120, -131, -142, -152, -162,
-	-171, -181, -189, -197, -205, -212, -219, -225, -231, -236, -241, -244, -248, -251, -253, -254,
-	-255, -256, -255, -254, -253, -251, -248, -244, -241, -236, -231, -225, -219, -212, -205, -197,
-	-189, -181, -171, -162, -152, -142, -131, -120, -109, -97, -86, -74, -62, -49, -37, -25, -12,
+/* Tracing (--trace file).  Frames, ticks, their phases and the pool's jobs
+ * are bracketed by trace_begin() and trace_end(), which append an event to a
+ * ring belonging to the calling thread; no locks are taken and a thread
+ * whose ring is full drops the event rather than wait.  A begin is only
+ * taken if there is room left for its end too, and a dropped one takes its
+ * end and everything between with it, so that every slice in the file is
+ * closed; those still open at exit are closed then.  A writer thread
+ * drains the rings every few milliseconds into a file of Chrome trace
+ * events, which Perfetto or chrome://tracing show as a timeline, one track
+ * per thread.  With tracing off each call is a couple of loads and branches.
+ */
+#define TRACE_THREADS 80
+#define TRACE_RING 16384 /* events per thread, a power of two */
+#define TRACE_FLUSH_US 5000
+
+struct trace_ring {
+	_Atomic uint32_t head; /* written by the thread the ring belongs to */
+	_Atomic uint32_t tail; /* written by the writer */
+	atomic_uint dropped;
+	uint32_t open; /* begins taken and not yet ended, each keeping a slot */
+	uint32_t skipping; /* depth inside a dropped begin, or 0 */
+	int named; /* the writer's: thread_name has been written */
+	uint32_t depth; /* the writer's: begins written, not yet ended */
+	char thread_name[24];
+	struct trace_event {
+		uint64_t us;
+		const char *name; /* a string constant */
+		char ph; /* 'B'egin or 'E'nd */
+	} ev[TRACE_RING];
 };
 
-static short sine(int a)
+static struct tracer {
+	atomic_int on;
+	FILE *f;
+	uint64_t start_us;
+	uint64_t events; /* written */
+	pthread_t writer;
+	int writer_running;
+	atomic_int stop;
+	atomic_int nrings;
+	struct trace_ring *_Atomic ring[TRACE_THREADS];
+} tracer;
+
+static _Thread_local struct trace_ring *trace_ring;
+static _Thread_local int trace_no_ring;
+static _Thread_local const char *trace_thread_name = "main";
+static _Thread_local int trace_thread_number = -1;
+
+/* Names the calling thread's track, "name" or "name n" if n >= 0 */
+static void trace_thread(const char *name, int n)
 {
-	if (a < 0 || a > 127)
-		fprintf(stderr, "sine(): Bad argument %d, should be in the range [0 - 127]\n", a);
-	return sine_array[a];
+	trace_thread_name = name;
+	trace_thread_number = n;
 }
 
-static short cosine(int a)
+static struct trace_ring *trace_new_ring(void)
 {
-	if (a < 0 || a > 127)
-		fprintf(stderr, "cosine(): Bad argument %d, should be in the range [0 - 127]\n", a);
-	return sine_array[(a + 32) & 127];
-}
+	int i = atomic_fetch_add(&tracer.nrings, 1);
+	struct trace_ring *r;
 
-/* Lookup table for angles 0 - 45 degrees (0 to 16 in our system).  x must be greater than or equal to y */
-static int16_t atan_lookup_table(int16_t x, int16_t y)
-{
-	static unsigned char atan_lut[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 10, 11, 12, 13, 13, 14, 15, 15 };
-	if (x == 0)
-		return 0;
-	/* x>=0, y>=0 and x>=y, so y/x will be in the range 0.0 to 1.0, so (16*y)/x will be in range 0 - 16 */
-	return (int16_t) atan_lut[(16 * y) / x];
+	if (i >= TRACE_THREADS || !(r = calloc(1, sizeof(*r)))) {
+		trace_no_ring = 1;
+		return NULL;
+	}
+	if (trace_thread_number >= 0)
+		snprintf(r->thread_name, sizeof(r->thread_name), "%s %d", trace_thread_name, trace_thread_number);
+	else
+		snprintf(r->thread_name, sizeof(r->thread_name), "%s", trace_thread_name);
+	atomic_store(&tracer.ring[i], r);
+	trace_ring = r;
+	return r;
 }
 
-static int16_t arctan2(int16_t y, int16_t x)
+static void trace_event(const char *name, char ph)
 {
-	int16_t angle, quadrant = 0;
+	struct trace_ring *r = trace_ring;
+	uint32_t head;
 
-	if (x < 0) {
-		x = -x;
-		quadrant = 1;
-	}
-	if (y < 0) {
-		y = -y;
-		quadrant |= 2;
+	if (!r && (trace_no_ring || !(r = trace_new_ring())))
+		return;
+	if (r->skipping) {
+		r->skipping += ph == 'B' ? 1 : -1;
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
 	}
-	if (x > y) /* angle is between 0 and 45 degrees */
-		angle = atan_lookup_table(x, y);
-	else /* angle is between 45 and 90 degrees */
-		angle = 32 - atan_lookup_table(y, x);
-
-	switch (quadrant) {
-	case 0:
-		return angle;
-	case 1:
-		return 64 - angle;
-	case 2:
-		return -angle;
-	case 3:
-	default:
-		return angle - 64;
+	if (ph == 'E' && !r->open)
+		return; /* its begin came before tracing did */
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	/* Every open begin has a slot kept for its end */
+	if (ph == 'B' && head - atomic_load_explicit(&r->tail, memory_order_acquire) + r->open + 2 > TRACE_RING) {
+		r->skipping = 1;
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
 	}
+	r->open += ph == 'B' ? 1 : -1;
+	r->ev[head % TRACE_RING] = (struct trace_event) { rtc_get_us_since_boot(), name, ph };
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
 }
 
-void Point(int x, int y)
+static inline void trace_begin(const char *name)
 {
-	if (x >= SCREEN_XDIM)
-		x = SCREEN_XDIM - 1;
-	if (y >= SCREEN_YDIM)
-		y = SCREEN_YDIM - 1;
-	SDL_RenderDrawPoint(renderer, x, y);
-}
+	struct trace_ring *r;
 
-void HorizontalLine(int x1, int y1, int x2, __attribute__((unused)) int y2)
-{
-	for (int x = x1; x <= x2; x++)
-		Point(x, y1);
+	if (atomic_load_explicit(&tracer.on, memory_order_relaxed))
+		trace_event(name, 'B');
+	else if ((r = trace_ring) && (r->open || r->skipping))
+		r->skipping++; /* so that its end isn't taken for an open one's */
 }
 
-void VerticalLine(int x1, int y1, __attribute__((unused)) int x2, int y2)
+/* Ends the slice even if tracing has stopped since it began */
+static inline void trace_end(const char *name)
 {
-	int y;
+	struct trace_ring *r = trace_ring;
 
-	for (y = y1; y <= y2; y++)
-		Point(x1, y);
+	if (r && (r->open || r->skipping))
+		trace_event(name, 'E');
 }
 
-void Line(int x0, int y0, int x1, int y1)
+/* Writes out what is in the rings so far */
+static void trace_drain(void)
 {
-	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-	int err = (dx > dy ? dx : -dy)/2, e2;
+	int nrings = atomic_load(&tracer.nrings);
+
+	if (nrings > TRACE_THREADS)
+		nrings = TRACE_THREADS;
+	for (int i = 0; i < nrings; i++) {
+		struct trace_ring *r = atomic_load(&tracer.ring[i]);
+		uint32_t head, tail;
+
+		if (!r)
+			continue; /* not quite there yet */
+		if (!r->named) {
+			fprintf(tracer.f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", i, r->thread_name);
+			r->named = 1;
+		}
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		for (; tail != head; tail++) {
+			const struct trace_event *e = &r->ev[tail % TRACE_RING];
+			fprintf(tracer.f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%llu}",
+				e->name, e->ph, i, (unsigned long long) (e->us - tracer.start_us));
+			r->depth += e->ph == 'B' ? 1 : -1;
+			tracer.events++;
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+}
 
-	for (;;) {
-		Point(x0, y0); /* optimise this: join multiple y==y points into one segments */
+static void *trace_writer(UNUSED void *arg)
+{
+	while (!atomic_load(&tracer.stop)) {
+		trace_drain();
+		usleep(TRACE_FLUSH_US);
+	}
+	return NULL;
+}
 
-		if (x0 == x1 && y0 == y1)
-			break;
+static void trace_close(void)
+{
+	uint64_t dropped = 0;
+	int nrings;
 
-		e2 = err;
-		if (e2 > -dx) { err -= dy; x0 += sx; }
-		if (e2 < dy) { err += dx; y0 += sy; }
+	if (!tracer.f)
+		return;
+	atomic_store(&tracer.on, 0);
+	atomic_store(&tracer.stop, 1);
+	if (tracer.writer_running)
+		pthread_join(tracer.writer, NULL);
+	trace_drain();
+	nrings = atomic_load(&tracer.nrings);
+	for (int i = 0; i < nrings && i < TRACE_THREADS; i++) {
+		struct trace_ring *r = atomic_load(&tracer.ring[i]);
+		uint64_t now = rtc_get_us_since_boot() - tracer.start_us;
+
+		if (!r)
+			continue;
+		/* Threads still busy end their slices here, where the file does */
+		for (; r->depth; r->depth--)
+			fprintf(tracer.f, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%llu}",
+				i, (unsigned long long) now);
+		dropped += atomic_load(&r->dropped);
 	}
+	fprintf(tracer.f, "\n]}\n");
+	fclose(tracer.f);
+	tracer.f = NULL;
+	printf("traced %llu events on %d threads, %llu dropped\n", (unsigned long long) tracer.events,
+		nrings < TRACE_THREADS ? nrings : TRACE_THREADS, (unsigned long long) dropped);
 }
 
-/* Draw a line clipped to the display.  At least one of the points must be on the display */
-void ClippedLine(signed short x0, signed short y0, signed short x1, signed short y1)
+/* Starts tracing into the file at path, until exit */
+static int trace_open(const char *path)
 {
-	/* If (x0, y0) is offscreen, assume (x1, y1) is onscreen and start drawing with (x1, y1) */
-	if (x0 < 0 || y0 < 0 || x0 >= SCREEN_XDIM || y0 >= SCREEN_YDIM) {
-		/* swap (x0, y0) and (x1, y1) */
-		unsigned short x, y;
-		x = x0;
-		y = y0;
-		x0 = x1;
-		y0 = y1;
-		x1 = x;
-		y1 = y;
+	tracer.f = fopen(path, "w");
+	if (!tracer.f) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
 	}
+	tracer.start_us = rtc_get_us_since_boot();
+	fprintf(tracer.f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"browzer-tanx\"}}");
+	/* Where threads are unavailable (e.g. wasm), everything is written at exit */
+	tracer.writer_running = pthread_create(&tracer.writer, NULL, trace_writer, NULL) == 0;
+	atexit(trace_close);
+	atomic_store(&tracer.on, 1);
+	return 0;
+}
 
-	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-	int err = (dx > dy ? dx : -dy)/2, e2;
+/* Where the time goes.  Each phase of a tick or a frame is bracketed by
+ * profile_begin() and profile_end(), which also trace it (see above), and
+ * which cost a couple of loads and branches while both are off.  The
+ * simulation's phases go to sim_phase_us, which belongs to whichever thread
+ * runs the simulation, and are handed on to the frame which shows that tick
+ * (see profile_frame()).
+ */
+enum profile_phase {
+	PHASE_INPUT, /* players' buttons */
+	PHASE_AI, /* tanks */
+	PHASE_MOVEMENT, /* timers, chunks, respawns and clearing away the dead */
+	PHASE_COLLISION, /* shells, which move and hit things together */
+	PHASE_PARTICLES,
+	PHASE_CULL,
+	PHASE_PROJECT,
+	PHASE_RASTER,
+	PHASE_PRESENT,
+	NPHASES,
+};
+#define NSIM_PHASES (PHASE_PARTICLES + 1)
 
-	for (;;) {
-		if (x0 < 0 || y0 < 0 || x0 >= SCREEN_XDIM || y0 >= SCREEN_YDIM)
-			break;
-		Point(x0, y0); /* optimise this: join multiple y==y points into one segments */
+static const char *phase_name[NPHASES] = {
+	"input", "ai", "movement", "collision", "particles", "cull", "project", "raster", "present",
+};
 
-		if (x0 == x1 && y0 == y1)
-			break;
+static atomic_int profiling;
+static uint32_t sim_phase_us[NSIM_PHASES]; /* in the last tick, while profiling */
 
-		e2 = err;
-		if (e2 > -dx) { err -= dy; x0 += sx; }
-		if (e2 < dy) { err += dx; y0 += sy; }
-	}
+static inline uint64_t profile_begin(int phase)
+{
+	trace_begin(phase_name[phase]);
+	return atomic_load_explicit(&profiling, memory_order_relaxed) ? rtc_get_us_since_boot() : 0;
 }
 
-static void add_spark(int x, int y, int z, int vx, int vy, int vz, int life)
+static inline void profile_end(uint32_t *phase_us, int phase, uint64_t start)
 {
-	if (nsparks >= MAX_SPARKS)
-		return;
-	struct bz_spark *s = &spark[nsparks];
-	s->x = x;
-	s->y = y;
-	s->z = z;
-	s->vx = vx;
-	s->vy = vy;
-	s->vz = vz;
-	s->life = life;
-	nsparks++;
+	trace_end(phase_name[phase]);
+	if (start)
+		phase_us[phase] += (uint32_t) (rtc_get_us_since_boot() - start);
 }
 
-static void remove_spark(int n)
+#ifndef BTSERVER
+static uint64_t rtc_get_ms_since_boot(void)
 {
-	if (n < nsparks - 1)
-		spark[n] = spark[nsparks - 1];
-	nsparks--;
+	return rtc_get_us_since_boot()/1000;
 }
+#endif
 
-static void move_spark(struct bz_spark *s)
+/* A fixed pool of threads, and the jobs it runs.  A job is a function run
+ * over a range [0, n) in chunks, a job of a single chunk being just a task.
+ * Jobs are put together into a graph in which a job may wait for others to
+ * finish, and run_jobs() runs the graph on the pool.  Once everything a job
+ * waits for is done its chunks are dealt out evenly, a contiguous run of them
+ * to each thread, so jobs which don't wait for each other run side by side.
+ * A thread works through its own runs from the front, and once those are
+ * empty it steals the back half of what remains of some other thread's last
+ * run, so threads which draw expensive chunks are helped out by the rest.
+ * The calling thread works alongside the pool, so with a single thread the
+ * graph just runs in order.  Each thread has a worker number in
+ * [0, pool.nthreads), 0 being the caller, which job functions can use to pick
+ * a per-thread output buffer.
+ *
+ * The pool runs one graph at a time.  A graph started while the pool is busy
+ * with another, from another thread or from inside a job, runs on the thread
+ * which started it alone, as worker 0; jobs which use the per-worker buffers
+ * must only be started from the simulation.
+ */
+#define MAX_WORKERS 64
+#define MAX_JOBS 16 /* in one graph */
+#define JOB_MAX_DEPS 4
+#define MAX_JOB_STATS 32
+typedef void (*parallel_fn)(void *arg, int begin, int end, int worker);
+
+/* Output buffers for loops run on the pool, one per worker */
+struct bz_worker_scratch {
+	int nshots;
+	int32_t shot[MAX_TANKS]; /* tanks which fired, see tank_shoot() */
+	int nhits;
+	struct shell_hit_event {
+		int32_t shell, target;
+		int32_t what; /* enum shell_hit */
+	} hit[MAX_SHELLS]; /* see move_shells() */
+};
+
+struct job {
+	const char *name; /* for the timings, see job_report() */
+	parallel_fn fn;
+	void *arg;
+	int n, chunk;
+	const int *count; /* if set, n is read from here once the job is ready to run */
+	int ndeps, dep[JOB_MAX_DEPS]; /* earlier jobs which must finish first */
+
+	/* The rest is filled in by run_jobs() */
+	int ndependents, dependent[MAX_JOBS];
+	atomic_int waiting; /* deps not finished yet */
+	atomic_int left; /* chunks not finished yet */
+	_Atomic uint64_t busy_us; /* in fn, summed over workers */
+	uint64_t ready_us, done_us;
+};
+
+struct job_graph {
+	int njobs;
+	struct job job[MAX_JOBS];
+	atomic_int left; /* jobs not finished yet */
+};
+
+/* The runs of chunks a thread has yet to start.  The owner takes from the
+ * front of the first run and thieves from the back of the last; the lock is
+ * only ever held for a few instructions.
+ */
+struct pool_deque {
+	atomic_flag lock;
+	int head, tail; /* runs [head, tail) */
+	struct job_run {
+		int job, front, back; /* chunks [front, back) of the job */
+	} run[MAX_JOBS + 1]; /* one of each job, and one stolen while empty */
+	uint64_t chunks; /* run by this worker, see job_report() */
+} __attribute__((aligned(64))); /* one per cache line */
+
+static struct worker_pool {
+	int nthreads; /* including the calling thread */
+	pthread_t thread[MAX_WORKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t wake, finished;
+	unsigned int generation; /* bumped for each new graph */
+	int running; /* pool threads still working on the current graph */
+	struct job_graph *graph;
+	atomic_flag busy; /* a graph is running on the pool */
+	struct pool_deque deque[MAX_WORKERS];
+	atomic_uint steals; /* successful steals, for the curious */
+	int timing; /* collect the job timings below */
+	int nstats;
+	struct job_stats {
+		const char *name;
+		uint64_t runs, busy_us, span_us;
+	} stats[MAX_JOB_STATS];
+	struct bz_worker_scratch scratch[MAX_WORKERS];
+} pool = { .nthreads = 1 };
+
+static void deque_lock(struct pool_deque *d)
 {
-	s->x += s->vx;
-	s->y += s->vy;
-	s->z += s->vz;
-	s->vy -= SPARK_GRAVITY; /* Why subtract here, but add in move_object()??? */
-	if (s->y > 256 * 20) /* this doesn't make sense to me... seems like it should be if s->y > 0 */
-		s->life = 0;
-	if (s->life > 0)
-		s->life--;
+	while (atomic_flag_test_and_set_explicit(&d->lock, memory_order_acquire))
+		;
 }
 
-static void move_sparks(void)
+static void deque_unlock(struct pool_deque *d)
 {
-	for (int i = 0; i < nsparks; i++)
-		move_spark(&spark[i]);
+	atomic_flag_clear_explicit(&d->lock, memory_order_release);
 }
 
-static void remove_dead_sparks(void)
+static void deque_push(struct pool_deque *d, int job, int front, int back)
 {
-	for (int i = 0;;) {
-		if (i >= nsparks)
-			break;
-		struct bz_spark *s = &spark[i];
-		if (s->life > 0) {
-			i++;
-			continue;
-		}
-		remove_spark(i);
-	}
+	deque_lock(d);
+	if (d->head == d->tail)
+		d->head = d->tail = 0;
+	d->run[d->tail++] = (struct job_run) { job, front, back };
+	deque_unlock(d);
 }
 
-static int mountain[128];
-
-static void fractal_mountain(int start, int middle, int end)
+/* Take the chunk at the front of d, or return -1 if d is empty */
+static int deque_pop(struct pool_deque *d, int *job)
 {
-	int m;
-	if (middle - start > 1) {
-		int d = (abs(mountain[middle] - mountain[start]) * 30) / 100;
-		if (d > 0)
-			m = ((mountain[start] + mountain[middle]) / 2) - (d / 2) + (xorshift(&xorshift_state) % d);
-		else
-			m = mountain[start];
-		int i = (middle - start) / 2 + start;
-		mountain[i] = m;
-		fractal_mountain(start, i, middle);
-	}
-	if (end - middle > 1) {
-		int d = (abs(mountain[end] - mountain[middle]) * 30) / 100;
-		if (d > 0)
-			m = ((mountain[middle] + mountain[end]) / 2) - (d / 2) + (xorshift(&xorshift_state) % d);
-		else
-			m = mountain[middle];
-		int i = (end - middle) / 2 + middle;
-		mountain[i] = m;
-		fractal_mountain(middle, i, end);
+	int chunk = -1;
+
+	deque_lock(d);
+	while (d->head < d->tail && d->run[d->head].front == d->run[d->head].back)
+		d->head++;
+	if (d->head < d->tail) {
+		*job = d->run[d->head].job;
+		chunk = d->run[d->head].front++;
 	}
+	deque_unlock(d);
+	return chunk;
 }
 
-static void init_mountains(void)
+/* Move the back half of another worker's last run onto our own (empty)
+ * deque and return the first chunk of it, or -1 if no other worker has any.
+ */
+static int pool_steal(struct worker_pool *p, int worker, int *job)
 {
-	for (int i = 0; i < 128; i++)
-		mountain[i] = SCREEN_YDIM / 2;
-	mountain[32] = 20;
-	fractal_mountain(0, 32, 96);
-}
+	for (int i = 1; i < p->nthreads; i++) {
+		struct pool_deque *victim = &p->deque[(worker + i) % p->nthreads];
+		int j = -1, front = 0, back = 0;
+
+		deque_lock(victim);
+		while (victim->head < victim->tail) {
+			struct job_run *r = &victim->run[victim->tail - 1];
+			if (r->front < r->back) {
+				j = r->job;
+				back = r->back;
+				front = back - (back - r->front + 1) / 2;
+				r->back = front;
+				break;
+			}
+			victim->tail--;
+		}
+		deque_unlock(victim);
+		if (j < 0)
+			continue;
 
-/* Program states.  Initial state is BATTLEZONE_INIT */
-enum battlezone_state_t {
-	BATTLEZONE_INIT,
-	BATTLEZONE_RUN,
-	BATTLEZONE_EXIT,
-};
+		if (front + 1 < back)
+			deque_push(&p->deque[worker], j, front + 1, back);
+		atomic_fetch_add_explicit(&p->steals, 1, memory_order_relaxed);
+		*job = j;
+		return front;
+	}
+	return -1;
+}
 
-static enum battlezone_state_t battlezone_state = BATTLEZONE_INIT;
-static int screen_changed = 0;
+static void release_job(struct worker_pool *p, struct job_graph *g, int k, int worker);
 
-static int add_object(int x, int y, int z, int orientation, uint8_t model, uint16_t color)
+static void finish_job(struct worker_pool *p, struct job_graph *g, int k, int worker)
 {
-	if (nbz_objects >= MAX_BZ_OBJECTS)
-		return -1;
-	bzo[nbz_objects].x = x;
-	bzo[nbz_objects].y = y;
-	bzo[nbz_objects].z = z;
-	bzo[nbz_objects].orientation = orientation;
-	bzo[nbz_objects].model = model;
-	bzo[nbz_objects].color = color;
-	bzo[nbz_objects].vx = 0;
-	bzo[nbz_objects].vy = 0;
-	bzo[nbz_objects].vz = 0;
-	bzo[nbz_objects].alive = 1;
-	bzo[nbz_objects].parent_obj = NO_PARENT_OBJ;
-	nbz_objects++;
-	return nbz_objects - 1;
+	struct job *j = &g->job[k];
+
+	if (p->timing)
+		j->done_us = rtc_get_us_since_boot();
+	for (int i = 0; i < j->ndependents; i++)
+		if (atomic_fetch_sub(&g->job[j->dependent[i]].waiting, 1) == 1)
+			release_job(p, g, j->dependent[i], worker);
+	atomic_fetch_sub(&g->left, 1);
 }
 
-static void remove_object(int n)
+/* Everything job k waits for is done, so deal its chunks out, starting
+ * with this thread so that a task runs where the one before it finished.
+ */
+static void release_job(struct worker_pool *p, struct job_graph *g, int k, int worker)
 {
-	if (n < nbz_objects - 1)
-		bzo[n] = bzo[nbz_objects - 1];
-	nbz_objects--;
+	struct job *j = &g->job[k];
+	int nchunks;
+
+	if (p->timing)
+		j->ready_us = rtc_get_us_since_boot();
+	if (j->count)
+		j->n = *j->count;
+	nchunks = j->n > 0 ? (j->n + j->chunk - 1) / j->chunk : 0;
+	if (nchunks == 0) {
+		finish_job(p, g, k, worker);
+		return;
+	}
+	atomic_store(&j->left, nchunks);
+	for (int i = 0; i < p->nthreads; i++) {
+		int front = (int) (((int64_t) nchunks * i + p->nthreads - 1) / p->nthreads);
+		int back = (int) (((int64_t) nchunks * (i + 1) + p->nthreads - 1) / p->nthreads);
+		if (front < back)
+			deque_push(&p->deque[(worker + i) % p->nthreads], k, front, back);
+	}
 }
 
-static void prescale_models(void)
+static void run_chunk(struct worker_pool *p, struct job_graph *g, int k, int chunk, int worker)
 {
-	static int already_scaled = 0;
-
-	if (already_scaled)
-		return;
-	already_scaled = 1;
+	struct job *j = &g->job[k];
+	int begin = chunk * j->chunk;
+	int end = begin + j->chunk;
+
+	if (end > j->n)
+		end = j->n;
+	trace_begin(j->name);
+	if (p->timing) {
+		uint64_t start = rtc_get_us_since_boot();
+		j->fn(j->arg, begin, end, worker);
+		atomic_fetch_add_explicit(&j->busy_us, rtc_get_us_since_boot() - start,
+			memory_order_relaxed);
+	} else {
+		j->fn(j->arg, begin, end, worker);
+	}
+	trace_end(j->name);
+	p->deque[worker].chunks++;
+	if (atomic_fetch_sub(&j->left, 1) == 1)
+		finish_job(p, g, k, worker);
+}
 
-	for (int i = 0; i < nmodels; i++) {
-		for (int j = 0; j < bz_model[i]->nvertices; j++) {
-			bz_model[i]->vert[j].x *= bz_model[i]->prescale_numerator;
-			bz_model[i]->vert[j].y *= bz_model[i]->prescale_numerator;
-			bz_model[i]->vert[j].z *= bz_model[i]->prescale_numerator;
-			bz_model[i]->vert[j].x /= bz_model[i]->prescale_denominator;
-			bz_model[i]->vert[j].y /= bz_model[i]->prescale_denominator;
-			bz_model[i]->vert[j].z /= bz_model[i]->prescale_denominator;
+static void pool_run_jobs(struct worker_pool *p, struct job_graph *g, int worker)
+{
+	while (atomic_load(&g->left) > 0) {
+		int k, chunk = deque_pop(&p->deque[worker], &k);
+		if (chunk < 0)
+			chunk = pool_steal(p, worker, &k);
+		if (chunk < 0) {
+			sched_yield(); /* what's left is waiting on jobs still running */
+			continue;
 		}
+		run_chunk(p, g, k, chunk, worker);
 	}
 }
 
-static void add_initial_objects(void)
+static void *pool_thread(void *arg)
 {
-	for (size_t i = 0; i < ARRAYSIZE(battlezone_map); i++) {
-		const struct bz_map_entry *m = &battlezone_map[i];
-		add_object((m->x - 128) * 512, 0, (m->z - 128) * 512, 0, m->type, OBSTACLE_COLOR);
+	struct worker_pool *p = &pool; /* there is only the one */
+	int worker = (int) (intptr_t) arg;
+	unsigned int seen = 0;
+
+	trace_thread("worker", worker);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->generation == seen)
+			pthread_cond_wait(&p->wake, &p->lock);
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+		pool_run_jobs(p, p->graph, worker);
+		pthread_mutex_lock(&p->lock);
+		if (--p->running == 0)
+			pthread_cond_signal(&p->finished);
 	}
-	add_object(   0, 0, -100 * 256, 0, TANK_MODEL, TANK_COLOR);
-	tank_brain.mode = TANK_MODE_IDLE;
-	tank_brain.cooldown = 0;
+	return NULL;
 }
 
-static void battlezone_init(void)
+static void pool_init(int nthreads)
 {
-	if (xorshift_state == 0) {
-		xorshift_state = 0xa5a5a5a5;
-		init_mountains();
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_WORKERS)
+		nthreads = MAX_WORKERS;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.finished, NULL);
+	atomic_flag_clear(&pool.busy);
+	for (int i = 0; i < MAX_WORKERS; i++)
+		atomic_flag_clear(&pool.deque[i].lock);
+	pool.nthreads = 1;
+	for (int i = 1; i < nthreads; i++) {
+		/* Where threads are unavailable (e.g. wasm), just run with fewer */
+		if (pthread_create(&pool.thread[i], NULL, pool_thread, (void *) (intptr_t) i) != 0)
+			break;
+		pool.nthreads++;
 	}
+}
 
-	nbz_objects = 0;
-	nsparks = 0;
-	prescale_models();
-	add_initial_objects();
-
-	camera.x = 0;
-	camera.y = CAMERA_GROUND_LEVEL;
-	camera.z = 0;
-	camera.vx = 0;
-	camera.vy = 0;
-	camera.orientation = 0;
-	camera.eyedist = (2 * SCREEN_XDIM / 3) * 256;
-
-	SDL_RenderClear(renderer);
-	battlezone_state = BATTLEZONE_RUN;
-	screen_changed = 1;
+/* Adds a job to g which runs fn over [0, n) in chunks, and returns its number */
+static int add_job(struct job_graph *g, const char *name, parallel_fn fn, void *arg, int n, int chunk)
+{
+	struct job *j = &g->job[g->njobs];
+
+	j->name = name;
+	j->fn = fn;
+	j->arg = arg;
+	j->n = n;
+	j->chunk = chunk > 0 ? chunk : 1;
+	j->count = NULL;
+	j->ndeps = 0;
+	return g->njobs++;
 }
 
-static void bump_player(void)
+/* Makes job k of g wait for job dep, which must have been added before it */
+static void job_after(struct job_graph *g, int k, int dep)
 {
-	camera.y = CAMERA_GROUND_LEVEL + (4 * 256);
+	g->job[k].dep[g->job[k].ndeps++] = dep;
 }
 
-static int shell_collision(struct bz_object *s)
+static void record_job_times(struct worker_pool *p, struct job_graph *g)
 {
-	int dx, dz;
-	for (int i = 0; i < nbz_objects; i++) {
-		if (s == &bzo[i]) /* can't collide with self */
-			continue;
+	for (int k = 0; k < g->njobs; k++) {
+		struct job *j = &g->job[k];
+		int i;
 
-		switch (bzo[i].model) {
-		case CHUNK0_MODEL: /* Can't collide with "chunks" */
-		case CHUNK1_MODEL:
-		case CHUNK2_MODEL:
-			continue;
-		case TANK_MODEL:
-			if (i == s->parent_obj) /* tank can't shoot itself */
+		for (i = 0; i < p->nstats; i++)
+			if (strcmp(p->stats[i].name, j->name) == 0)
+				break;
+		if (i == p->nstats) {
+			if (p->nstats == MAX_JOB_STATS)
 				continue;
-			break;
-		default:
-			break;
+			p->stats[p->nstats++] = (struct job_stats) { .name = j->name };
 		}
-
-		dx = s->x - bzo[i].x;
-		dz = s->z - bzo[i].z;
-		if (dx < 0)
-			dx = -dx;
-		if (dz < 0)
-			dz = -dz;
-		 if (dx < (8 << 8) &&  dz < (8 << 8))
-			return i + 1;
+		p->stats[i].runs++;
+		p->stats[i].busy_us += atomic_load(&j->busy_us);
+		p->stats[i].span_us += j->done_us - j->ready_us;
 	}
-
-	if (s->parent_obj == PLAYER_PARENT_OBJ) /* player can't hit themselves */
-		return 0;
-
-	/* Check if we hit the player */
-	dx = s->x - camera.x;
-	dz = s->z - camera.z;
-	if (dx < 0)
-		dx = -dx;
-	if (dz < 0)
-		dz = -dz;
-	 if (dx < (8 << 8) &&  dz < (8 << 8))
-		return -1;
-	return 0;
 }
 
-static int player_obstacle_collision(int nx, int nz)
+static void run_jobs_serially(struct job_graph *g, int timing)
 {
-	for (int i = 0; i < nbz_objects; i++) {
-		int dx, dz;
-
-		switch (bzo[i].model) {
-		case CHUNK0_MODEL: /* can't collide with "chunks" */
-		case CHUNK1_MODEL:
-		case CHUNK2_MODEL:
-			continue;
-		default:
-			break;
+	for (int k = 0; k < g->njobs; k++) {
+		struct job *j = &g->job[k];
+		uint64_t start = timing ? rtc_get_us_since_boot() : 0;
+
+		if (j->count)
+			j->n = *j->count;
+		trace_begin(j->name);
+		if (j->n > 0)
+			j->fn(j->arg, 0, j->n, 0);
+		trace_end(j->name);
+		if (timing) {
+			j->ready_us = start;
+			j->done_us = rtc_get_us_since_boot();
+			atomic_store(&j->busy_us, j->done_us - start);
 		}
-
-		dx = nx - bzo[i].x;
-		dz = nz - bzo[i].z;
-		if (dx < 0)
-			dx = -dx;
-		if (dz < 0)
-			dz = -dz;
-		 if (dx < (15 << 8) &&  dz < (15 << 8))
-			return 1;
 	}
-	return 0;
 }
 
-static int tank_obstacle_collision(struct bz_object *tank, int nx, int nz)
+/* Runs graph g on pool p, or in order on this thread if p is NULL */
+static void run_jobs(struct worker_pool *p, struct job_graph *g)
 {
-	for (int i = 0; i < nbz_objects; i++) {
-		int dx, dz;
-
-		if (&bzo[i] == tank) /* Can't collide with self */
-			continue;
+	int own = p && !atomic_flag_test_and_set(&p->busy);
+
+	for (int k = 0; k < g->njobs; k++)
+		g->job[k].ndependents = 0;
+	for (int k = 0; k < g->njobs; k++) {
+		struct job *j = &g->job[k];
+		for (int i = 0; i < j->ndeps; i++) {
+			struct job *d = &g->job[j->dep[i]];
+			d->dependent[d->ndependents++] = k;
+		}
+		atomic_store(&j->waiting, j->ndeps);
+		atomic_store(&j->busy_us, 0);
+	}
 
-		switch (bzo[i].model) {
-		case CHUNK0_MODEL: /* can't collide with "chunks" */
-		case CHUNK1_MODEL:
-		case CHUNK2_MODEL:
-			continue;
-		case ARTILLERY_SHELL_MODEL:
-			continue; /* shell_move will get the collision, if any */
-#if DEBUG_MARKERS
-		case NARROW_PYRAMID_MODEL:
-			if (bzo[i].color == RED)
-				continue;
-			break;
-#endif
-		default:
-			break;
+	if (!own || p->nthreads == 1 ||
+		(g->njobs == 1 && !g->job[0].count && g->job[0].n <= g->job[0].chunk)) {
+		run_jobs_serially(g, own && p->timing);
+		if (own) {
+			if (p->timing)
+				record_job_times(p, g);
+			atomic_flag_clear(&p->busy);
 		}
+		return;
+	}
 
-		dx = nx - bzo[i].x;
-		dz = nz - bzo[i].z;
-		if (dx < 0)
-			dx = -dx;
-		if (dz < 0)
-			dz = -dz;
-		 if (dx < (15 << 8) &&  dz < (15 << 8))
-			return 1;
+	atomic_store(&g->left, g->njobs);
+	for (int i = 0; i < p->nthreads; i++) {
+		struct pool_deque *d = &p->deque[i];
+		deque_lock(d);
+		d->head = d->tail = 0;
+		deque_unlock(d);
 	}
-	return 0;
+	pthread_mutex_lock(&p->lock);
+	p->graph = g;
+	p->running = p->nthreads - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int k = 0; k < g->njobs; k++)
+		if (g->job[k].ndeps == 0)
+			release_job(p, g, k, 0);
+	pool_run_jobs(p, g, 0);
+
+	trace_begin("wait for pool");
+	pthread_mutex_lock(&p->lock);
+	while (p->running > 0)
+		pthread_cond_wait(&p->finished, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	trace_end("wait for pool");
+	if (p->timing)
+		record_job_times(p, g);
+	atomic_flag_clear(&p->busy);
 }
 
-static int player_has_been_hit = 0;
-static void fire_gun(void)
+/* Run fn over [0, n) on pool p, or straight through on this thread if p is NULL */
+static void parallel_for(struct worker_pool *p, const char *name, int n, int chunk,
+			parallel_fn fn, void *arg)
 {
+	struct job_graph g = { 0 };
 
-#define SHELL_SPEED 5
-#define SHELL_LIFETIME 100
-#define IDEAL_TARGET_DIST ((SHELL_SPEED * SHELL_LIFETIME * 180) / 256)
-#define TANK_SHOOT_COOLDOWN_TIME_MS (3000)
-
-	int n;
+	add_job(&g, name, fn, arg, n, chunk);
+	run_jobs(p, &g);
+}
 
-	n = add_object(camera.x, camera.y, camera.z, camera.orientation, ARTILLERY_SHELL_MODEL, ORANGE);
-	if (n < 0)
+/* Prints where the time went in the jobs run since timing was switched on,
+ * and how the chunks were shared out.
+ */
+static void job_report(struct worker_pool *p)
+{
+	uint64_t total = 0;
+
+	printf("%-16s %8s %10s %10s %8s\n", "job", "runs", "span us", "busy us", "threads");
+	for (int i = 0; i < p->nstats; i++) {
+		const struct job_stats *s = &p->stats[i];
+		printf("%-16s %8llu %10.2f %10.2f %8.2f\n", s->name, (unsigned long long) s->runs,
+			(double) s->span_us / s->runs, (double) s->busy_us / s->runs,
+			s->span_us ? (double) s->busy_us / s->span_us : 1.0);
+	}
+	for (int i = 0; i < p->nthreads; i++)
+		total += p->deque[i].chunks;
+	if (p->nthreads == 1)
 		return;
-	bzo[n].alive = SHELL_LIFETIME;
-	bzo[n].vx = -SHELL_SPEED * sine(camera.orientation);
-	bzo[n].vz = -SHELL_SPEED * cosine(camera.orientation);
-	bzo[n].vy = 0;
-	bzo[n].parent_obj = PLAYER_PARENT_OBJ;
+	printf("%u steals, %llu chunks, per worker:", atomic_load(&p->steals), (unsigned long long) total);
+	for (int i = 0; i < p->nthreads; i++)
+		printf(" %.1f%%", total ? 100.0 * p->deque[i].chunks / total : 0.0);
+	printf("\n");
 }
 
-static void check_buttons(void)
+/* George Marsaglia's xorshift PRNG algorithm,
+ * see: https://en.wikipedia.org/wiki/Xorshift#Example_implementation */
+/* The state word must be initialized to non-zero */
+unsigned int xorshift(unsigned int *state)
 {
-	if (button_pressed(BUTTON_FIRE)) {
-		keypress_latches &= ~BUTTON_FIRE;
-		fire_gun();
-	}
-	if (button_pressed(BUTTON_LEFT)) {
-		keypress_latches &= ~BUTTON_LEFT;
-		camera.orientation--;
-		if (camera.orientation < 0)
-			camera.orientation = 127;
-	}
-	if (button_pressed(BUTTON_RIGHT)) {
-		camera.orientation++;
-		keypress_latches &= ~BUTTON_RIGHT;
-		if (camera.orientation > 127)
-			camera.orientation = 0;
+	/* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/* Batch random numbers: RNG_LANES independent xorshift streams advanced side
+ * by side in SIMD lanes, used to fill whole arrays at once.  Values are mapped
+ * onto a range with a multiply and shift rather than with %, so no division is
+ * involved.  Output depends only on the seed and on the sequence of fills.
+ */
+typedef uint32_t v4u32 __attribute__((vector_size(16), may_alias));
+#define RNG_LANES 8
+struct bz_rng {
+	uint32_t state[RNG_LANES] SIMD_ALIGN;
+};
+
+/* Program states.  Initial state is BATTLEZONE_INIT */
+enum battlezone_state_t {
+	BATTLEZONE_INIT,
+	BATTLEZONE_RUN,
+	BATTLEZONE_EXIT,
+};
+
+#define GRID_CELL_SHIFT 13 /* 32 units */
+#define GRID_DIM 128
+#define GRID_CELLS (GRID_DIM * GRID_DIM)
+#define GRID_MAX_ITEMS MAX_STATICS
+struct bz_grid {
+	int cell_start[GRID_CELLS + 1];
+	int32_t item[GRID_MAX_ITEMS];
+};
+
+#define AI_MAX_STEPS 8 /* most ticks of movement a tank makes up for in one update */
+#define AI_NEAR_DIST (256 << 8) /* about the range of the radar */
+#define AI_MID_DIST (512 << 8)
+#define AI_FAR_DIST (1024 << 8)
+#define AI_FAR_BUDGET 128 /* distant tank updates per tick */
+
+struct ai_stats {
+	uint64_t updates; /* tank brain updates, all ticks */
+	uint64_t ticks;
+	int max_updates; /* most tank brain updates in one tick */
+};
+
+#define TIMER_WHEEL_SLOTS 256
+#define MAX_TIMERS (MAX_TANKS + MAX_SHELLS) /* each tank or shell has at most one */
+
+enum timer_event {
+	TIMER_SHELL_EXPIRED,
+	TIMER_TANK_WAKE,
+};
+
+struct bz_timer_wheel {
+	int32_t slot[TIMER_WHEEL_SLOTS]; /* first timer in each slot, or -1 */
+	int32_t free; /* first unused timer, or -1 */
+	struct bz_timer {
+		uint32_t expiry;
+		int32_t target; /* index into the table the event applies to */
+		int32_t next, prev; /* neighbours in a slot, or in the free list */
+		unsigned char event; /* enum timer_event */
+	} timer[MAX_TIMERS];
+	int fired; /* timers fired, for the benchmark */
+};
+
+#define NAV_CELL_SHIFT 11 /* 8 units */
+#define NAV_CELL_SIZE (1 << NAV_CELL_SHIFT)
+#define NAV_DIM 128
+#define NAV_CELLS (NAV_DIM * NAV_DIM)
+#define NAV_WORK_PER_TICK 4096
+#define NAV_RECENTER_DIST (NAV_DIM / 4) /* cells the player may stray from the centre */
+#define NAV_UNREACHED 255 /* any heading >= 128 means there is no way on from here */
+#define NAV_BLOCKED 254
+#define NAV_GOAL 253
+
+struct nav_field {
+	int32_t origin_x, origin_z; /* corner of cell (0, 0) */
+	int goal;
+	unsigned char heading[NAV_CELLS];
+};
+
+struct nav_build {
+	int active;
+	int32_t origin_x, origin_z;
+	unsigned int statics_version;
+	int blocked_valid;
+	unsigned char blocked[NAV_CELLS];
+	int32_t queue[NAV_CELLS];
+	int head, tail;
+};
+
+/* The arena is unbounded.  It is divided into square chunks, and obstacles
+ * are generated for each chunk, from the seed and the chunk's coordinates
+ * alone, when the player comes within CHUNK_RADIUS chunks of it.  Chunks
+ * the player has left behind stay loaded until the cache is full, then the
+ * least recently visited one is evicted along with its obstacles, so a chunk
+ * looks the same each time it is visited and memory use does not grow with
+ * the distance travelled.  Chunk (0, 0) holds the arcade map.
+ *
+ * Positions are relative to a local origin which is moved, a whole number
+ * of chunks at a time, whenever the player strays more than REBASE_DIST from
+ * it, so coordinates stay small wherever the player goes.  Chunk coordinates
+ * are global.
+ */
+#define CHUNK_SHIFT 17 /* 512 units, the size of the arcade map */
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_RADIUS 2
+#define MAX_CHUNKS 64 /* must be at least (2 * CHUNK_RADIUS + 1)^2 */
+#define CHUNK_MIN_OBSTACLES 8
+#define CHUNK_MAX_OBSTACLES 20
+#define REBASE_DIST (4 * CHUNK_SIZE)
+#define REBASE_LIMIT (1 << 30) /* anything left this far away is dropped */
+
+struct bz_chunk_cache {
+	int n;
+	int64_t cx[MAX_CHUNKS], cz[MAX_CHUNKS]; /* global chunk coordinates */
+	uint32_t last_used[MAX_CHUNKS]; /* sim_tick when the player was last near */
+	int64_t origin_cx, origin_cz; /* global coordinates of the chunk at the local origin */
+	int64_t player_cx, player_cz; /* chunk the player was in at the last update */
+	int valid; /* player_cx, player_cz are meaningful */
+	int loaded, evicted, rebased; /* counts, for the benchmark */
+};
+
+/* Sounds the simulation makes, for the audio to pick up after the tick (see
+ * queue_sounds()).  They have no effect on the game, so they live outside the
+ * world, where rewinding, snapshots and checksums never see them, and are
+ * dropped once there are more than MAX_SOUND_EVENTS in a tick.
+ */
+#define MAX_SOUND_EVENTS 64
+enum sound_effect {
+	SOUND_GUN,
+	SOUND_EXPLOSION,
+	SOUND_ENGINE,
+	NSOUND_EFFECTS,
+};
+
+struct sound_event {
+	int32_t x, y, z;
+	int effect; /* enum sound_effect */
+};
+
+struct sound_events {
+	int n;
+	struct sound_event e[MAX_SOUND_EVENTS];
+};
+
+/* Everything that makes up one game, so that a process can run any number of
+ * them side by side.  The simulation is handed the world it is to work on
+ * rather than reaching for file scope state.  Models, the map and the lookup
+ * tables are shared by every world and never written once the game is
+ * running.  A world holds no pointers into itself, so it may be copied whole.
+ */
+struct bz_world {
+	enum battlezone_state_t battlezone_state;
+	unsigned int seed;
+	struct worker_pool *pool; /* runs loops in parallel, or NULL to run them serially */
+	struct sound_events *sounds; /* where the last tick's sounds go, or NULL for none */
+	uint32_t sim_tick; /* counts calls to simulate_tick() */
+	uint64_t checksum; /* of the state after the last step_world() */
+	unsigned int xorshift_state;
+	struct bz_rng particle_rng;
+	int enemy_tank_count; /* how many enemy tanks to keep in the arena */
+	int respawn_ticks; /* between bringing in replacement tanks, 0 for at once */
+	int tank_cooldown_ticks; /* between a tank's shots, 0 for TANK_SHOOT_COOLDOWN_TICKS */
+	int explosions_per_second; /* set off at random around the anchor */
+	int no_terrain; /* chunks are left empty, the scenario places everything */
+	uint32_t last_respawn_tick;
+	int explosion_credit; /* explosions owed, times TICKS_PER_SECOND */
+	int32_t next_tank_id, next_shell_id;
+	int nplayers; /* player slots ever used, active or not */
+	struct bz_player player[MAX_PLAYERS];
+	int view_player; /* whose eyes draw_screen() looks through */
+	int mountain[128];
+
+	struct bz_static_table statics;
+	struct bz_tank_table tanks;
+	struct bz_shell_table shells;
+	struct bz_spark_pool sparks;
+	struct bz_debris_pool debris;
+	struct bz_timer_wheel timers;
+
+	struct bz_grid static_grid;
+	int static_grid_dirty;
+	unsigned int statics_version; /* bumped whenever obstacles change */
+	uint64_t statics_checksum; /* see statics_checksum() */
+	unsigned int statics_checksum_version;
+	struct bz_chunk_cache chunks;
+	struct bz_grid tank_grid;
+	int32_t tank_snapshot_x[MAX_TANKS], tank_snapshot_z[MAX_TANKS];
+	int tank_snapshot_count;
+
+	struct nav_field nav_field[2];
+	int nav_front; /* the complete field which tanks follow */
+	int nav_ready; /* set once the first field is complete */
+	struct nav_build nav_build;
+
+	int32_t awake[MAX_TANKS]; /* tanks not asleep, in no particular order */
+	int nawake;
+	unsigned char ai_period[MAX_TANKS]; /* of awake[i] */
+	int32_t ai_due[MAX_TANKS]; /* tanks whose brains run this tick */
+	int ai_due_count;
+	struct ai_stats ai_stats;
+	int32_t ai_fired[MAX_TANKS];
+	struct shell_hit_event shell_hit[MAX_SHELLS];
+	struct bz_worker_scratch serial_scratch; /* for when there is no pool */
+
+};
+
+static void add_sound(struct bz_world *w, int effect, int32_t x, int32_t y, int32_t z)
+{
+	struct sound_events *s = w->sounds;
+
+	if (s && s->n < MAX_SOUND_EVENTS)
+		s->e[s->n++] = (struct sound_event) { x, y, z, effect };
+}
+
+static int button_pressed(struct bz_world *w, int p, int button)
+{
+	return !!(w->player[p].keypress_latches & button);
+}
+
+/* The player the arena is centred on: chunks are streamed, the origin is
+ * moved and the navigation field is built around them.  This is the first
+ * player in the game, or wherever player 0 was if nobody is.
+ */
+static struct camera *anchor_camera(struct bz_world *w)
+{
+	for (int p = 0; p < w->nplayers; p++)
+		if (w->player[p].active)
+			return &w->player[p].camera;
+	return &w->player[0].camera;
+}
+
+/* The player nearest (x, z), for a tank to go after, or the anchor if nobody
+ * is playing.
+ */
+static int nearest_player(const struct bz_world *w, int32_t x, int32_t z)
+{
+	int best = 0;
+	int64_t best_d = INT64_MAX;
+
+	for (int p = 0; p < w->nplayers; p++) {
+		if (!w->player[p].active)
+			continue;
+		int64_t dx = llabs((int64_t) w->player[p].camera.x - x);
+		int64_t dz = llabs((int64_t) w->player[p].camera.z - z);
+		int64_t d = dx > dz ? dx : dz;
+		if (d < best_d) {
+			best_d = d;
+			best = p;
+		}
+	}
+	return best;
+}
+
+static int world_workers(const struct bz_world *w)
+{
+	return w->pool ? w->pool->nthreads : 1;
+}
+
+static struct bz_worker_scratch *worker_scratch(struct bz_world *w, int worker)
+{
+	return w->pool ? &w->pool->scratch[worker] : &w->serial_scratch;
+}
+
+static void rng_seed(struct bz_rng *r, unsigned int seed)
+{
+	if (seed == 0)
+		seed = 0xa5a5a5a5;
+	for (int i = 0; i < RNG_LANES; i++)
+		r->state[i] = xorshift(&seed); /* never zero, as seed is never zero */
+}
+
+/* Fill out[0] through out[n - 1] with values uniformly spread over
+ * [lo, lo + range).  range must be no more than 65536.
+ */
+static void rng_fill_range(struct bz_rng *r, int32_t *out, int n, int32_t lo, uint32_t range)
+{
+	v4u32 s0 = *(v4u32 *) &r->state[0];
+	v4u32 s1 = *(v4u32 *) &r->state[4];
+
+	for (int i = 0; i < n; i += RNG_LANES) {
+		v4i32 v[2];
+
+		s0 ^= s0 << 13;
+		s0 ^= s0 >> 17;
+		s0 ^= s0 << 5;
+		s1 ^= s1 << 13;
+		s1 ^= s1 >> 17;
+		s1 ^= s1 << 5;
+		v[0] = (v4i32) (((s0 >> 16) * range) >> 16) + lo;
+		v[1] = (v4i32) (((s1 >> 16) * range) >> 16) + lo;
+		if (n - i >= RNG_LANES)
+			memcpy(&out[i], v, sizeof(v));
+		else
+			memcpy(&out[i], v, (n - i) * sizeof(out[0]));
+	}
+	*(v4u32 *) &r->state[0] = s0;
+	*(v4u32 *) &r->state[4] = s1;
+}
+
+/* Game angles (orientations and headings) are in units of a 128th of a
+ * turn.  The tables underneath are finer, TRIG_STEPS units to the turn, and
+ * are generated at build time by gen-trig-tables (see the Makefile for how
+ * to change the resolution).  Angles wrap by masking, so any int is a valid
+ * angle and lookups do not branch.
+ */
+#define ANGLE_STEPS 128 /* 1 << 7 */
+#define TRIG_PER_ANGLE (TRIG_STEPS / ANGLE_STEPS)
+
+/* sin(2 * pi * a / TRIG_STEPS) * TRIG_ONE */
+static inline int32_t sine_fine(int a)
+{
+	return trig_sine_table[a & TRIG_MASK];
+}
+
+static inline int32_t cosine_fine(int a)
+{
+	return trig_sine_table[(a + TRIG_STEPS / 4) & TRIG_MASK];
+}
+
+/* sin(2 * pi * a / ANGLE_STEPS) * 256 */
+static inline short sine(int a)
+{
+	return (sine_fine(a * TRIG_PER_ANGLE) + (1 << (TRIG_ONE_SHIFT - 9))) >> (TRIG_ONE_SHIFT - 8);
+}
+
+static inline short cosine(int a)
+{
+	return (cosine_fine(a * TRIG_PER_ANGLE) + (1 << (TRIG_ONE_SHIFT - 9))) >> (TRIG_ONE_SHIFT - 8);
+}
+
+/* atan2(y, x) in TRIG_STEPS units with ATAN_FRAC_SHIFT bits of fraction.
+ * The tangent of the angle's offset within its octant is looked up and
+ * interpolated between entries, then the octant is folded back in.
+ */
+static int64_t arctan2_fixed(int32_t y, int32_t x)
+{
+	uint32_t ax = x < 0 ? -(uint32_t) x : (uint32_t) x;
+	uint32_t ay = y < 0 ? -(uint32_t) y : (uint32_t) y;
+	uint32_t lo = ax < ay ? ax : ay;
+	uint32_t hi = ax < ay ? ay : ax;
+	uint32_t t, i, frac;
+	int64_t angle;
+
+	if (hi == 0)
+		return 0;
+	t = (uint32_t) (((uint64_t) lo << 16) / hi); /* in [0, 1] with 16 bits of fraction */
+	i = t >> (16 - ATAN_SHIFT);
+	frac = t & ((1 << (16 - ATAN_SHIFT)) - 1);
+	angle = trig_atan_table[i];
+	if (frac)
+		angle += ((int64_t) (trig_atan_table[i + 1] - trig_atan_table[i]) * frac) >> (16 - ATAN_SHIFT);
+
+	if (ay > ax)
+		angle = ((int64_t) TRIG_STEPS << (ATAN_FRAC_SHIFT - 2)) - angle;
+	if (x < 0)
+		angle = ((int64_t) TRIG_STEPS << (ATAN_FRAC_SHIFT - 1)) - angle;
+	if (y < 0)
+		angle = -angle;
+	return angle;
+}
+
+/* atan2(y, x) in TRIG_STEPS units, rounded, in [-TRIG_STEPS / 2, TRIG_STEPS / 2] */
+static inline int arctan2_fine(int32_t y, int32_t x)
+{
+	return (int) ((arctan2_fixed(y, x) + (1 << (ATAN_FRAC_SHIFT - 1))) >> ATAN_FRAC_SHIFT);
+}
+
+/* atan2(y, x) as a game angle, rounded, in [-64, 64] */
+static int arctan2(int32_t y, int32_t x)
+{
+	const int shift = ATAN_FRAC_SHIFT + TRIG_SHIFT - 7;
+
+	return (int) ((arctan2_fixed(y, x) + ((int64_t) 1 << (shift - 1))) >> shift);
+}
+
+#ifndef BTSERVER
+/* Points are collected and handed to SDL in batches.  The batch must be
+ * flushed before the draw color changes and before the frame is presented.
+ */
+#define POINT_BATCH_SIZE 4096
+static SDL_Point point_batch[POINT_BATCH_SIZE];
+static int npoint_batch = 0;
+
+static void flush_points(void)
+{
+	if (npoint_batch > 0)
+		SDL_RenderDrawPoints(renderer, point_batch, npoint_batch);
+	npoint_batch = 0;
+}
+
+void Point(int x, int y)
+{
+	if (x >= SCREEN_XDIM)
+		x = SCREEN_XDIM - 1;
+	if (y >= SCREEN_YDIM)
+		y = SCREEN_YDIM - 1;
+	if (npoint_batch >= POINT_BATCH_SIZE)
+		flush_points();
+	point_batch[npoint_batch].x = x;
+	point_batch[npoint_batch].y = y;
+	npoint_batch++;
+}
+
+void HorizontalLine(int x1, int y1, int x2, __attribute__((unused)) int y2)
+{
+	for (int x = x1; x <= x2; x++)
+		Point(x, y1);
+}
+
+void VerticalLine(int x1, int y1, __attribute__((unused)) int x2, int y2)
+{
+	int y;
+
+	for (y = y1; y <= y2; y++)
+		Point(x1, y);
+}
+
+void Line(int x0, int y0, int x1, int y1)
+{
+	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int err = (dx > dy ? dx : -dy)/2, e2;
+
+	for (;;) {
+		Point(x0, y0); /* optimise this: join multiple y==y points into one segments */
+
+		if (x0 == x1 && y0 == y1)
+			break;
+
+		e2 = err;
+		if (e2 > -dx) { err -= dy; x0 += sx; }
+		if (e2 < dy) { err += dx; y0 += sy; }
+	}
+}
+
+/* Draw a line clipped to the display.  At least one of the points must be on the display */
+void ClippedLine(signed short x0, signed short y0, signed short x1, signed short y1)
+{
+	/* If (x0, y0) is offscreen, assume (x1, y1) is onscreen and start drawing with (x1, y1) */
+	if (x0 < 0 || y0 < 0 || x0 >= SCREEN_XDIM || y0 >= SCREEN_YDIM) {
+		/* swap (x0, y0) and (x1, y1) */
+		unsigned short x, y;
+		x = x0;
+		y = y0;
+		x0 = x1;
+		y0 = y1;
+		x1 = x;
+		y1 = y;
+	}
+
+	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int err = (dx > dy ? dx : -dy)/2, e2;
+
+	for (;;) {
+		if (x0 < 0 || y0 < 0 || x0 >= SCREEN_XDIM || y0 >= SCREEN_YDIM)
+			break;
+		Point(x0, y0); /* optimise this: join multiple y==y points into one segments */
+
+		if (x0 == x1 && y0 == y1)
+			break;
+
+		e2 = err;
+		if (e2 > -dx) { err -= dy; x0 += sx; }
+		if (e2 < dy) { err += dx; y0 += sy; }
+	}
+}
+#endif
+
+/* Spawn count sparks at (x, y, z), flying off upwards in random directions */
+static void add_sparks(struct bz_world *w, int x, int y, int z, int count)
+{
+	int n = w->sparks.n;
+
+	if (count > MAX_SPARKS - n)
+		count = MAX_SPARKS - n;
+	rng_fill_range(&w->particle_rng, &w->sparks.vx[n], count, -300, 600);
+	rng_fill_range(&w->particle_rng, &w->sparks.vy[n], count, -599, 600);
+	rng_fill_range(&w->particle_rng, &w->sparks.vz[n], count, -300, 600);
+	rng_fill_range(&w->particle_rng, &w->sparks.expiry[n], count, 50, 30);
+	for (int i = n; i < n + count; i++) {
+		/* This tick counts as the first of its life */
+		w->sparks.expiry[i] = (int32_t) (w->sim_tick - 1 + (uint32_t) w->sparks.expiry[i]);
+		w->sparks.x[i] = x;
+		w->sparks.y[i] = y;
+		w->sparks.z[i] = z;
+	}
+	w->sparks.n += count;
+}
+
+/* Spawn count debris chunks of random shapes at (x, y, z) */
+static void add_debris(struct bz_world *w, int x, int y, int z, int count, uint16_t color)
+{
+	int32_t model[64];
+	int n = w->debris.n;
+
+	if (count > MAX_DEBRIS - n)
+		count = MAX_DEBRIS - n;
+	rng_fill_range(&w->particle_rng, &w->debris.vx[n], count, -300, 600);
+	rng_fill_range(&w->particle_rng, &w->debris.vy[n], count, 0, 600);
+	rng_fill_range(&w->particle_rng, &w->debris.vz[n], count, -300, 600);
+	rng_fill_range(&w->particle_rng, &w->debris.expiry[n], count, 150, 30);
+	for (int i = n; i < n + count; i++) {
+		int m = (i - n) % (int) ARRAYSIZE(model);
+
+		if (m == 0)
+			rng_fill_range(&w->particle_rng, model, ARRAYSIZE(model), CHUNK0_MODEL, 3);
+		w->debris.expiry[i] = (int32_t) (w->sim_tick - 1 + (uint32_t) w->debris.expiry[i]);
+		w->debris.x[i] = x;
+		w->debris.y[i] = y;
+		w->debris.z[i] = z;
+		w->debris.orientation[i] = 0;
+		/* Give each chunk a bit of tumble, varying with which slot it landed in */
+		w->debris.spin[i] = (i % 6) - 3;
+		if (w->debris.spin[i] == 0)
+			w->debris.spin[i] = 1;
+		w->debris.model[i] = model[m];
+		w->debris.color[i] = color;
+	}
+	w->debris.n += count;
+}
+
+/* Particles carry the tick at which they expire rather than a count of ticks
+ * left, so the only per tick work on them is integrating their motion.  A
+ * particle which has to die early has its expiry set to the current tick.
+ */
+static const v4i32 simd_lane = { 0, 1, 2, 3 };
+
+static void move_sparks(struct bz_world *w, int begin, int end)
+{
+	const int32_t t = (int32_t) w->sim_tick;
+	const v4i32 now = { t, t, t, t };
+
+	for (int i = begin; i < end; i += SIMD_WIDTH) {
+		v4i32 *y = (v4i32 *) &w->sparks.y[i];
+		v4i32 *vy = (v4i32 *) &w->sparks.vy[i];
+		v4i32 *expiry = (v4i32 *) &w->sparks.expiry[i];
+		v4i32 live = simd_lane + i < w->sparks.n; /* comparisons yield -1 for true */
+		v4i32 too_high;
+
+		*(v4i32 *) &w->sparks.x[i] += *(v4i32 *) &w->sparks.vx[i] & live;
+		*y += *vy & live;
+		*(v4i32 *) &w->sparks.z[i] += *(v4i32 *) &w->sparks.vz[i] & live;
+		*vy -= SPARK_GRAVITY & live; /* Why subtract here, but add in move_debris()??? */
+		/* this doesn't make sense to me... seems like it should be if y > 0 */
+		too_high = *y > 256 * 20;
+		*expiry = (*expiry & ~too_high) | (now & too_high);
+	}
+}
+
+static void move_debris(struct bz_world *w, int begin, int end)
+{
+	const int32_t t = (int32_t) w->sim_tick;
+	const v4i32 now = { t, t, t, t };
+
+	for (int i = begin; i < end; i += SIMD_WIDTH) {
+		v4i32 *y = (v4i32 *) &w->debris.y[i];
+		v4i32 *vy = (v4i32 *) &w->debris.vy[i];
+		v4i32 *expiry = (v4i32 *) &w->debris.expiry[i];
+		v4i32 *orientation = (v4i32 *) &w->debris.orientation[i];
+		v4i32 live = simd_lane + i < w->debris.n;
+		v4i32 landed;
+
+		*(v4i32 *) &w->debris.x[i] += *(v4i32 *) &w->debris.vx[i] & live;
+		*y += *vy & live;
+		*(v4i32 *) &w->debris.z[i] += *(v4i32 *) &w->debris.vz[i] & live;
+		*vy += SPARK_GRAVITY & live; /* Why add here, but subtract in move_sparks()??? */
+		landed = *y < 0;
+		*expiry = (*expiry & ~landed) | (now & landed);
+		*orientation = (*orientation + (*(v4i32 *) &w->debris.spin[i] & live)) & 127;
+	}
+}
+
+static int particle_expired(struct bz_world *w, int32_t expiry)
+{
+	return (int32_t) ((uint32_t) expiry - w->sim_tick) <= 0;
+}
+
+/* Returns the index of the first particle which has expired, or n if they
+ * are all still alive.  Whole vectors of live particles are skipped.
+ */
+static int find_dead_particle(struct bz_world *w, const int32_t *expiry, int n)
+{
+	const v4u32 now = { w->sim_tick, w->sim_tick, w->sim_tick, w->sim_tick };
+	int i;
+
+	for (i = 0; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		v4i32 left = (v4i32) (*(const v4u32 *) &expiry[i] - now);
+		v4i32 dead = left <= 0;
+		if (dead[0] | dead[1] | dead[2] | dead[3])
+			break;
+	}
+	for (; i < n; i++)
+		if (particle_expired(w, expiry[i]))
+			break;
+	return i;
+}
+
+/* Dead particles are squeezed out in place, preserving the order of the survivors */
+static void remove_dead_sparks(struct bz_world *w)
+{
+	int j = find_dead_particle(w, w->sparks.expiry, w->sparks.n);
+
+	for (int i = j + 1; i < w->sparks.n; i++) {
+		if (particle_expired(w, w->sparks.expiry[i]))
+			continue;
+		w->sparks.x[j] = w->sparks.x[i];
+		w->sparks.y[j] = w->sparks.y[i];
+		w->sparks.z[j] = w->sparks.z[i];
+		w->sparks.vx[j] = w->sparks.vx[i];
+		w->sparks.vy[j] = w->sparks.vy[i];
+		w->sparks.vz[j] = w->sparks.vz[i];
+		w->sparks.expiry[j] = w->sparks.expiry[i];
+		j++;
+	}
+	w->sparks.n = j;
+}
+
+static void remove_dead_debris(struct bz_world *w)
+{
+	int j = find_dead_particle(w, w->debris.expiry, w->debris.n);
+
+	for (int i = j + 1; i < w->debris.n; i++) {
+		if (particle_expired(w, w->debris.expiry[i]))
+			continue;
+		w->debris.x[j] = w->debris.x[i];
+		w->debris.y[j] = w->debris.y[i];
+		w->debris.z[j] = w->debris.z[i];
+		w->debris.vx[j] = w->debris.vx[i];
+		w->debris.vy[j] = w->debris.vy[i];
+		w->debris.vz[j] = w->debris.vz[i];
+		w->debris.expiry[j] = w->debris.expiry[i];
+		w->debris.orientation[j] = w->debris.orientation[i];
+		w->debris.spin[j] = w->debris.spin[i];
+		w->debris.model[j] = w->debris.model[i];
+		w->debris.color[j] = w->debris.color[i];
+		j++;
+	}
+	w->debris.n = j;
+}
+
+static void move_sparks_range(void *arg, int begin, int end, UNUSED int worker)
+{
+	move_sparks(arg, begin, end);
+}
+
+static void move_debris_range(void *arg, int begin, int end, UNUSED int worker)
+{
+	move_debris(arg, begin, end);
+}
+
+static void remove_dead_sparks_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	remove_dead_sparks(arg);
+}
+
+static void remove_dead_debris_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	remove_dead_debris(arg);
+}
+
+/* Sparks and debris have nothing to do with each other, so each moves and
+ * is swept up alongside the other.
+ */
+#define PARTICLE_CHUNK 1024 /* a multiple of SIMD_WIDTH */
+static void move_particles(struct bz_world *w)
+{
+	struct job_graph g = { 0 };
+	int sparks, debris;
+
+	sparks = add_job(&g, "move sparks", move_sparks_range, w, w->sparks.n, PARTICLE_CHUNK);
+	debris = add_job(&g, "move debris", move_debris_range, w, w->debris.n, PARTICLE_CHUNK);
+	job_after(&g, add_job(&g, "sweep sparks", remove_dead_sparks_job, w, 1, 1), sparks);
+	job_after(&g, add_job(&g, "sweep debris", remove_dead_debris_job, w, 1, 1), debris);
+	run_jobs(w->pool, &g);
+}
+
+static void fractal_mountain(struct bz_world *w, int start, int middle, int end)
+{
+	int m;
+	if (middle - start > 1) {
+		int d = (abs(w->mountain[middle] - w->mountain[start]) * 30) / 100;
+		if (d > 0)
+			m = ((w->mountain[start] + w->mountain[middle]) / 2) - (d / 2) +
+				(xorshift(&w->xorshift_state) % d);
+		else
+			m = w->mountain[start];
+		int i = (middle - start) / 2 + start;
+		w->mountain[i] = m;
+		fractal_mountain(w, start, i, middle);
+	}
+	if (end - middle > 1) {
+		int d = (abs(w->mountain[end] - w->mountain[middle]) * 30) / 100;
+		if (d > 0)
+			m = ((w->mountain[middle] + w->mountain[end]) / 2) - (d / 2) +
+				(xorshift(&w->xorshift_state) % d);
+		else
+			m = w->mountain[middle];
+		int i = (end - middle) / 2 + middle;
+		w->mountain[i] = m;
+		fractal_mountain(w, middle, i, end);
+	}
+}
+
+static void init_mountains(struct bz_world *w)
+{
+	for (int i = 0; i < 128; i++)
+		w->mountain[i] = SCREEN_YDIM / 2;
+	w->mountain[32] = 20;
+	fractal_mountain(w, 0, 32, 96);
+}
+
+/* Returns true if (x2, z2) lies within dist of (x1, z1) along both axes */
+static inline int within_box(int32_t x1, int32_t z1, int32_t x2, int32_t z2, int32_t dist)
+{
+	int dx = x1 - x2;
+	int dz = z1 - z2;
+
+	if (dx < 0)
+		dx = -dx;
+	if (dz < 0)
+		dz = -dz;
+	return dx < dist && dz < dist;
+}
+
+/* Uniform grid for finding what is near a point without looking at
+ * everything.  Cell coordinates wrap around, so any position maps to some
+ * cell, and items from far away which share a cell are weeded out by the
+ * exact test.  Items are stored sorted by cell, and by index within a cell,
+ * so queries visit them in a repeatable order.
+ */
+static inline int grid_cell(int cx, int cz)
+{
+	return (cz & (GRID_DIM - 1)) * GRID_DIM + (cx & (GRID_DIM - 1));
+}
+
+static void grid_build(struct bz_grid *g, const int32_t *x, const int32_t *z, int n)
+{
+	memset(g->cell_start, 0, sizeof(g->cell_start));
+	for (int i = 0; i < n; i++)
+		g->cell_start[grid_cell(x[i] >> GRID_CELL_SHIFT, z[i] >> GRID_CELL_SHIFT) + 1]++;
+	for (int c = 0; c < GRID_CELLS; c++)
+		g->cell_start[c + 1] += g->cell_start[c];
+	/* Fill in using cell_start[c] as a cursor, leaving it at the start of c + 1 */
+	for (int i = 0; i < n; i++)
+		g->item[g->cell_start[grid_cell(x[i] >> GRID_CELL_SHIFT, z[i] >> GRID_CELL_SHIFT)]++] = i;
+	for (int c = GRID_CELLS; c > 0; c--)
+		g->cell_start[c] = g->cell_start[c - 1];
+	g->cell_start[0] = 0;
+}
+
+typedef int (*grid_filter_fn)(int i, const void *cookie);
+
+/* Returns the first item within dist of (px, pz) along both axes, going by the
+ * positions in x[] and z[], for which accept() is true, or -1 if there is none.
+ * slop widens the search for items which have moved since the grid was built.
+ */
+static int grid_find(const struct bz_grid *g, const int32_t *x, const int32_t *z,
+			int32_t px, int32_t pz, int32_t dist, int32_t slop,
+			grid_filter_fn accept, const void *cookie)
+{
+	int cx0 = (px - dist - slop) >> GRID_CELL_SHIFT;
+	int cx1 = (px + dist + slop) >> GRID_CELL_SHIFT;
+	int cz0 = (pz - dist - slop) >> GRID_CELL_SHIFT;
+	int cz1 = (pz + dist + slop) >> GRID_CELL_SHIFT;
+
+	if (cx1 - cx0 >= GRID_DIM)
+		cx1 = cx0 + GRID_DIM - 1;
+	if (cz1 - cz0 >= GRID_DIM)
+		cz1 = cz0 + GRID_DIM - 1;
+	for (int cz = cz0; cz <= cz1; cz++) {
+		for (int cx = cx0; cx <= cx1; cx++) {
+			int c = grid_cell(cx, cz);
+			for (int k = g->cell_start[c]; k < g->cell_start[c + 1]; k++) {
+				int i = g->item[k];
+				if (!within_box(px, pz, x[i], z[i], dist))
+					continue;
+				if (accept && !accept(i, cookie))
+					continue;
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+/* Obstacles rarely change, so their grid is rebuilt only when they do */
+static void update_static_grid(struct bz_world *w)
+{
+	if (!w->static_grid_dirty)
+		return;
+	grid_build(&w->static_grid, w->statics.x, w->statics.z, w->statics.n);
+	w->static_grid_dirty = 0;
+}
+
+/* Tanks are gridded at the start of each tick, using a snapshot of their
+ * positions.  Tank AI tests against the snapshot, so each tank's decisions
+ * depend only on the state at the start of the tick and not on which other
+ * tanks have already moved.
+ */
+#define TANK_GRID_SLOP ((AI_MAX_STEPS + 1) << 8) /* tanks move less than this per tick */
+
+static void snapshot_tanks(struct bz_world *w)
+{
+	memcpy(w->tank_snapshot_x, w->tanks.x, sizeof(w->tanks.x[0]) * w->tanks.n);
+	memcpy(w->tank_snapshot_z, w->tanks.z, sizeof(w->tanks.z[0]) * w->tanks.n);
+	w->tank_snapshot_count = w->tanks.n;
+	grid_build(&w->tank_grid, w->tank_snapshot_x, w->tank_snapshot_z, w->tanks.n);
+}
+
+static int add_static(struct bz_world *w, int x, int y, int z, int orientation,
+			uint8_t model, uint16_t color)
+{
+	int n = w->statics.n;
+
+	if (n >= MAX_STATICS)
+		return -1;
+	w->statics.x[n] = x;
+	w->statics.y[n] = y;
+	w->statics.z[n] = z;
+	w->statics.orientation[n] = orientation;
+	w->statics.model[n] = model;
+	w->statics.color[n] = color;
+	w->statics.chunk[n] = -1;
+	w->statics.n++;
+	w->static_grid_dirty = 1;
+	w->statics_version++;
+	return n;
+}
+
+/* Shell lifetimes and tank cooldowns are kept in a hashed timer wheel keyed
+ * on sim_tick, rather than being counted down on every object every tick.  A
+ * timer sits in the slot for its expiry tick modulo TIMER_WHEEL_SLOTS, and
+ * each tick only that one slot is walked, passing over any timers due on a
+ * later turn of the wheel.  Timers refer to their object by table index and
+ * each object knows its timer, so that remove_tank() and remove_shell() can
+ * cancel the timer of the object going away and re-point the timer of the
+ * one moved into its place.
+ */
+static void init_timers(struct bz_world *w)
+{
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		w->timers.slot[i] = -1;
+	for (int i = 0; i < MAX_TIMERS; i++)
+		w->timers.timer[i].next = i + 1 < MAX_TIMERS ? i + 1 : -1;
+	w->timers.free = 0;
+}
+
+/* Returns the new timer, or -1 if there are none left */
+static int add_timer(struct bz_world *w, uint32_t expiry, enum timer_event event, int target)
+{
+	int n = w->timers.free;
+	int32_t *slot;
+
+	if (n < 0)
+		return -1;
+	if ((int32_t) (expiry - w->sim_tick) <= 0)
+		expiry = w->sim_tick + 1; /* This tick's slot has already been run */
+	w->timers.free = w->timers.timer[n].next;
+
+	slot = &w->timers.slot[expiry % TIMER_WHEEL_SLOTS];
+	w->timers.timer[n].expiry = expiry;
+	w->timers.timer[n].event = event;
+	w->timers.timer[n].target = target;
+	w->timers.timer[n].prev = -1;
+	w->timers.timer[n].next = *slot;
+	if (*slot >= 0)
+		w->timers.timer[*slot].prev = n;
+	*slot = n;
+	return n;
+}
+
+static void unlink_timer(struct bz_world *w, int n)
+{
+	struct bz_timer *t = &w->timers.timer[n];
+
+	if (t->prev >= 0)
+		w->timers.timer[t->prev].next = t->next;
+	else
+		w->timers.slot[t->expiry % TIMER_WHEEL_SLOTS] = t->next;
+	if (t->next >= 0)
+		w->timers.timer[t->next].prev = t->prev;
+	t->next = w->timers.free;
+	w->timers.free = n;
+}
+
+static void cancel_timer(struct bz_world *w, int32_t *timer)
+{
+	if (*timer < 0)
+		return;
+	unlink_timer(w, *timer);
+	*timer = -1;
+}
+
+/* Only tanks on the awake list are considered by the AI scheduler, so a
+ * sleeping tank costs nothing until the timer wheel wakes it.
+ */
+static void wake_tank(struct bz_world *w, int t)
+{
+	w->tanks.awake_slot[t] = w->nawake;
+	w->awake[w->nawake++] = t;
+}
+
+static void sleep_tank(struct bz_world *w, int t)
+{
+	int slot = w->tanks.awake_slot[t];
+	int last = w->awake[--w->nawake];
+
+	w->awake[slot] = last;
+	w->tanks.awake_slot[last] = slot;
+	w->tanks.awake_slot[t] = -1;
+}
+
+static void fire_timer(struct bz_world *w, enum timer_event event, int target)
+{
+	switch (event) {
+	case TIMER_SHELL_EXPIRED:
+		w->shells.timer[target] = -1;
+		w->shells.alive[target] = 0;
+		break;
+	case TIMER_TANK_WAKE:
+		w->tanks.timer[target] = -1;
+		wake_tank(w, target);
+		break;
+	}
+}
+
+/* Fire the timers due this tick */
+static void run_timers(struct bz_world *w)
+{
+	int n = w->timers.slot[w->sim_tick % TIMER_WHEEL_SLOTS];
+
+	while (n >= 0) {
+		struct bz_timer *t = &w->timers.timer[n];
+		int next = t->next;
+
+		if ((int32_t) (t->expiry - w->sim_tick) <= 0) {
+			unlink_timer(w, n);
+			fire_timer(w, t->event, t->target);
+			w->timers.fired++;
+		}
+		n = next;
+	}
+}
+
+static int add_tank(struct bz_world *w, int x, int y, int z, int orientation)
+{
+	int n = w->tanks.n;
+
+	if (n >= MAX_TANKS)
+		return -1;
+	w->tanks.x[n] = x;
+	w->tanks.y[n] = y;
+	w->tanks.z[n] = z;
+	w->tanks.orientation[n] = orientation;
+	w->tanks.alive[n] = 1;
+	w->tanks.id[n] = w->next_tank_id++;
+	w->tanks.resume[n] = 0;
+	w->tanks.counter[n] = 0;
+	w->tanks.wake_tick[n] = w->sim_tick;
+	w->tanks.ai_tick[n] = w->sim_tick;
+	w->tanks.timer[n] = -1;
+	w->tanks.color[n] = TANK_COLOR;
+	wake_tank(w, n);
+	w->tanks.n++;
+	return n;
+}
+
+static int add_shell(struct bz_world *w, int x, int y, int z, int orientation, int parent, int lifetime)
+{
+	int n = w->shells.n;
+
+	if (n >= MAX_SHELLS)
+		return -1;
+	w->shells.x[n] = x;
+	w->shells.y[n] = y;
+	w->shells.z[n] = z;
+	w->shells.orientation[n] = orientation;
+	w->shells.parent[n] = parent;
+	w->shells.vx[n] = 0;
+	w->shells.vz[n] = 0;
+	w->shells.alive[n] = 1;
+	w->shells.id[n] = w->next_shell_id++;
+	w->shells.timer[n] = add_timer(w, w->sim_tick + lifetime, TIMER_SHELL_EXPIRED, n);
+	w->shells.n++;
+	return n;
+}
+
+static void remove_tank(struct bz_world *w, int n)
+{
+	int last = w->tanks.n - 1;
+
+	cancel_timer(w, &w->tanks.timer[n]);
+	if (w->tanks.awake_slot[n] >= 0)
+		sleep_tank(w, n);
+	if (n < last) {
+		w->tanks.x[n] = w->tanks.x[last];
+		w->tanks.y[n] = w->tanks.y[last];
+		w->tanks.z[n] = w->tanks.z[last];
+		w->tanks.orientation[n] = w->tanks.orientation[last];
+		w->tanks.alive[n] = w->tanks.alive[last];
+		w->tanks.id[n] = w->tanks.id[last];
+		w->tanks.resume[n] = w->tanks.resume[last];
+		w->tanks.counter[n] = w->tanks.counter[last];
+		w->tanks.wake_tick[n] = w->tanks.wake_tick[last];
+		w->tanks.ai_tick[n] = w->tanks.ai_tick[last];
+		w->tanks.timer[n] = w->tanks.timer[last];
+		if (w->tanks.timer[n] >= 0)
+			w->timers.timer[w->tanks.timer[n]].target = n;
+		w->tanks.color[n] = w->tanks.color[last];
+		w->tanks.awake_slot[n] = w->tanks.awake_slot[last];
+		if (w->tanks.awake_slot[n] >= 0)
+			w->awake[w->tanks.awake_slot[n]] = n;
+	}
+	w->tanks.n--;
+}
+
+static void remove_shell(struct bz_world *w, int n)
+{
+	int last = w->shells.n - 1;
+
+	cancel_timer(w, &w->shells.timer[n]);
+	if (n < last) {
+		w->shells.x[n] = w->shells.x[last];
+		w->shells.y[n] = w->shells.y[last];
+		w->shells.z[n] = w->shells.z[last];
+		w->shells.vx[n] = w->shells.vx[last];
+		w->shells.vz[n] = w->shells.vz[last];
+		w->shells.alive[n] = w->shells.alive[last];
+		w->shells.timer[n] = w->shells.timer[last];
+		if (w->shells.timer[n] >= 0)
+			w->timers.timer[w->shells.timer[n]].target = n;
+		w->shells.parent[n] = w->shells.parent[last];
+		w->shells.id[n] = w->shells.id[last];
+		w->shells.orientation[n] = w->shells.orientation[last];
+	}
+	w->shells.n--;
+}
+
+static void prescale_models(void)
+{
+	static int already_scaled = 0;
+
+	if (already_scaled)
+		return;
+	already_scaled = 1;
+
+	for (int i = 0; i < nmodels; i++) {
+		for (int j = 0; j < bz_model[i]->nvertices; j++) {
+			bz_model[i]->vert[j].x *= bz_model[i]->prescale_numerator;
+			bz_model[i]->vert[j].y *= bz_model[i]->prescale_numerator;
+			bz_model[i]->vert[j].z *= bz_model[i]->prescale_numerator;
+			bz_model[i]->vert[j].x /= bz_model[i]->prescale_denominator;
+			bz_model[i]->vert[j].y /= bz_model[i]->prescale_denominator;
+			bz_model[i]->vert[j].z /= bz_model[i]->prescale_denominator;
+		}
+	}
+}
+
+static void remove_static(struct bz_world *w, int n)
+{
+	int last = w->statics.n - 1;
+
+	if (n < last) {
+		w->statics.x[n] = w->statics.x[last];
+		w->statics.y[n] = w->statics.y[last];
+		w->statics.z[n] = w->statics.z[last];
+		w->statics.orientation[n] = w->statics.orientation[last];
+		w->statics.color[n] = w->statics.color[last];
+		w->statics.model[n] = w->statics.model[last];
+		w->statics.chunk[n] = w->statics.chunk[last];
+	}
+	w->statics.n--;
+	w->static_grid_dirty = 1;
+	w->statics_version++;
+}
+
+/* Chunk containing the local position x (or z).  Chunks are centred on
+ * multiples of CHUNK_SIZE so that the arcade map fits in chunk 0.
+ */
+static inline int32_t chunk_of(int32_t x)
+{
+	return (x + CHUNK_SIZE / 2) >> CHUNK_SHIFT;
+}
+
+static void generate_chunk(struct bz_world *w, int slot)
+{
+	struct bz_chunk_cache *cc = &w->chunks;
+	int32_t base_x = (int32_t) (cc->cx[slot] - cc->origin_cx) * CHUNK_SIZE;
+	int32_t base_z = (int32_t) (cc->cz[slot] - cc->origin_cz) * CHUNK_SIZE;
+	int n, count;
+
+	if (w->no_terrain)
+		return;
+	if (cc->cx[slot] == 0 && cc->cz[slot] == 0) {
+		for (size_t i = 0; i < ARRAYSIZE(battlezone_map); i++) {
+			const struct bz_map_entry *m = &battlezone_map[i];
+			n = add_static(w, base_x + (m->x - 128) * 512, 0, base_z + (m->z - 128) * 512,
+					0, m->type, OBSTACLE_COLOR);
+			if (n >= 0)
+				w->statics.chunk[n] = slot;
+		}
+		return;
+	}
+
+	/* Mix the seed and the chunk coordinates into a starting state */
+	uint64_t h = w->seed * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (uint64_t) cc->cx[slot]) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (uint64_t) cc->cz[slot]) * 0x94d049bb133111ebULL;
+	unsigned int state = (unsigned int) (h ^ (h >> 32)) | 1;
+
+	count = CHUNK_MIN_OBSTACLES + xorshift(&state) % (CHUNK_MAX_OBSTACLES - CHUNK_MIN_OBSTACLES + 1);
+	for (int i = 0; i < count; i++) {
+		int32_t x = base_x + ((int) (xorshift(&state) % 256) - 128) * 512;
+		int32_t z = base_z + ((int) (xorshift(&state) % 256) - 128) * 512;
+		int type = xorshift(&state) % 4;
+		if (within_box(x, z, anchor_camera(w)->x, anchor_camera(w)->z, 20 << 8))
+			continue; /* never drop one on the player */
+		n = add_static(w, x, 0, z, 0, type, OBSTACLE_COLOR);
+		if (n >= 0)
+			w->statics.chunk[n] = slot;
+	}
+}
+
+static void evict_chunk(struct bz_world *w, int slot)
+{
+	struct bz_chunk_cache *cc = &w->chunks;
+	int last = cc->n - 1;
+
+	for (int i = 0; i < w->statics.n;) {
+		if (w->statics.chunk[i] == slot)
+			remove_static(w, i);
+		else
+			i++;
+	}
+	if (slot < last) {
+		cc->cx[slot] = cc->cx[last];
+		cc->cz[slot] = cc->cz[last];
+		cc->last_used[slot] = cc->last_used[last];
+		for (int i = 0; i < w->statics.n; i++)
+			if (w->statics.chunk[i] == last)
+				w->statics.chunk[i] = slot;
+	}
+	cc->n--;
+	cc->evicted++;
+}
+
+static void load_chunk(struct bz_world *w, int64_t cx, int64_t cz)
+{
+	struct bz_chunk_cache *cc = &w->chunks;
+
+	if (cc->n == MAX_CHUNKS) {
+		int lru = -1;
+		for (int i = 0; i < cc->n; i++) {
+			if (cc->last_used[i] == w->sim_tick)
+				continue; /* in use around the player */
+			if (lru < 0 || cc->last_used[i] < cc->last_used[lru])
+				lru = i;
+		}
+		evict_chunk(w, lru);
+	}
+	cc->cx[cc->n] = cx;
+	cc->cz[cc->n] = cz;
+	cc->last_used[cc->n] = w->sim_tick;
+	cc->n++;
+	cc->loaded++;
+	generate_chunk(w, cc->n - 1);
+}
+
+static inline int beyond_rebase_limit(int32_t x, int32_t z, int32_t dx, int32_t dz)
+{
+	return llabs((int64_t) x - dx) > REBASE_LIMIT || llabs((int64_t) z - dz) > REBASE_LIMIT;
+}
+
+/* Move the local origin by (cx, cz) chunks, dropping anything which would
+ * then be so far away that its coordinates could overflow.
+ */
+static void shift_origin(struct bz_world *w, int32_t cx, int32_t cz)
+{
+	int32_t dx = cx * CHUNK_SIZE;
+	int32_t dz = cz * CHUNK_SIZE;
+
+	w->chunks.origin_cx += cx;
+	w->chunks.origin_cz += cz;
+	w->chunks.rebased++;
+	for (int p = 0; p < w->nplayers; p++) {
+		w->player[p].camera.x -= dx;
+		w->player[p].camera.z -= dz;
+	}
+	for (int i = 0; i < w->statics.n;) {
+		if (w->statics.chunk[i] < 0 &&
+			beyond_rebase_limit(w->statics.x[i], w->statics.z[i], dx, dz)) {
+			remove_static(w, i);
+			continue;
+		}
+		w->statics.x[i] -= dx;
+		w->statics.z[i] -= dz;
+		i++;
+	}
+	w->static_grid_dirty = 1;
+	w->statics_version++;
+	for (int i = 0; i < w->tanks.n;) {
+		if (beyond_rebase_limit(w->tanks.x[i], w->tanks.z[i], dx, dz)) {
+			remove_tank(w, i);
+			continue;
+		}
+		w->tanks.x[i] -= dx;
+		w->tanks.z[i] -= dz;
+		i++;
+	}
+	for (int i = 0; i < w->shells.n; i++) {
+		w->shells.x[i] -= dx;
+		w->shells.z[i] -= dz;
+	}
+	for (int i = 0; i < w->sparks.n; i++) {
+		w->sparks.x[i] -= dx;
+		w->sparks.z[i] -= dz;
+	}
+	for (int i = 0; i < w->debris.n; i++) {
+		w->debris.x[i] -= dx;
+		w->debris.z[i] -= dz;
+	}
+	/* Whole chunks are whole nav cells, so the fields just move along */
+	for (int i = 0; i < 2; i++) {
+		w->nav_field[i].origin_x -= dx;
+		w->nav_field[i].origin_z -= dz;
+	}
+	w->nav_build.origin_x -= dx;
+	w->nav_build.origin_z -= dz;
+}
+
+/* Move the local origin to the chunk the player is in */
+static void rebase_world(struct bz_world *w)
+{
+	shift_origin(w, chunk_of(anchor_camera(w)->x), chunk_of(anchor_camera(w)->z));
+}
+
+/* Load the chunks around the player, evicting old ones as needed */
+static void stream_chunks(struct bz_world *w)
+{
+	struct bz_chunk_cache *cc = &w->chunks;
+
+	if (abs(anchor_camera(w)->x) > REBASE_DIST || abs(anchor_camera(w)->z) > REBASE_DIST)
+		rebase_world(w);
+
+	int64_t pcx = cc->origin_cx + chunk_of(anchor_camera(w)->x);
+	int64_t pcz = cc->origin_cz + chunk_of(anchor_camera(w)->z);
+
+	if (cc->valid && pcx == cc->player_cx && pcz == cc->player_cz)
+		return;
+	cc->player_cx = pcx;
+	cc->player_cz = pcz;
+	cc->valid = 1;
+
+	/* Mark what is already loaded first, so none of it gets evicted */
+	for (int i = 0; i < cc->n; i++)
+		if (llabs(cc->cx[i] - pcx) <= CHUNK_RADIUS && llabs(cc->cz[i] - pcz) <= CHUNK_RADIUS)
+			cc->last_used[i] = w->sim_tick;
+	for (int64_t cz = pcz - CHUNK_RADIUS; cz <= pcz + CHUNK_RADIUS; cz++) {
+		for (int64_t cx = pcx - CHUNK_RADIUS; cx <= pcx + CHUNK_RADIUS; cx++) {
+			int i;
+			for (i = 0; i < cc->n; i++)
+				if (cc->cx[i] == cx && cc->cz[i] == cz)
+					break;
+			if (i == cc->n)
+				load_chunk(w, cx, cz);
+		}
+	}
+}
+
+/* Scenario files are text, one setting or object to a line, and # starts a
+ * comment:
+ *
+ *	tanks n			enemy tanks to keep in the arena
+ *	respawn ticks		between bringing in replacements, 0 for at once
+ *	tank-cooldown ticks	between a tank's shots, 1 for continuous fire
+ *	explosions n		per second, at random around the player
+ *	terrain procedural|none	whether chunks are filled with obstacles
+ *	obstacle model x z [orientation]
+ *	tank x z [orientation]
+ *
+ * where model is cube, short-cube, pyramid or narrow-pyramid, and x and z
+ * are in units of 256 (an arcade map is 512 units across) from the centre
+ * of the arcade map.  Anything not set is as in the arcade game.
+ */
+#define SCENARIO_MAX_OBSTACLES (MAX_STATICS - MAX_CHUNKS * CHUNK_MAX_OBSTACLES) /* leaving room for chunks */
+static const char *scenario_models[] = { "cube", "short-cube", "pyramid", "narrow-pyramid" };
+
+static int add_scenario_object(struct scenario_object **list, int *n, const struct scenario_object *o)
+{
+	if ((*n & (*n - 1)) == 0) { /* at each power of two */
+		struct scenario_object *bigger = realloc(*list, sizeof(**list) * (*n ? *n * 2 : 16));
+		if (!bigger)
+			return -1;
+		*list = bigger;
+	}
+	(*list)[(*n)++] = *o;
+	return 0;
+}
+
+static void free_scenario(struct scenario *s)
+{
+	if (!s)
+		return;
+	free(s->obstacle);
+	free(s->tank);
+	free(s);
+}
+
+static struct scenario *load_scenario(const char *path)
+{
+	struct scenario *s = calloc(1, sizeof(*s));
+	char line[256], word[32], arg[32];
+	int lineno = 0;
+	FILE *f;
+
+	if (!s) {
+		fprintf(stderr, "Out of memory loading %s\n", path);
+		return NULL;
+	}
+	s->tanks = -1;
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		free(s);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct scenario_object o = { 0 };
+		char *hash = strchr(line, '#');
+		int n, ok = 1;
+
+		lineno++;
+		if (hash)
+			*hash = '\0';
+		if (sscanf(line, "%31s", word) != 1)
+			continue; /* blank */
+		if (strcmp(word, "tanks") == 0)
+			ok = sscanf(line, "%*s %d", &s->tanks) == 1 && s->tanks >= 0 && s->tanks <= MAX_TANKS;
+		else if (strcmp(word, "respawn") == 0)
+			ok = sscanf(line, "%*s %d", &s->respawn_ticks) == 1 && s->respawn_ticks >= 0;
+		else if (strcmp(word, "tank-cooldown") == 0)
+			ok = sscanf(line, "%*s %d", &s->tank_cooldown_ticks) == 1 && s->tank_cooldown_ticks >= 1;
+		else if (strcmp(word, "explosions") == 0)
+			ok = sscanf(line, "%*s %d", &s->explosions_per_second) == 1 &&
+				s->explosions_per_second >= 0 && s->explosions_per_second <= 1000;
+		else if (strcmp(word, "terrain") == 0) {
+			ok = sscanf(line, "%*s %31s", arg) == 1;
+			if (ok && strcmp(arg, "none") == 0)
+				s->no_terrain = 1;
+			else if (ok && strcmp(arg, "procedural") == 0)
+				s->no_terrain = 0;
+			else
+				ok = 0;
+		} else if (strcmp(word, "obstacle") == 0) {
+			n = sscanf(line, "%*s %31s %d %d %d", arg, &o.x, &o.z, &o.orientation);
+			ok = n >= 3;
+			for (o.model = 0; ok && o.model < (int) ARRAYSIZE(scenario_models); o.model++)
+				if (strcmp(arg, scenario_models[o.model]) == 0)
+					break;
+			ok = ok && o.model < (int) ARRAYSIZE(scenario_models) &&
+				add_scenario_object(&s->obstacle, &s->nobstacles, &o) == 0;
+		} else if (strcmp(word, "tank") == 0) {
+			n = sscanf(line, "%*s %d %d %d", &o.x, &o.z, &o.orientation);
+			ok = n >= 2 && add_scenario_object(&s->tank, &s->ntanks, &o) == 0;
+		} else {
+			ok = 0;
+		}
+		if (!ok || abs(o.x) > 1000000 || abs(o.z) > 1000000) {
+			fprintf(stderr, "%s:%d: cannot make sense of: %s", path, lineno, line);
+			fclose(f);
+			free_scenario(s);
+			return NULL;
+		}
+	}
+	fclose(f);
+	if (s->nobstacles > SCENARIO_MAX_OBSTACLES || s->ntanks > MAX_TANKS) {
+		fprintf(stderr, "%s: at most %d obstacles and %d tanks\n", path, SCENARIO_MAX_OBSTACLES, MAX_TANKS);
+		free_scenario(s);
+		return NULL;
+	}
+	return s;
+}
+
+static void add_initial_objects(struct bz_world *w)
+{
+	const struct scenario *s = scenario;
+
+	if (s) {
+		if (s->tanks >= 0)
+			w->enemy_tank_count = s->tanks;
+		w->respawn_ticks = s->respawn_ticks;
+		w->tank_cooldown_ticks = s->tank_cooldown_ticks;
+		w->explosions_per_second = s->explosions_per_second;
+		w->no_terrain = s->no_terrain;
+	}
+	memset(&w->chunks, 0, sizeof(w->chunks));
+	stream_chunks(w);
+	if (!s) {
+		add_tank(w, 0, 0, -100 * 256, 0);
+		return;
+	}
+	for (int i = 0; i < s->nobstacles; i++) {
+		const struct scenario_object *o = &s->obstacle[i];
+		add_static(w, o->x * 256, 0, o->z * 256, o->orientation & 127, o->model, OBSTACLE_COLOR);
+	}
+	for (int i = 0; i < s->ntanks; i++) {
+		const struct scenario_object *o = &s->tank[i];
+		add_tank(w, o->x * 256, 0, o->z * 256, o->orientation & 127);
+	}
+}
+
+/* Puts a player into free slot p at (x, z), facing orientation */
+static void add_player(struct bz_world *w, int p, int32_t x, int32_t z)
+{
+	struct bz_player *pl = &w->player[p];
+
+	memset(pl, 0, sizeof(*pl));
+	pl->camera.x = x;
+	pl->camera.y = CAMERA_GROUND_LEVEL;
+	pl->camera.z = z;
+	pl->camera.eyedist = (2 * SCREEN_XDIM / 3) * 256;
+	pl->active = 1;
+	if (p >= w->nplayers)
+		w->nplayers = p + 1;
+}
+
+static void battlezone_init(struct bz_world *w)
+{
+	if (w->xorshift_state == 0) {
+		w->xorshift_state = w->seed ? w->seed : 0xa5a5a5a5;
+		rng_seed(&w->particle_rng, w->seed);
+		init_mountains(w);
+	}
+
+	w->statics.n = 0;
+	w->static_grid_dirty = 1;
+	w->statics_version++;
+	w->tanks.n = 0;
+	w->nawake = 0;
+	w->shells.n = 0;
+	w->sparks.n = 0;
+	w->debris.n = 0;
+	init_timers(w);
+
+	memset(w->player, 0, sizeof(w->player));
+	w->nplayers = 0;
+	add_player(w, 0, 0, 0);
+
+	add_initial_objects(w);
+
+	w->battlezone_state = BATTLEZONE_RUN;
+}
+
+/* Returns a new world, not yet initialized (see battlezone_init()), which runs
+ * its loops on pool, or serially if pool is NULL.
+ */
+static struct bz_world *create_world(struct worker_pool *pool, unsigned int seed, int ntanks)
+{
+	struct bz_world *w = calloc(1, sizeof(*w));
+
+	if (!w) {
+		fprintf(stderr, "Out of memory allocating a world\n");
+		return NULL;
+	}
+	w->battlezone_state = BATTLEZONE_INIT;
+	w->pool = pool;
+	w->seed = seed;
+	w->enemy_tank_count = ntanks;
+	return w;
+}
+
+static void bump_player(struct bz_world *w, int p)
+{
+	w->player[p].camera.y = CAMERA_GROUND_LEVEL + (4 * 256);
+}
+
+enum shell_hit {
+	SHELL_HIT_NOTHING,
+	SHELL_HIT_OBSTACLE,
+	SHELL_HIT_TANK,
+	SHELL_HIT_PLAYER,
+};
+
+struct shell_parent {
+	const struct bz_world *w;
+	int32_t parent;
+};
+
+static int not_shell_parent(int i, const void *cookie)
+{
+	const struct shell_parent *sp = cookie;
+
+	return sp->w->tanks.id[i] != sp->parent; /* tank can't shoot itself */
+}
+
+/* Returns what shell s has hit, if anything, and the index of the
+ * obstacle, tank or player that was hit in *target.
+ */
+static enum shell_hit shell_collision(struct bz_world *w, int s, int *target)
+{
+	const int32_t sx = w->shells.x[s];
+	const int32_t sz = w->shells.z[s];
+	const struct shell_parent sp = { w, w->shells.parent[s] };
+
+	*target = grid_find(&w->static_grid, w->statics.x, w->statics.z, sx, sz, 8 << 8, 0, NULL, NULL);
+	if (*target >= 0)
+		return SHELL_HIT_OBSTACLE;
+
+	*target = grid_find(&w->tank_grid, w->tanks.x, w->tanks.z, sx, sz, 8 << 8, TANK_GRID_SLOP,
+				not_shell_parent, &sp);
+	if (*target >= 0)
+		return SHELL_HIT_TANK;
+
+	for (int p = 0; p < w->nplayers; p++) {
+		if (!w->player[p].active || sp.parent == PLAYER_PARENT(p)) /* players can't hit themselves */
+			continue;
+		if (within_box(sx, sz, w->player[p].camera.x, w->player[p].camera.z, 8 << 8)) {
+			*target = p;
+			return SHELL_HIT_PLAYER;
+		}
+	}
+	return SHELL_HIT_NOTHING;
+}
+
+static int player_obstacle_collision(struct bz_world *w, int nx, int nz)
+{
+	update_static_grid(w);
+	if (grid_find(&w->static_grid, w->statics.x, w->statics.z, nx, nz, 15 << 8, 0, NULL, NULL) >= 0)
+		return 1;
+	for (int i = 0; i < w->tanks.n; i++)
+		if (within_box(nx, nz, w->tanks.x[i], w->tanks.z[i], 15 << 8))
+			return 1;
+	return 0;
+}
+
+static int not_self(int i, const void *cookie)
+{
+	return i != *(const int *) cookie; /* Can't collide with self */
+}
+
+static int tank_obstacle_collision(struct bz_world *w, int tank, int nx, int nz)
+{
+	if (grid_find(&w->static_grid, w->statics.x, w->statics.z, nx, nz, 15 << 8, 0, NULL, NULL) >= 0)
+		return 1;
+	if (grid_find(&w->tank_grid, w->tank_snapshot_x, w->tank_snapshot_z, nx, nz, 15 << 8, 0,
+			not_self, &tank) >= 0)
+		return 1;
+	return 0;
+}
+
+static void fire_gun(struct bz_world *w, int p)
+{
+
+#define SHELL_SPEED 5
+#define SHELL_LIFETIME 100
+#define IDEAL_TARGET_DIST ((SHELL_SPEED * SHELL_LIFETIME * 180) / 256)
+#define TICKS_PER_SECOND 30 /* battlezone_run() paces the simulation to about this */
+#define TANK_SHOOT_COOLDOWN_TICKS (3 * TICKS_PER_SECOND)
+
+	const struct camera *c = &w->player[p].camera;
+	int n;
+
+	n = add_shell(w, c->x, c->y, c->z, c->orientation, PLAYER_PARENT(p), SHELL_LIFETIME);
+	if (n < 0)
+		return;
+	w->shells.vx[n] = -SHELL_SPEED * sine(c->orientation);
+	w->shells.vz[n] = -SHELL_SPEED * cosine(c->orientation);
+	add_sound(w, SOUND_GUN, c->x, c->y, c->z);
+}
+
+/* Turns and drives player p as their BUTTON_* latches say.  This is all a
+ * networked client needs to predict where its own tank goes.
+ */
+static void steer_player(struct bz_world *w, int p)
+{
+	struct camera *c = &w->player[p].camera;
+	int nx, nz;
+
+	if (button_pressed(w, p, BUTTON_LEFT)) {
+		w->player[p].keypress_latches &= ~BUTTON_LEFT;
+		c->orientation--;
+		if (c->orientation < 0)
+			c->orientation = 127;
+	}
+	if (button_pressed(w, p, BUTTON_RIGHT)) {
+		c->orientation++;
+		w->player[p].keypress_latches &= ~BUTTON_RIGHT;
+		if (c->orientation > 127)
+			c->orientation = 0;
+	}
+	if (button_pressed(w, p, BUTTON_UP)) {
+		w->player[p].keypress_latches &= ~BUTTON_UP;
+		/* This seems "off", but... works?  Something's screwy about the coord system
+		 * I think. */
+		nx = c->x - sine(c->orientation);
+		nz = c->z - cosine(c->orientation);
+		if (!player_obstacle_collision(w, nx, nz)) {
+			c->x = nx;
+			c->z = nz;
+		} else {
+			bump_player(w, p);
+		}
+	}
+	if (button_pressed(w, p, BUTTON_DOWN)) {
+		w->player[p].keypress_latches &= ~BUTTON_DOWN;
+		/* This seems "off", but... works?  Something's screwy about the coord system
+		 * I think. */
+		nz = c->z + cosine(c->orientation);
+		nx = c->x + sine(c->orientation);
+		if (!player_obstacle_collision(w, nx, nz)) {
+			c->x = nx;
+			c->z = nz;
+		} else {
+			bump_player(w, p);
+		}
+	}
+}
+
+static void check_buttons(struct bz_world *w)
+{
+	for (int p = 0; p < w->nplayers; p++) {
+		if (!w->player[p].active)
+			continue;
+		if (button_pressed(w, p, BUTTON_FIRE)) {
+			w->player[p].keypress_latches &= ~BUTTON_FIRE;
+			fire_gun(w, p);
+		}
+		steer_player(w, p);
+		if (button_pressed(w, p, BUTTON_QUIT))
+			w->battlezone_state = BATTLEZONE_EXIT;
+	}
+}
+
+#ifndef BTSERVER
+static void project_vertex(struct camera *c, struct bz_vertex *v,
+			int32_t ox, int32_t oy, int32_t oz, int orientation)
+{
+	int32_t x, y, z, a, nx, ny, nz;
+
+	a = orientation;
+	a = -a;
+	if (a < 0)
+		a = a + 128;
+	if (a >= 128)
+		a = a - 128;
+
+	/* Rotate for object orientation */
+	nx = ((-v->x * cosine(a)) / 256) - ((v->z * sine(a)) / 256);
+	ny = v->y;
+	nz = ((v->z * cosine(a)) / 256) - ((v->x * sine(a)) / 256); 
+	x = nx;
+	y = ny;
+	z = nz;
+
+	/* Translate for +object position and -camera position */
+	x = x + ox - c->x;
+	y = y + oy - c->y;
+	z = z + oz - c->z;
+
+	/* Rotate for camera */
+	a = 128 - c->orientation;
+	if (a > 127)
+		a = a - 128;
+
+	nx = ((-x * cosine(a)) / 256) - ((z * sine(a)) / 256);
+	ny = y;
+	nz = ((z * cosine(a)) / 256) - ((x * sine(a)) / 256); 
+	x = nx;
+	y = ny;
+	z = nz;
+
+	if (z >= 0) {
+		v->px = -1;
+		v->py = -1;
+		return;
+	}
+
+	v->px = (int) (((int64_t) c->eyedist * (int64_t) x) / -z);
+	v->py = (int) (((int64_t) c->eyedist * (int64_t) y) / -z);
+	v->px = v->px + ((SCREEN_XDIM / 2) * 256);
+	v->py = (SCREEN_YDIM * 256) - (v->py + ((SCREEN_YDIM / 2) * 256));
+}
+
+static int onscreen(int x, int y)
+{
+	if (x < 0 || x >= SCREEN_XDIM)
+		return 0;
+	if (y < 0 || y >= SCREEN_YDIM)
+		return 0;
+	return 1;
+}
+
+/* Drawing objects goes in three passes, each timed on its own (see
+ * draw_screen()): culling picks out the objects in view, projection turns
+ * their models into lines on the screen, and rasterising draws the lines.
+ */
+#define MAX_VISIBLE (MAX_STATICS + MAX_TANKS + MAX_SHELLS + MAX_PLAYERS)
+static int nvisible;
+static struct visible_object {
+	int32_t x, y, z;
+	int model, orientation, color;
+} visible[MAX_VISIBLE];
+
+static int nscreen_lines, max_screen_lines;
+static struct screen_line {
+	int16_t x1, y1, x2, y2;
+	unsigned char color, clipped; /* clipped if either end is off the screen */
+} *screen_line;
+
+static void add_screen_line(struct bz_vertex *v1, struct bz_vertex *v2, int color)
+{
+	int x1, y1, x2, y2, onscreen1, onscreen2;
+
+	x1 = v1->px / 256;
+	y1 = v1->py / 256;
+	x2 = v2->px / 256;
+	y2 = v2->py / 256;
+	onscreen1 = onscreen(x1, y1);
+	onscreen2 = onscreen(x2, y2);
+	if (!onscreen1 && !onscreen2)
+		return;
+	if (nscreen_lines == max_screen_lines) {
+		int n = max_screen_lines ? 2 * max_screen_lines : 4096;
+		struct screen_line *l = realloc(screen_line, sizeof(*l) * n);
+		if (!l)
+			return; /* a line short is better than no frame */
+		screen_line = l;
+		max_screen_lines = n;
+	}
+	screen_line[nscreen_lines++] = (struct screen_line) { x1, y1, x2, y2, color,
+		!onscreen1 || !onscreen2 };
+}
+
+static inline void FgColor(int c)
+{
+	static int current_color = -1;
+
+	if (c == current_color)
+		return;
+	current_color = c;
+	flush_points();
+	SDL_SetRenderDrawColor(renderer, color[c].r, color[c].g, color[c].b, color[c].a);
+}
+
+/* Adds the segments of model m between the projected vertices vert */
+static void add_model_lines(const struct bz_model *m, struct bz_vertex *vert, int color)
+{
+	int v1, v2;
+
+	for (int i = 0; i < m->nsegs - 1;) {
+		v1 = m->vlist[i];
+		v2 = m->vlist[i + 1];
+		if (v2 == -1) {
+			i = i + 2;
+			continue;
+		}
+		add_screen_line(&vert[v1], &vert[v2], color);
+		i++;
+	}
+}
+
+static void project_object(struct camera *c, const struct visible_object *o)
+{
+	struct bz_model *m = (struct bz_model *) bz_model[o->model];
+
+	for (int i = 0; i < m->nvertices; i++)
+		project_vertex(c, &m->vert[i], o->x, o->y, o->z, o->orientation);
+	add_model_lines(m, m->vert, o->color);
+}
+
+static void project_objects(struct camera *c)
+{
+	nscreen_lines = 0;
+	for (int i = 0; i < nvisible; i++)
+		project_object(c, &visible[i]);
+}
+
+static void draw_screen_lines(void)
+{
+	for (int i = 0; i < nscreen_lines; i++) {
+		const struct screen_line *l = &screen_line[i];
+		FgColor(l->color);
+		if (l->clipped)
+			ClippedLine(l->x1, l->y1, l->x2, l->y2);
+		else
+			Line(l->x1, l->y1, l->x2, l->y2);
+	}
+}
+
+static void draw_mountains(struct bz_world *w, struct camera *c)
+{
+	int x1 = 0;
+	int y1, x2, y2;
+	int j;
+
+#define HORIZ_ANGLE_OF_VIEW 26
+
+	FgColor(TERRAIN_COLOR);
+	for (int i = 0; i < HORIZ_ANGLE_OF_VIEW; i++) {
+		j = i + c->orientation;
+		if (j > 127)
+			j -= 128;
+		y1 = w->mountain[j];
+		j++;
+		if (j > 127)
+			j -= 128;
+		y2 = w->mountain[j];
+		x2 = x1 + (SCREEN_XDIM * 256) / HORIZ_ANGLE_OF_VIEW;
+		ClippedLine(x1 >> 8, y1, x2 >> 8, y2);
+		x1 = x2;
+		y1 = y2;
+	}
+}
+
+static void draw_horizon(void)
+{
+	FgColor(TERRAIN_COLOR);
+	HorizontalLine(0, 80, 128, 80);
+}
+
+static int inside_view_frustum(struct camera *c, int32_t x, int32_t z)
+{
+	int32_t dx = x - c->x;
+	int32_t dz = z - c->z;
+
+	int a = arctan2(-dx, -dz);
+	if (a < 0)
+		a += 128;
+	if (a > 127)
+		a -= 128;
+	a = a - c->orientation;
+	if (a < 0)
+		a += 128;
+	if (a > 127)
+		a -= 128;
+	return (a < 18 && a >= 0) || (a > 128 - 18 && a < 128);
+}
+
+#define SEE(m, px, py, pz, o, col) \
+	(visible[nvisible++] = (struct visible_object) { (px), (py), (pz), (m), (o), (col) })
+
+/* Debris is culled as it is projected, see project_debris() */
+static void cull_objects(struct bz_world *w, struct camera *c)
+{
+	nvisible = 0;
+	for (int i = 0; i < w->statics.n; i++)
+		if (inside_view_frustum(c, w->statics.x[i], w->statics.z[i]))
+			SEE(w->statics.model[i], w->statics.x[i], w->statics.y[i], w->statics.z[i],
+				w->statics.orientation[i], w->statics.color[i]);
+	for (int i = 0; i < w->tanks.n; i++)
+		if (inside_view_frustum(c, w->tanks.x[i], w->tanks.z[i]))
+			SEE(TANK_MODEL, w->tanks.x[i], w->tanks.y[i], w->tanks.z[i],
+				w->tanks.orientation[i], w->tanks.color[i]);
+	for (int i = 0; i < w->shells.n; i++)
+		if (inside_view_frustum(c, w->shells.x[i], w->shells.z[i]))
+			SEE(ARTILLERY_SHELL_MODEL, w->shells.x[i], w->shells.y[i], w->shells.z[i],
+				w->shells.orientation[i], SHELL_COLOR);
+	for (int p = 0; p < w->nplayers; p++) {
+		const struct camera *pc = &w->player[p].camera;
+		if (w->player[p].active && pc != c && inside_view_frustum(c, pc->x, pc->z))
+			SEE(TANK_MODEL, pc->x, pc->y - CAMERA_GROUND_LEVEL, pc->z,
+				pc->orientation, PLAYER_TANK_COLOR);
+	}
+}
+
+/* Sparks are moved into camera space SIMD_WIDTH at a time, then the ones in
+ * front of the camera are projected and batched as points.
+ */
+static struct spark_projection {
+	const struct bz_world *w;
+	const struct camera *c;
+	int32_t cos_a, sin_a;
+	int32_t cx[MAX_SPARKS] SIMD_ALIGN, cy[MAX_SPARKS] SIMD_ALIGN, cz[MAX_SPARKS] SIMD_ALIGN;
+} spark_projection;
+
+/* Moves points [begin, end) of px, py, pz into camera space in cx, cy, cz */
+static void to_camera_space(const struct camera *c, int32_t cos_a, int32_t sin_a,
+			const int32_t *px, const int32_t *py, const int32_t *pz,
+			int32_t *cx, int32_t *cy, int32_t *cz, int begin, int end)
+{
+	for (int i = begin; i < end; i += SIMD_WIDTH) {
+		/* Translate for +object position and -camera position */
+		v4i32 x = *(const v4i32 *) &px[i] - c->x;
+		v4i32 y = *(const v4i32 *) &py[i] - c->y;
+		v4i32 z = *(const v4i32 *) &pz[i] - c->z;
+
+		*(v4i32 *) &cx[i] = ((-x * cos_a) / 256) - ((z * sin_a) / 256);
+		*(v4i32 *) &cy[i] = y;
+		*(v4i32 *) &cz[i] = ((z * cos_a) / 256) - ((x * sin_a) / 256);
+	}
+}
+
+static void project_spark_range(void *arg, int begin, int end, UNUSED int worker)
+{
+	struct spark_projection *sp = arg;
+	const struct bz_world *w = sp->w;
+
+	to_camera_space(sp->c, sp->cos_a, sp->sin_a, w->sparks.x, w->sparks.y, w->sparks.z,
+		sp->cx, sp->cy, sp->cz, begin, end);
+}
+
+/* The projection shares the pool with the simulation's jobs.  When the
+ * simulation has its own thread and is busy with the pool (see
+ * start_pipeline()), it runs on the drawing thread alone.
+ */
+#define SPARK_PROJECTION_CHUNK 1024 /* a multiple of SIMD_WIDTH */
+static void project_sparks(struct bz_world *w, struct camera *c)
+{
+	struct spark_projection *sp = &spark_projection;
+	int a;
+
+	/* Rotate for camera */
+	a = 128 - c->orientation;
+	if (a > 127)
+		a = a - 128;
+	sp->w = w;
+	sp->c = c;
+	sp->cos_a = cosine(a);
+	sp->sin_a = sine(a);
+	parallel_for(w->pool, "project sparks", w->sparks.n, SPARK_PROJECTION_CHUNK,
+		project_spark_range, sp);
+}
+
+/* Debris is projected in a batch too.  The chunks' centres are moved into
+ * camera space like the sparks, and since a chunk's shape depends only on
+ * its model and orientation, each shape is turned to face the camera once a
+ * frame, at every orientation, rather than once for each chunk.  A chunk is
+ * then its centre plus the corners of its shape.
+ */
+#define NCHUNK_MODELS 3 /* CHUNK0_MODEL onwards */
+#define MAX_CHUNK_VERTICES 4
+static struct debris_projection {
+	const struct bz_world *w;
+	const struct camera *c;
+	int32_t cos_a, sin_a;
+	struct chunk_shape {
+		int32_t x, y, z;
+	} shape[NCHUNK_MODELS][ANGLE_STEPS][MAX_CHUNK_VERTICES];
+	int32_t cx[MAX_DEBRIS] SIMD_ALIGN, cy[MAX_DEBRIS] SIMD_ALIGN, cz[MAX_DEBRIS] SIMD_ALIGN;
+} debris_projection;
+
+static void project_debris_range(void *arg, int begin, int end, UNUSED int worker)
+{
+	struct debris_projection *dp = arg;
+	const struct bz_world *w = dp->w;
+
+	to_camera_space(dp->c, dp->cos_a, dp->sin_a, w->debris.x, w->debris.y, w->debris.z,
+		dp->cx, dp->cy, dp->cz, begin, end);
+}
+
+/* The rotations are project_vertex()'s, for an object at the camera */
+static void turn_chunk_shapes(struct debris_projection *dp)
+{
+	for (int k = 0; k < NCHUNK_MODELS; k++) {
+		const struct bz_model *m = bz_model[CHUNK0_MODEL + k];
+
+		for (int o = 0; o < ANGLE_STEPS; o++) {
+			int a = o ? ANGLE_STEPS - o : 0;
+
+			for (int i = 0; i < m->nvertices; i++) {
+				const struct bz_vertex *v = &m->vert[i];
+				int32_t x = ((-v->x * cosine(a)) / 256) - ((v->z * sine(a)) / 256);
+				int32_t z = ((v->z * cosine(a)) / 256) - ((v->x * sine(a)) / 256);
+
+				dp->shape[k][o][i] = (struct chunk_shape) {
+					((-x * dp->cos_a) / 256) - ((z * dp->sin_a) / 256),
+					v->y,
+					((z * dp->cos_a) / 256) - ((x * dp->sin_a) / 256),
+				};
+			}
+		}
+	}
+}
+
+/* Adds the lines of the debris in front of the camera to the screen lines */
+#define DEBRIS_PROJECTION_CHUNK 1024 /* a multiple of SIMD_WIDTH */
+static void project_debris(struct bz_world *w, struct camera *c)
+{
+	struct debris_projection *dp = &debris_projection;
+	struct bz_vertex vert[MAX_CHUNK_VERTICES];
+	int a;
+
+	a = 128 - c->orientation;
+	if (a > 127)
+		a = a - 128;
+	dp->w = w;
+	dp->c = c;
+	dp->cos_a = cosine(a);
+	dp->sin_a = sine(a);
+	turn_chunk_shapes(dp);
+	parallel_for(w->pool, "project debris", w->debris.n, DEBRIS_PROJECTION_CHUNK,
+		project_debris_range, dp);
+
+	for (int i = 0; i < w->debris.n; i++) {
+		const struct bz_model *m = bz_model[w->debris.model[i]];
+		const struct chunk_shape *shape;
+
+		if (dp->cz[i] >= 0) /* behind the camera */
+			continue;
+		shape = dp->shape[w->debris.model[i] - CHUNK0_MODEL][w->debris.orientation[i] & 127];
+		for (int j = 0; j < m->nvertices; j++) {
+			int32_t x = dp->cx[i] + shape[j].x;
+			int32_t y = dp->cy[i] + shape[j].y;
+			int32_t z = dp->cz[i] + shape[j].z;
+
+			if (z >= 0) {
+				vert[j].px = -1;
+				vert[j].py = -1;
+				continue;
+			}
+			vert[j].px = (int) (((int64_t) c->eyedist * (int64_t) x) / -z) + (SCREEN_XDIM / 2) * 256;
+			vert[j].py = (SCREEN_YDIM * 256) -
+				((int) (((int64_t) c->eyedist * (int64_t) y) / -z) + (SCREEN_YDIM / 2) * 256);
+		}
+		add_model_lines(m, vert, w->debris.color[i]);
+	}
+}
+
+static void draw_sparks(struct bz_world *w, struct camera *c)
+{
+	const int32_t *cx = spark_projection.cx, *cy = spark_projection.cy, *cz = spark_projection.cz;
+
+	FgColor(SPARK_COLOR);
+	for (int i = 0; i < w->sparks.n; i++) {
+		int64_t sx, sy;
+
+		if (cz[i] >= 0) /* behind the camera */
+			continue;
+		sx = (int64_t) c->eyedist * (int64_t) cx[i] / -cz[i];
+		sy = (int64_t) c->eyedist * (int64_t) cy[i] / -cz[i];
+		sx = sx / 256;
+		sy = sy / 256;
+		sx += SCREEN_XDIM / 2;
+		sy += SCREEN_YDIM / 2;
+		if (onscreen(sx, sy))
+			Point(sx, sy);
+		if (onscreen(sx + 1, sy))
+			Point(sx + 1, sy);
+		if (onscreen(sx, sy + 1))
+			Point(sx, sy + 1);
+		if (onscreen(sx + 1, sy + 1))
+			Point(sx + 1, sy + 1);
+	}
+}
+
+static void draw_radar_blip(struct camera *c, int32_t x, int32_t z, int rx, int ry)
+{
+	int dx, dz, d, tx, tz;
+
+	dx = (x - c->x) >> 8;
+	dz = (z - c->z) >> 8;
+
+	d = ((dx * dx >> 8)) + ((dz * dz) >> 8);
+	if (d > 200)
+		return;
+	/* Rotate for camera */
+	int a = 128 - c->orientation;
+	if (a > 127)
+		a = a - 128;
+	int nx = ((-dx * cosine(a)) / 256) - ((dz * sine(a)) / 256);
+	int nz = ((dz * cosine(a)) / 256) - ((dx * sine(a)) / 256);
+	tx = (SCREEN_XDIM * nx / 20) >> 8;
+	tz = (SCREEN_XDIM * nz / 20) >> 8;
+	FgColor(RADAR_BLIP_COLOR);
+	Point(rx + tx, ry + tz);
+	Point(rx + tx + 1, ry + tz + 1);
+	Point(rx + tx + 1, ry + tz);
+	Point(rx + tx, ry + tz + 1);
+}
+
+static void draw_radar(struct bz_world *w, struct camera *c)
+{
+	static int radar_angle = 0;
+	const int rx = SCREEN_XDIM / 2;
+	const int ry = SCREEN_YDIM / 10;
+	const int radius = SCREEN_YDIM / 16;
+
+	radar_angle++;
+	if (radar_angle >= 128)
+		radar_angle = 0;
+	int x = (cosine(radar_angle) * radius) >> 8;
+	int y = (sine(radar_angle) * radius) >> 8;
+	FgColor(RADAR_COLOR);
+	Line(rx, ry, rx + x, ry + y);
+	VerticalLine(SCREEN_XDIM / 2, ry - radius, SCREEN_XDIM / 2, ry - radius + 2);
+	VerticalLine(SCREEN_XDIM / 2, ry + radius -2, SCREEN_XDIM / 2, ry + radius);
+	HorizontalLine(rx - radius - 2, ry, rx - radius, ry);
+	HorizontalLine(rx + radius - 2, ry, rx + radius, ry);
+
+	if ((radar_angle & 0x03) == 0x03)
+		return; /* Make radar blips blink by not drawing them every few frames */
+
+	for (int i = 0; i < w->tanks.n; i++)
+		draw_radar_blip(c, w->tanks.x[i], w->tanks.z[i], rx, ry);
+	for (int p = 0; p < w->nplayers; p++)
+		if (w->player[p].active && &w->player[p].camera != c)
+			draw_radar_blip(c, w->player[p].camera.x, w->player[p].camera.z, rx, ry);
+}
+
+static void draw_reticle(void)
+{
+	int xo = SCREEN_XDIM / 24;
+	int yo = SCREEN_YDIM / 24;
+	int x = SCREEN_XDIM / 2;
+	int y = SCREEN_YDIM / 2;
+
+	FgColor(RETICLE_COLOR);
+	Line(x - 2 * xo, y, x - xo, y);
+	Line(x + xo, y, x + 2 * xo, y);
+	Line(x, y - 2 * yo, x, y - yo);
+	Line(x, y + yo, x, y + 2 * yo);
+}
+#endif
+
+static void explosion(struct bz_world *w, int x, int y, int z, int count, int chunks)
+{
+	add_sparks(w, x, y, z, count);
+	add_debris(w, x, y, z, chunks, TANK_COLOR);
+	add_sound(w, SOUND_EXPLOSION, x, y, z);
+}
+
+/* Navigation.  Rather than each tank finding its own way, all tanks share one
+ * flow field: a grid laid over the obstacles, NAV_DIM cells on a side and
+ * centred near the player, in which each cell holds the heading to take out
+ * of it along a shortest path to the player.  Steering is then a single
+ * lookup per tank, whatever the number of tanks.
+ *
+ * The field is rebuilt whenever the player moves into another cell.  The
+ * rebuild is a breadth first search out from the player which runs for at
+ * most NAV_WORK_PER_TICK cells per tick into a second buffer; tanks keep
+ * following the previous field until the new one is complete.
+ */
+/* Headings (as for orientation) from a cell to each of its eight neighbours */
+static const struct nav_step {
+	int dx, dz;
+	unsigned char heading;
+} nav_step[] = {
+	{ 0, -1, 0 }, { -1, 0, 32 }, { 0, 1, 64 }, { 1, 0, 96 },
+	{ -1, -1, 16 }, { -1, 1, 48 }, { 1, 1, 80 }, { 1, -1, 112 },
+};
+
+static int nav_cell_of(int32_t origin_x, int32_t origin_z, int32_t x, int32_t z)
+{
+	int cx = (x - origin_x) >> NAV_CELL_SHIFT;
+	int cz = (z - origin_z) >> NAV_CELL_SHIFT;
+
+	if (cx < 0 || cx >= NAV_DIM || cz < 0 || cz >= NAV_DIM)
+		return -1;
+	return cz * NAV_DIM + cx;
+}
+
+/* A cell is blocked if a tank sitting in the middle of it would hit an obstacle */
+static void nav_mark_blocked(struct bz_world *w)
+{
+	const int32_t reach = (15 << 8) + NAV_CELL_SIZE / 2;
+
+	memset(w->nav_build.blocked, 0, sizeof(w->nav_build.blocked));
+	for (int i = 0; i < w->statics.n; i++) {
+		int cx0 = (w->statics.x[i] - reach - w->nav_build.origin_x) >> NAV_CELL_SHIFT;
+		int cx1 = (w->statics.x[i] + reach - w->nav_build.origin_x) >> NAV_CELL_SHIFT;
+		int cz0 = (w->statics.z[i] - reach - w->nav_build.origin_z) >> NAV_CELL_SHIFT;
+		int cz1 = (w->statics.z[i] + reach - w->nav_build.origin_z) >> NAV_CELL_SHIFT;
+
+		if (cx1 < 0 || cx0 >= NAV_DIM || cz1 < 0 || cz0 >= NAV_DIM)
+			continue;
+		for (int cz = cz0 < 0 ? 0 : cz0; cz <= cz1 && cz < NAV_DIM; cz++) {
+			for (int cx = cx0 < 0 ? 0 : cx0; cx <= cx1 && cx < NAV_DIM; cx++) {
+				int32_t x = w->nav_build.origin_x + cx * NAV_CELL_SIZE + NAV_CELL_SIZE / 2;
+				int32_t z = w->nav_build.origin_z + cz * NAV_CELL_SIZE + NAV_CELL_SIZE / 2;
+				if (within_box(x, z, w->statics.x[i], w->statics.z[i], 15 << 8))
+					w->nav_build.blocked[cz * NAV_DIM + cx] = 1;
+			}
+		}
+	}
+	w->nav_build.statics_version = w->statics_version;
+	w->nav_build.blocked_valid = 1;
+}
+
+static void nav_start_build(struct bz_world *w)
+{
+	struct nav_field *back = &w->nav_field[!w->nav_front];
+	int32_t origin_x = w->nav_build.origin_x;
+	int32_t origin_z = w->nav_build.origin_z;
+	const struct camera *c = anchor_camera(w);
+	int goal = nav_cell_of(origin_x, origin_z, c->x, c->z);
+
+	/* Re-centre the grid on the player once they wander too far from the middle */
+	if (!w->nav_build.blocked_valid || goal < 0 ||
+		abs(goal % NAV_DIM - NAV_DIM / 2) > NAV_RECENTER_DIST ||
+		abs(goal / NAV_DIM - NAV_DIM / 2) > NAV_RECENTER_DIST) {
+		origin_x = ((c->x >> NAV_CELL_SHIFT) - NAV_DIM / 2) * NAV_CELL_SIZE;
+		origin_z = ((c->z >> NAV_CELL_SHIFT) - NAV_DIM / 2) * NAV_CELL_SIZE;
+		w->nav_build.blocked_valid = 0;
+	}
+	if (!w->nav_build.blocked_valid || w->nav_build.statics_version != w->statics_version) {
+		w->nav_build.origin_x = origin_x;
+		w->nav_build.origin_z = origin_z;
+		nav_mark_blocked(w);
+	}
+	goal = nav_cell_of(origin_x, origin_z, c->x, c->z);
+
+	back->origin_x = origin_x;
+	back->origin_z = origin_z;
+	back->goal = goal;
+	for (int i = 0; i < NAV_CELLS; i++)
+		back->heading[i] = w->nav_build.blocked[i] ? NAV_BLOCKED : NAV_UNREACHED;
+	back->heading[goal] = NAV_GOAL; /* The player is never inside an obstacle */
+	w->nav_build.queue[0] = goal;
+	w->nav_build.head = 0;
+	w->nav_build.tail = 1;
+	w->nav_build.active = 1;
+}
+
+static void nav_continue_build(struct bz_world *w)
+{
+	struct nav_field *back = &w->nav_field[!w->nav_front];
+
+	for (int work = 0; work < NAV_WORK_PER_TICK; work++) {
+		if (w->nav_build.head == w->nav_build.tail) {
+			w->nav_front = !w->nav_front;
+			w->nav_build.active = 0;
+			w->nav_ready = 1;
+			return;
+		}
+		int c = w->nav_build.queue[w->nav_build.head++];
+		int cx = c % NAV_DIM;
+		int cz = c / NAV_DIM;
+		for (size_t i = 0; i < ARRAYSIZE(nav_step); i++) {
+			int nx = cx + nav_step[i].dx;
+			int nz = cz + nav_step[i].dz;
+			if (nx < 0 || nx >= NAV_DIM || nz < 0 || nz >= NAV_DIM)
+				continue;
+			int n = nz * NAV_DIM + nx;
+			if (back->heading[n] != NAV_UNREACHED)
+				continue;
+			/* Don't cut corners past obstacles */
+			if (nav_step[i].dx && nav_step[i].dz &&
+				(w->nav_build.blocked[cz * NAV_DIM + nx] ||
+				w->nav_build.blocked[nz * NAV_DIM + cx]))
+				continue;
+			/* Found n from c, so the way on from n is back towards c */
+			back->heading[n] = (nav_step[i].heading + 64) & 127;
+			w->nav_build.queue[w->nav_build.tail++] = n;
+		}
+	}
+}
+
+static void update_nav_field(struct bz_world *w)
+{
+	const struct nav_field *f = &w->nav_field[w->nav_front];
+	const struct camera *c = anchor_camera(w);
+
+	if (!w->nav_build.active && (!w->nav_build.blocked_valid ||
+		w->nav_build.statics_version != w->statics_version ||
+		nav_cell_of(f->origin_x, f->origin_z, c->x, c->z) != f->goal))
+		nav_start_build(w);
+	if (w->nav_build.active)
+		nav_continue_build(w);
+}
+
+/* Returns the heading to follow from (x, z) towards the anchor player, or -1 if the
+ * navigation field has nothing to say about this spot.
+ */
+static int nav_heading(struct bz_world *w, int32_t x, int32_t z)
+{
+	const struct nav_field *f = &w->nav_field[w->nav_front];
+	int c;
+
+	if (!w->nav_ready)
+		return -1;
+	c = nav_cell_of(f->origin_x, f->origin_z, x, z);
+	if (c < 0 || f->heading[c] >= 128)
+		return -1;
+	return f->heading[c];
+}
+
+/* Heading to travel along the vector (dx, dz) */
+static int heading_to(int dx, int dz)
+{
+	int a = arctan2(-dx, -dz);
+	if (a < 0)
+		a += 128;
+	return a;
+}
+
+/* Turn tank t up to steps steps towards heading a.  Returns how far off it still is. */
+static int turn_towards(struct bz_world *w, int t, int a, int steps)
+{
+	int turning_direction;
+	int da = a - w->tanks.orientation[t];
+
+	if (da == 0)
+		return 0;
+	if (da < -64 || (da > 0 && da <= 64))
+		turning_direction = 1;
+	else
+		turning_direction = -1;
+	da = abs(da);
+	if (da > 64)
+		da = 128 - da;
+	if (steps > da)
+		steps = da;
+	w->tanks.orientation[t] += turning_direction * steps;
+	if (w->tanks.orientation[t] < 0)
+		w->tanks.orientation[t] += 128;
+	if (w->tanks.orientation[t] >= 128)
+		w->tanks.orientation[t] -= 128;
+	return da - steps;
+}
+
+/* The eye of the player tank t is after */
+static const struct camera *tank_target(struct bz_world *w, int t)
+{
+	return &w->player[nearest_player(w, w->tanks.x[t], w->tanks.z[t])].camera;
+}
+
+static int tank_in_range_of_player(struct bz_world *w, int t)
+{
+	const struct camera *c = tank_target(w, t);
+	int64_t dx = c->x - w->tanks.x[t];
+	int64_t dz = c->z - w->tanks.z[t];
+
+	return ((dx * dx / 256) + (dz * dz / 256) / 256) < (IDEAL_TARGET_DIST * IDEAL_TARGET_DIST);
+}
+
+#define TANK_DRIVE_ANGLE 8 /* drive while turning only if this close to the right heading */
+
+/* Turn and drive towards the player for steps ticks.  Returns 0 if something
+ * is in the way.
+ */
+static int tank_drive(struct bz_world *w, int t, int steps)
+{
+	const struct camera *c = tank_target(w, t);
+	int nx, nz, a = -1;
+
+	/* Follow the navigation field, or head straight for the player if it can't help */
+	if (c == anchor_camera(w))
+		a = nav_heading(w, w->tanks.x[t], w->tanks.z[t]);
+	if (a < 0)
+		a = heading_to(c->x - w->tanks.x[t], c->z - w->tanks.z[t]);
+	if (turn_towards(w, t, a, steps) > TANK_DRIVE_ANGLE)
+		return 1;
+
+	nx = w->tanks.x[t] - steps * sine(w->tanks.orientation[t]);
+	nz = w->tanks.z[t] - steps * cosine(w->tanks.orientation[t]);
+	if (tank_obstacle_collision(w, t, nx, nz))
+		return 0;
+	w->tanks.x[t] = nx;
+	w->tanks.z[t] = nz;
+	return 1;
+}
+
+/* Reverse for up to steps ticks while turning away, counting down
+ * tanks.counter[t].  Returns 1 once the count runs out.
+ */
+static int tank_back_off(struct bz_world *w, int t, int steps)
+{
+	for (int i = 0; i < steps && w->tanks.counter[t] > 0; i++) {
+		w->tanks.x[t] = w->tanks.x[t] + (sine(w->tanks.orientation[t]));
+		w->tanks.z[t] = w->tanks.z[t] + (cosine(w->tanks.orientation[t]));
+		if (w->tanks.counter[t] & 0x01) {
+			w->tanks.orientation[t]++;
+			if (w->tanks.orientation[t] >= 128)
+				w->tanks.orientation[t] -= 128;
+		}
+		w->tanks.counter[t]--;
+	}
+	return w->tanks.counter[t] <= 0;
+}
+
+/* Turn towards the player for steps ticks.  Returns 1 once the gun is on them. */
+static int tank_aim(struct bz_world *w, int t, int steps)
+{
+	const struct camera *c = tank_target(w, t);
+	int dx, dz;
+
+	dx = c->x - w->tanks.x[t];
+	dz = c->z - w->tanks.z[t];
+
+	/* This prevents taking arctan2(0, 0); */
+	if (abs(dx) < TANK_DEST_ARRIVE_DIST && abs(dz) < TANK_DEST_ARRIVE_DIST)
+		return 0; /* FIXME... what to do here? */
+
+	return turn_towards(w, t, heading_to(dx, dz), steps) == 0;
+}
+
+/* Tank AI runs in parallel, so shots are not added to the shell table
+ * directly.  Each worker collects the tanks which fired in a buffer of its
+ * own, and the buffers are merged in tank order once every tank has moved.
+ */
+static void tank_shoot(struct bz_world *w, int t, int worker)
+{
+	struct bz_worker_scratch *b = worker_scratch(w, worker);
+
+	b->shot[b->nshots++] = t;
+}
+
+static void fire_tank_gun(struct bz_world *w, int t)
+{
+	int n;
+
+	n = add_shell(w, w->tanks.x[t], tank_target(w, t)->y, w->tanks.z[t], w->tanks.orientation[t],
+			w->tanks.id[t], SHELL_LIFETIME);
+	if (n < 0)
+		return;
+	w->shells.vx[n] = -SHELL_SPEED * sine(w->tanks.orientation[t]);
+	w->shells.vz[n] = -SHELL_SPEED * cosine(w->tanks.orientation[t]);
+	add_sound(w, SOUND_GUN, w->tanks.x[t], w->tanks.y[t], w->tanks.z[t]);
+}
+
+/* Tank behaviours are stackless coroutines, in the manner of protothreads.
+ * A behaviour is a function written as straight line code between
+ * BEHAVIOR_BEGIN() and BEHAVIOR_END() which returns to the scheduler at each
+ * YIELD() or SLEEP() and carries on from that point the next time it is
+ * called.  All that is kept between calls is where to resume and when to wake
+ * up, so ordinary local variables do not survive a yield, and there must be
+ * no switch statements or more than one yield on a line within a behaviour.
+ */
+#define BEHAVIOR_BEGIN(t) switch (w->tanks.resume[t]) { case 0:
+#define BEHAVIOR_END(t) } w->tanks.resume[t] = 0
+#define YIELD(t) do { w->tanks.resume[t] = __LINE__; return; case __LINE__:; } while (0)
+#define SLEEP(t, ticks) do { w->tanks.wake_tick[t] = w->sim_tick + (ticks); YIELD(t); } while (0)
+
+/* steps is how many ticks have passed since the tank last ran, see move_tank() */
+static void tank_behavior(struct bz_world *w, int t, int steps, int worker)
+{
+	BEHAVIOR_BEGIN(t);
+	for (;;) {
+		if (!tank_in_range_of_player(w, t)) {
+			if (!tank_drive(w, t, steps)) {
+				/* The field steers around obstacles, so this is most likely another tank */
+				w->tanks.counter[t] = 20;
+				do {
+					YIELD(t);
+				} while (!tank_back_off(w, t, steps));
+			}
+		} else if (tank_aim(w, t, steps)) {
+			tank_shoot(w, t, worker);
+			SLEEP(t, w->tank_cooldown_ticks ? w->tank_cooldown_ticks : TANK_SHOOT_COOLDOWN_TICKS);
+			continue;
+		}
+		YIELD(t);
+	}
+	BEHAVIOR_END(t);
+}
+
+/* Run tank t's brain, making up for any ticks it was skipped by the scheduler */
+static void move_tank(struct bz_world *w, int t, int worker)
+{
+	uint32_t last = w->tanks.ai_tick[t];
+	int steps;
+
+	if ((int32_t) (w->tanks.wake_tick[t] - 1 - last) > 0)
+		last = w->tanks.wake_tick[t] - 1; /* time spent asleep needs no making up */
+	steps = (int) (w->sim_tick - last);
+	if (steps < 1)
+		steps = 1;
+	if (steps > AI_MAX_STEPS)
+		steps = AI_MAX_STEPS; /* an overloaded scheduler slows far away tanks down */
+	w->tanks.ai_tick[t] = w->sim_tick;
+
+	tank_behavior(w, t, steps, worker);
+}
+
+/* AI level of detail.  Tanks near a player think every tick; further out
+ * they think every 2nd or 4th tick, and beyond that as rarely as it takes to
+ * keep the number of distant tanks updated per tick within AI_FAR_BUDGET.
+ * Each tank's phase comes from its id so that the tanks sharing a rate are
+ * spread evenly across ticks, and a tank which has skipped ticks makes up for
+ * them in its next update (see move_tank()).
+ */
+static int ai_tier_period(struct bz_world *w, int t)
+{
+	const struct camera *c = tank_target(w, t);
+	int32_t d = abs(w->tanks.x[t] - c->x);
+	int32_t dz = abs(w->tanks.z[t] - c->z);
+
+	if (dz > d)
+		d = dz;
+	if (d < AI_NEAR_DIST)
+		return 1;
+	if (d < AI_MID_DIST)
+		return 2;
+	if (d < AI_FAR_DIST)
+		return 4;
+	return 0; /* distant, see schedule_tank_ai() */
+}
+
+static void schedule_tank_ai(struct bz_world *w)
+{
+	unsigned char *period = w->ai_period;
+	int nfar = 0, far_period = AI_MAX_STEPS;
+
+	for (int i = 0; i < w->nawake; i++) {
+		period[i] = ai_tier_period(w, w->awake[i]);
+		if (!period[i])
+			nfar++;
+	}
+	while (far_period < 256 && nfar / far_period >= AI_FAR_BUDGET)
+		far_period *= 2;
+
+	w->ai_due_count = 0;
+	for (int i = 0; i < w->nawake; i++) {
+		int t = w->awake[i];
+		int p = period[i] ? period[i] : far_period;
+		if (((w->sim_tick + (uint32_t) w->tanks.id[t]) & (p - 1)) == 0)
+			w->ai_due[w->ai_due_count++] = t;
+	}
+
+	w->ai_stats.updates += w->ai_due_count;
+	w->ai_stats.ticks++;
+	if (w->ai_due_count > w->ai_stats.max_updates)
+		w->ai_stats.max_updates = w->ai_due_count;
+}
+
+static void move_tank_range(void *arg, int begin, int end, int worker)
+{
+	struct bz_world *w = arg;
+
+	for (int i = begin; i < end; i++)
+		move_tank(w, w->ai_due[i], worker);
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *) a;
+	int32_t y = *(const int32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void static_grid_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	update_static_grid(arg);
+}
+
+static void nav_field_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	update_nav_field(arg);
+}
+
+static void snapshot_tanks_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	snapshot_tanks(arg);
+}
+
+static void schedule_tank_ai_job(void *arg, UNUSED int begin, UNUSED int end, UNUSED int worker)
+{
+	schedule_tank_ai(arg);
+}
+
+/* The obstacle grid, the navigation field, the tank snapshot and the AI
+ * schedule each write only their own part of the world, so they are built
+ * side by side, and the tank AI waits for all four.
+ */
+#define TANK_AI_CHUNK 64
+static void move_tanks(struct bz_world *w)
+{
+	int32_t *fired = w->ai_fired;
+	int nfired = 0;
+	struct job_graph g = { 0 };
+	int prologue[4], ai;
+
+	for (int i = 0; i < world_workers(w); i++)
+		worker_scratch(w, i)->nshots = 0;
+	prologue[0] = add_job(&g, "static grid", static_grid_job, w, 1, 1);
+	prologue[1] = add_job(&g, "nav field", nav_field_job, w, 1, 1);
+	prologue[2] = add_job(&g, "tank snapshot", snapshot_tanks_job, w, 1, 1);
+	prologue[3] = add_job(&g, "AI schedule", schedule_tank_ai_job, w, 1, 1);
+	ai = add_job(&g, "tank AI", move_tank_range, w, 0, TANK_AI_CHUNK);
+	g.job[ai].count = &w->ai_due_count; /* known once the schedule is */
+	for (int i = 0; i < 4; i++)
+		job_after(&g, ai, prologue[i]);
+	run_jobs(w->pool, &g);
+
+	/* Tanks which went to sleep are woken up by the timer wheel */
+	for (int i = 0; i < w->ai_due_count; i++) {
+		int t = w->ai_due[i];
+		if ((int32_t) (w->tanks.wake_tick[t] - w->sim_tick) > 0 && w->tanks.timer[t] < 0) {
+			w->tanks.timer[t] = add_timer(w, w->tanks.wake_tick[t], TIMER_TANK_WAKE, t);
+			if (w->tanks.timer[t] >= 0)
+				sleep_tank(w, t);
+		}
+	}
+
+	/* Fire in tank order, whichever worker each shot came from */
+	for (int i = 0; i < world_workers(w); i++) {
+		struct bz_worker_scratch *b = worker_scratch(w, i);
+		memcpy(&fired[nfired], b->shot, sizeof(fired[0]) * b->nshots);
+		nfired += b->nshots;
+	}
+	qsort(fired, nfired, sizeof(fired[0]), compare_int32);
+	for (int i = 0; i < nfired; i++)
+		fire_tank_gun(w, fired[i]);
+}
+
+/* Shells move and look for collisions in parallel, against a world which
+ * nothing changes until they have all finished: each worker only writes its
+ * own shells' positions, and records whatever they hit in a queue of its own.
+ * The hits are then sorted into shell order and acted on in one serial pass,
+ * so the outcome is the same whatever the number of threads.
+ */
+static void move_shell_range(void *arg, int begin, int end, int worker)
+{
+	struct bz_world *w = arg;
+	struct bz_worker_scratch *q = worker_scratch(w, worker);
+
+	for (int s = begin; s < end; s++) {
+		struct shell_hit_event *e = &q->hit[q->nhits];
+
+		w->shells.x[s] += w->shells.vx[s];
+		w->shells.z[s] += w->shells.vz[s];
+		e->what = shell_collision(w, s, &e->target);
+		if (e->what == SHELL_HIT_NOTHING)
+			continue;
+		e->shell = s;
+		q->nhits++;
+	}
+}
+
+static void apply_shell_hit(struct bz_world *w, const struct shell_hit_event *e)
+{
+	int s = e->shell;
+
+	switch (e->what) {
+	case SHELL_HIT_PLAYER: {
+		struct bz_player *pl = &w->player[e->target];
+		int direction = w->shells.orientation[s];
+		direction += 64;
+		if (direction > 127)
+			direction -= 128;
+		pl->has_been_hit = 1;
+		explosion(w, pl->camera.x, pl->camera.y, pl->camera.z, SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
+		pl->camera.vx = (2 * sine(direction));
+		pl->camera.vy = 2 << 8;
+		pl->camera.vz = (2 * cosine(direction));
+		bump_player(w, e->target);
+		pl->deaths++;
+		if (w->shells.parent[s] < 0)
+			w->player[SHELL_PLAYER(w->shells.parent[s])].kills++;
+		break;
+	}
+	case SHELL_HIT_TANK:
+		explosion(w, w->shells.x[s], w->shells.y[s], w->shells.z[s],
+			SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
+		w->tanks.alive[e->target] = 0;
+		if (w->shells.parent[s] < 0)
+			w->player[SHELL_PLAYER(w->shells.parent[s])].kills++;
+		break;
+	case SHELL_HIT_OBSTACLE:
+		explosion(w, w->shells.x[s], w->shells.y[s], w->shells.z[s], SPARKS_PER_EXPLOSION, 0);
+		break;
+	}
+	w->shells.alive[s] = 0;
+}
+
+static int compare_shell_hit(const void *a, const void *b)
+{
+	const struct shell_hit_event *x = a;
+	const struct shell_hit_event *y = b;
+
+	return (x->shell > y->shell) - (x->shell < y->shell);
+}
+
+#define SHELL_CHUNK 256
+static void move_shells(struct bz_world *w)
+{
+	struct shell_hit_event *hit = w->shell_hit;
+	int nhits = 0;
+
+	for (int i = 0; i < world_workers(w); i++)
+		worker_scratch(w, i)->nhits = 0;
+	parallel_for(w->pool, "move shells", w->shells.n, SHELL_CHUNK, move_shell_range, w);
+
+	for (int i = 0; i < world_workers(w); i++) {
+		struct bz_worker_scratch *q = worker_scratch(w, i);
+		memcpy(&hit[nhits], q->hit, sizeof(hit[0]) * q->nhits);
+		nhits += q->nhits;
+	}
+	qsort(hit, nhits, sizeof(hit[0]), compare_shell_hit);
+	for (int i = 0; i < nhits; i++)
+		apply_shell_hit(w, &hit[i]);
+}
+
+static int regenerate_tank(struct bz_world *w)
+{
+	int x, z, orientation;
+
+	x = (((int) xorshift(&w->xorshift_state)) % 256);
+	z = (((int) xorshift(&w->xorshift_state)) % 256);
+	orientation = (((int) xorshift(&w->xorshift_state)) % 128);
+	if (orientation < 0)
+		orientation = - orientation;
+
+	return add_tank(w, anchor_camera(w)->x + (x - 128) * 256, 0, anchor_camera(w)->z + (z - 128) * 256,
+			orientation);
+}
+
+/* Explosions for their own sake, to load the particle systems as a battle
+ * would.  They go off within an arcade map's width of the anchor.
+ */
+static void ambient_explosions(struct bz_world *w)
+{
+	const struct camera *c = anchor_camera(w);
+
+	w->explosion_credit += w->explosions_per_second;
+	while (w->explosion_credit >= TICKS_PER_SECOND) {
+		int x = (int) (xorshift(&w->xorshift_state) % 512) - 256;
+		int z = (int) (xorshift(&w->xorshift_state) % 512) - 256;
+
+		w->explosion_credit -= TICKS_PER_SECOND;
+		explosion(w, c->x + x * 256, 0, c->z + z * 256, SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
+	}
+}
+
+static void move_objects(struct bz_world *w)
+{
+	uint64_t t;
+
+	/* Static obstacles never move, so there is nothing to do for them */
+	t = profile_begin(PHASE_AI);
+	move_tanks(w);
+	profile_end(sim_phase_us, PHASE_AI, t);
+	t = profile_begin(PHASE_COLLISION);
+	move_shells(w);
+	profile_end(sim_phase_us, PHASE_COLLISION, t);
+	t = profile_begin(PHASE_MOVEMENT);
+
+	while (w->tanks.n < w->enemy_tank_count) {
+		if (w->respawn_ticks && w->sim_tick - w->last_respawn_tick < (uint32_t) w->respawn_ticks)
+			break;
+		if (regenerate_tank(w) < 0)
+			break;
+		w->last_respawn_tick = w->sim_tick;
+	}
+	ambient_explosions(w);
+
+	/* If a player is above normal ground level, make them fall */
+	for (int p = 0; p < w->nplayers; p++) {
+		struct camera *c = &w->player[p].camera;
+		if (!w->player[p].active || c->y <= CAMERA_GROUND_LEVEL)
+			continue;
+		c->vy -= (1 << 4);
+		c->x += c->vx;
+		c->y += c->vy;
+		c->z += c->vz;
+		if (c->y <= CAMERA_GROUND_LEVEL) {
+			c->y = CAMERA_GROUND_LEVEL;
+			c->vx = 0;
+			c->vy = 0;
+			c->vz = 0;
+		}
+	}
+	profile_end(sim_phase_us, PHASE_MOVEMENT, t);
+}
+
+static void remove_dead_objects(struct bz_world *w)
+{
+	for (int i = 0; i < w->tanks.n;) {
+		if (w->tanks.alive[i] > 0)
+			i++;
+		else
+			remove_tank(w, i);
+	}
+	for (int i = 0; i < w->shells.n;) {
+		if (w->shells.alive[i] > 0)
+			i++;
+		else
+			remove_shell(w, i);
+	}
+}
+
+static void simulate_tick(struct bz_world *w)
+{
+	uint64_t t;
+
+	for (int p = 0; p < w->nplayers; p++)
+		w->player[p].has_been_hit = 0;
+	w->sim_tick++;
+	t = profile_begin(PHASE_MOVEMENT);
+	run_timers(w);
+	stream_chunks(w);
+	profile_end(sim_phase_us, PHASE_MOVEMENT, t);
+	move_objects(w);
+	t = profile_begin(PHASE_MOVEMENT);
+	remove_dead_objects(w);
+	profile_end(sim_phase_us, PHASE_MOVEMENT, t);
+	t = profile_begin(PHASE_PARTICLES);
+	move_particles(w);
+	profile_end(sim_phase_us, PHASE_PARTICLES, t);
+}
+
+/* World checksums.  The simulation uses integers only, takes its input
+ * only through step_world() and keeps time only in ticks, so a world is
+ * reproduced exactly from its seed and the input of each tick, whatever the
+ * thread count.  After every tick the state that matters is hashed into
+ * w->checksum; two runs, or two builds, agree if their checksums agree tick
+ * for tick.  Everything carried from one tick to the next is hashed, down to
+ * the particles' velocities and tumble and the settings a scenario loaded, so
+ * that a divergence shows on the tick it happens rather than some ticks
+ * later.  Derived state (grids, the nav field, the timer wheel's own links)
+ * is left out.
+ */
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	uint64_t word;
+
+	if (n >= 32) {
+		/* Four independent lanes, so the multiplies overlap */
+		uint64_t lane[4] = { h, h ^ 1, h ^ 2, h ^ 3 };
+		for (; n >= 32; n -= 32, p += 32) {
+			for (int i = 0; i < 4; i++) {
+				memcpy(&word, p + 8 * i, 8);
+				lane[i] = (lane[i] ^ word) * HASH_MUL;
+				lane[i] ^= lane[i] >> 32;
+			}
+		}
+		h = lane[0] ^ (lane[1] * 3) ^ (lane[2] * 5) ^ (lane[3] * 7);
+	}
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy(&word, p, 8);
+		h = (h ^ word) * HASH_MUL;
+		h ^= h >> 32;
+	}
+	word = n;
+	memcpy(&word, p, n);
+	h = (h ^ word) * HASH_MUL;
+	return h ^ (h >> 32);
+}
+
+#define HASH_FIELD(h, field) hash_bytes((h), &(field), sizeof(field))
+#define HASH_PREFIX(h, array, n) hash_bytes((h), (array), sizeof((array)[0]) * (n))
+
+/* Obstacles are many and rarely change, so their hash is kept until they do */
+static uint64_t statics_checksum(struct bz_world *w)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	if (w->statics_checksum_version == w->statics_version)
+		return w->statics_checksum;
+	h = HASH_FIELD(h, w->statics.n);
+	h = HASH_PREFIX(h, w->statics.x, w->statics.n);
+	h = HASH_PREFIX(h, w->statics.z, w->statics.n);
+	h = HASH_PREFIX(h, w->statics.model, w->statics.n);
+	w->statics_checksum = h;
+	w->statics_checksum_version = w->statics_version;
+	return h;
+}
+
+static uint64_t world_checksum(struct bz_world *w)
+{
+	uint64_t h = statics_checksum(w);
+
+	h = HASH_FIELD(h, w->sim_tick);
+	h = HASH_FIELD(h, w->xorshift_state);
+	h = HASH_FIELD(h, w->particle_rng.state);
+	h = HASH_FIELD(h, w->enemy_tank_count);
+	h = HASH_FIELD(h, w->respawn_ticks);
+	h = HASH_FIELD(h, w->tank_cooldown_ticks);
+	h = HASH_FIELD(h, w->explosions_per_second);
+	h = HASH_FIELD(h, w->no_terrain);
+	h = HASH_FIELD(h, w->last_respawn_tick);
+	h = HASH_FIELD(h, w->explosion_credit);
+	h = HASH_FIELD(h, w->next_tank_id);
+	h = HASH_FIELD(h, w->next_shell_id);
+	h = HASH_FIELD(h, w->nplayers);
+	h = HASH_PREFIX(h, w->player, w->nplayers);
+	h = HASH_FIELD(h, w->chunks.origin_cx);
+	h = HASH_FIELD(h, w->chunks.origin_cz);
+
+	h = HASH_FIELD(h, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.x, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.z, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.orientation, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.alive, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.id, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.resume, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.counter, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.wake_tick, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.ai_tick, w->tanks.n);
+	h = HASH_PREFIX(h, w->tanks.y, w->tanks.n);
+
+	h = HASH_FIELD(h, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.x, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.z, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.vx, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.vz, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.alive, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.parent, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.id, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.y, w->shells.n);
+	h = HASH_PREFIX(h, w->shells.orientation, w->shells.n);
+	for (int i = 0; i < w->shells.n; i++) {
+		/* When the flight ends, rather than which timer ends it */
+		uint32_t expiry = w->shells.timer[i] >= 0 ? w->timers.timer[w->shells.timer[i]].expiry : 0;
+		h = HASH_FIELD(h, expiry);
+	}
+
+	h = HASH_FIELD(h, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.x, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.y, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.z, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.vx, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.vy, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.vz, w->sparks.n);
+	h = HASH_PREFIX(h, w->sparks.expiry, w->sparks.n);
+
+	h = HASH_FIELD(h, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.x, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.y, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.z, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.vx, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.vy, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.vz, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.expiry, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.orientation, w->debris.n);
+	h = HASH_PREFIX(h, w->debris.spin, w->debris.n);
+	return h;
+}
+
+/* Advance w by one tick, each player pressing the BUTTON_* bits in their
+ * keypress_latches.
+ */
+static void step_players(struct bz_world *w)
+{
+	uint64_t t;
+
+	trace_begin("tick");
+	if (w->sounds)
+		w->sounds->n = 0;
+	t = profile_begin(PHASE_INPUT);
+	if (t)
+		memset(sim_phase_us, 0, sizeof(sim_phase_us));
+	check_buttons(w);
+	profile_end(sim_phase_us, PHASE_INPUT, t);
+	simulate_tick(w);
+	w->checksum = world_checksum(w);
+	trace_end("tick");
+}
+
+/* Advance w by one tick with player 0 pressing the BUTTON_* bits in input */
+static void step_world(struct bz_world *w, uint32_t input)
+{
+	w->player[0].keypress_latches = input;
+	step_players(w);
+}
+
+/* Stands in for a player when nobody is at the controls: turn on the spot
+ * and fire every few ticks, so that shells, explosions and debris get
+ * exercised along with the tanks.  If drive is set, head straight on instead,
+ * turning only to get around obstacles, so that the world streams past.
+ * Returns player p's input for the next tick.
+ */
+static uint32_t scripted_player_input(struct bz_world *w, int p, int drive)
+{
+	const struct camera *c = &w->player[p].camera;
+	uint32_t input = BUTTON_LEFT;
+
+	if (drive && !player_obstacle_collision(w, c->x - sine(c->orientation), c->z - cosine(c->orientation)))
+		input = BUTTON_UP;
+	if ((w->sim_tick % 8) == 0)
+		input |= BUTTON_FIRE;
+	return input;
+}
+
+/* The autopilot plays in place of a person, for unattended soak and load
+ * runs.  It wanders about, turning away from whatever it runs into, and when
+ * a tank comes in range it turns to face it and fires.  It has a random
+ * number generator of its own, so a given seed always plays the same game.
+ */
+#define AUTOPILOT_RANGE (400 * 256) /* shells carry about 500 units */
+#define AUTOPILOT_SHOT_TICKS 10 /* between shots */
+
+struct autopilot {
+	unsigned int rng;
+	int heading; /* to wander or detour on */
+	int wander_ticks; /* until picking another */
+	int detour_ticks; /* left going around something, whatever is in range */
+	uint32_t last_shot; /* sim_tick */
+};
+
+static void autopilot_init(struct autopilot *a, unsigned int seed)
+{
+	memset(a, 0, sizeof(*a));
+	a->rng = seed ? seed : 0xa5a5a5a5;
+}
+
+/* Returns player p's input for the next tick */
+static uint32_t autopilot_input(struct bz_world *w, int p, struct autopilot *a)
+{
+	const struct camera *c = &w->player[p].camera;
+	int64_t best = AUTOPILOT_RANGE;
+	int target = -1, heading, da;
+	uint32_t input = 0;
+
+	for (int i = 0; i < w->tanks.n; i++) {
+		int64_t dx = llabs((int64_t) w->tanks.x[i] - c->x);
+		int64_t dz = llabs((int64_t) w->tanks.z[i] - c->z);
+		int64_t d = dx > dz ? dx : dz;
+		if (d < best) {
+			best = d;
+			target = i;
+		}
+	}
+	if (a->detour_ticks > 0) {
+		a->detour_ticks--;
+		heading = a->heading;
+	} else if (target >= 0) {
+		heading = heading_to(w->tanks.x[target] - c->x, w->tanks.z[target] - c->z);
+	} else {
+		if (--a->wander_ticks <= 0) {
+			a->heading = xorshift(&a->rng) % 128;
+			a->wander_ticks = 2 * TICKS_PER_SECOND + xorshift(&a->rng) % (8 * TICKS_PER_SECOND);
+		}
+		heading = a->heading;
+	}
+
+	da = (heading - c->orientation) & 127;
+	if (da > 64)
+		da -= 128;
+	if (da > 0)
+		input |= BUTTON_RIGHT;
+	else if (da < 0)
+		input |= BUTTON_LEFT;
+	if (abs(da) > 2)
+		return input;
+
+	if (target >= 0 && !a->detour_ticks && w->sim_tick - a->last_shot >= AUTOPILOT_SHOT_TICKS) {
+		input |= BUTTON_FIRE;
+		a->last_shot = w->sim_tick;
+	}
+	if (target < 0 || a->detour_ticks || best > AUTOPILOT_RANGE / 2) {
+		if (player_obstacle_collision(w, c->x - sine(c->orientation), c->z - cosine(c->orientation))) {
+			/* Blocked, so go off some other way for a while */
+			a->heading = (c->orientation + 32 + xorshift(&a->rng) % 64) & 127;
+			a->detour_ticks = TICKS_PER_SECOND;
+		} else {
+			input |= BUTTON_UP;
+		}
+	}
+	return input;
+}
+
+/* Varints: seven bits to a byte, least significant first, the top bit set
+ * on all but the last byte.  Used by replay files and network packets.
+ */
+static int put_varint(unsigned char *p, uint64_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char) v;
+	return n;
+}
+
+/* Bounds checked reading from a buffer; bad is set on running off the end */
+struct cursor {
+	const unsigned char *p, *end;
+	int bad;
+};
+
+static uint64_t get_varint(struct cursor *c)
+{
+	uint64_t v = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (c->p >= c->end)
+			break;
+		unsigned char b = *c->p++;
+		v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+	}
+	c->bad = 1;
+	return 0;
+}
+
+#ifndef BTWASM
+/* Networked play.  A server runs the arena and is the only authority on it.
+ * Clients send it their input and draw what it sends back, but move their
+ * own tank at once rather than wait to hear where it went.  Everything goes
+ * in UDP datagrams, any of which may be lost, repeated or late.
+ *
+ * After each tick the server reduces the world to a snapshot: the players,
+ * tanks and shells, sorted on a key made of their kind and stable id, each
+ * with a few fields in the same fixed point the simulation uses.  A client
+ * is sent the difference between that and the newest snapshot it has said
+ * it received, if the server still has that one, or else the whole thing:
+ *
+ *	'S' varint tick, varint ticks back to the baseline (0 for none), then
+ *	    for no baseline only, varint seed; varint the client's player,
+ *	    varint the last of their inputs applied, zigzag varint origin
+ *	    chunk x and z; varint count, then the varint key steps of the
+ *	    entities removed; varint count, then for each entity added or
+ *	    changed a varint key step, a byte of which fields changed and the
+ *	    zigzag varint change in each
+ *
+ * Clients send one of these every tick:
+ *
+ *	'J' asking to join, until a snapshot says which player they are
+ *	'I' varint newest snapshot tick received, varint sequence number of
+ *	    the newest input, varint count, then that many inputs (BUTTON_*
+ *	    bits) newest first, so that input in a lost packet still arrives
+ *	'L' on leaving
+ *
+ * Obstacles are not sent, as clients generate the same chunks from the
+ * seed, and nor are sparks or debris; clients make their own explosions
+ * where tanks disappear.
+ */
+#define NET_HISTORY 32 /* snapshots kept as baselines, about a second */
+#define NET_FIELDS 6
+#define NET_MAX_ENTITIES (MAX_PLAYERS + 2048) /* any more are not sent */
+#define NET_MAX_PACKET 60000 /* bigger snapshots are not sent */
+#define NET_PACKET_BUF (NET_MAX_ENTITIES * (2 * 10 + 1 + NET_FIELDS * 5) + 64)
+#define NET_INPUT_HISTORY 64 /* inputs a client remembers, for resending and prediction */
+#define NET_INPUT_REDUNDANCY 4
+#define NET_INPUT_QUEUE 8 /* inputs a server holds for each client */
+#define NET_TIMEOUT_TICKS (5 * TICKS_PER_SECOND)
+
+enum net_kind {
+	NET_PLAYER, /* x, y, z, orientation, kills, deaths */
+	NET_TANK, /* x, y, z, orientation */
+	NET_SHELL, /* x, y, z, orientation, parent */
+};
+#define NET_KEY(kind, id) ((uint64_t) (kind) << 32 | (uint32_t) (id))
+#define NET_KIND(key) ((int) ((key) >> 32))
+#define NET_ID(key) ((int32_t) (uint32_t) (key))
+
+struct net_entity {
+	uint64_t key;
+	int32_t f[NET_FIELDS];
+};
+
+struct net_state {
+	uint32_t tick; /* 0 for none */
+	int64_t origin_cx, origin_cz;
+	int n;
+	struct net_entity e[NET_MAX_ENTITIES];
+};
+
+/* Packet loss, for testing */
+static int net_loss_percent;
+static unsigned int net_loss_state = 0x12345678;
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* The server side of snapshots */
+#ifdef BTSERVER
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int compare_net_entity(const void *a, const void *b)
+{
+	const struct net_entity *x = a;
+	const struct net_entity *y = b;
+
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static void net_add_entity(struct net_state *s, uint64_t key, int32_t x, int32_t y, int32_t z,
+				int32_t a, int32_t b, int32_t c)
+{
+	struct net_entity *e;
+
+	if (s->n >= NET_MAX_ENTITIES)
+		return;
+	e = &s->e[s->n++];
+	e->key = key;
+	e->f[0] = x;
+	e->f[1] = y;
+	e->f[2] = z;
+	e->f[3] = a;
+	e->f[4] = b;
+	e->f[5] = c;
+}
+
+static void net_capture(struct bz_world *w, struct net_state *s)
+{
+	int tanks;
+
+	s->tick = w->sim_tick;
+	s->origin_cx = w->chunks.origin_cx;
+	s->origin_cz = w->chunks.origin_cz;
+	s->n = 0;
+	for (int p = 0; p < w->nplayers; p++) {
+		const struct bz_player *pl = &w->player[p];
+		if (pl->active)
+			net_add_entity(s, NET_KEY(NET_PLAYER, p), pl->camera.x, pl->camera.y, pl->camera.z,
+					pl->camera.orientation, pl->kills, pl->deaths);
+	}
+	tanks = s->n;
+	for (int i = 0; i < w->tanks.n; i++)
+		net_add_entity(s, NET_KEY(NET_TANK, w->tanks.id[i]), w->tanks.x[i], w->tanks.y[i],
+				w->tanks.z[i], w->tanks.orientation[i], 0, 0);
+	qsort(&s->e[tanks], s->n - tanks, sizeof(s->e[0]), compare_net_entity);
+	int shells = s->n;
+	for (int i = 0; i < w->shells.n; i++)
+		net_add_entity(s, NET_KEY(NET_SHELL, w->shells.id[i]), w->shells.x[i], w->shells.y[i],
+				w->shells.z[i], w->shells.orientation[i], w->shells.parent[i], 0);
+	qsort(&s->e[shells], s->n - shells, sizeof(s->e[0]), compare_net_entity);
+}
+
+/* Encodes s as a change from base, or whole if base is NULL, for player p
+ * whose inputs up to seq have been applied.  Returns the packet length.
+ */
+static size_t net_encode(unsigned char *out, const struct net_state *base, const struct net_state *s,
+			unsigned int seed, int p, uint32_t seq)
+{
+	static const struct net_state empty;
+	unsigned char *q = out;
+	int nremoved = 0, nchanged = 0;
+	uint64_t last;
+	int i, j;
+
+	if (!base)
+		base = &empty;
+	*q++ = 'S';
+	q += put_varint(q, s->tick);
+	q += put_varint(q, base->tick ? s->tick - base->tick : 0);
+	if (!base->tick)
+		q += put_varint(q, seed);
+	q += put_varint(q, p);
+	q += put_varint(q, seq);
+	q += put_varint(q, zigzag(s->origin_cx));
+	q += put_varint(q, zigzag(s->origin_cz));
+
+	for (i = 0, j = 0; i < base->n; i++) {
+		while (j < s->n && s->e[j].key < base->e[i].key)
+			j++;
+		if (j == s->n || s->e[j].key != base->e[i].key)
+			nremoved++;
+	}
+	q += put_varint(q, nremoved);
+	for (i = 0, j = 0, last = 0; i < base->n; i++) {
+		while (j < s->n && s->e[j].key < base->e[i].key)
+			j++;
+		if (j == s->n || s->e[j].key != base->e[i].key) {
+			q += put_varint(q, base->e[i].key - last);
+			last = base->e[i].key;
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1)
+			q += put_varint(q, nchanged);
+		for (i = 0, j = 0, last = 0; j < s->n; j++) {
+			static const int32_t zero[NET_FIELDS];
+			const int32_t *from = zero;
+			int mask = 0;
+
+			while (i < base->n && base->e[i].key < s->e[j].key)
+				i++;
+			if (i < base->n && base->e[i].key == s->e[j].key)
+				from = base->e[i].f;
+			for (int f = 0; f < NET_FIELDS; f++)
+				if (s->e[j].f[f] != from[f])
+					mask |= 1 << f;
+			if (from != zero && mask == 0)
+				continue;
+			if (pass == 0) {
+				nchanged++;
+				continue;
+			}
+			q += put_varint(q, s->e[j].key - last);
+			last = s->e[j].key;
+			*q++ = (unsigned char) mask;
+			for (int f = 0; f < NET_FIELDS; f++)
+				if (mask & (1 << f))
+					q += put_varint(q, zigzag((int64_t) s->e[j].f[f] - from[f]));
+		}
+	}
+	return q - out;
+}
+#endif
+
+struct net_client {
+	int fd;
+	struct sockaddr_in server;
+	int player; /* -1 until the server says */
+	uint32_t seq; /* of the newest input */
+	uint32_t input[NET_INPUT_HISTORY]; /* by sequence number */
+	struct camera predicted[NET_INPUT_HISTORY]; /* where each input took the player */
+	struct net_state *state; /* NET_HISTORY snapshots, by tick */
+	uint32_t newest; /* tick of the newest snapshot received */
+	uint32_t applied; /* and of the one shown */
+	uint32_t applied_seq; /* last input the server had applied in it */
+	uint64_t removed[NET_MAX_ENTITIES]; /* decoding scratch */
+	uint64_t bytes_in, bytes_out, snapshots, discarded, corrections, thrown;
+};
+
+/* Decodes a snapshot into c->state.  Returns its tick, or 0 if it is damaged,
+ * stale, or a change from a snapshot this client no longer has.
+ */
+static uint32_t net_decode(struct net_client *c, struct bz_world *w, const unsigned char *p, size_t len)
+{
+	struct cursor cur = { p + 1, p + len, 0 };
+	const struct net_state *base;
+	struct net_state *s;
+	uint64_t player;
+	uint32_t tick, back, seq;
+	int nremoved, nchanged, i = 0, r = 0;
+	int64_t ocx, ocz;
+	uint64_t last = 0;
+
+	tick = (uint32_t) get_varint(&cur);
+	back = (uint32_t) get_varint(&cur);
+	if (back == 0) {
+		unsigned int seed = (unsigned int) get_varint(&cur);
+		if (!cur.bad && seed != w->seed) {
+			w->seed = seed;
+			w->xorshift_state = 0;
+			battlezone_init(w);
+		}
+	}
+	player = get_varint(&cur);
+	seq = (uint32_t) get_varint(&cur);
+	ocx = unzigzag(get_varint(&cur));
+	ocz = unzigzag(get_varint(&cur));
+	if (cur.bad || tick == 0 || back >= NET_HISTORY || player >= MAX_PLAYERS)
+		return 0;
+	s = &c->state[tick % NET_HISTORY];
+	if ((int32_t) (tick - s->tick) <= 0)
+		return 0; /* already have it, or something newer in its place */
+	base = back ? &c->state[(tick - back) % NET_HISTORY] : NULL;
+	if (base && base->tick != tick - back)
+		return 0;
+
+	nremoved = (int) get_varint(&cur);
+	if (nremoved < 0 || nremoved > (base ? base->n : 0))
+		return 0;
+	for (int k = 0; k < nremoved; k++) {
+		last += get_varint(&cur);
+		c->removed[k] = last;
+	}
+	nchanged = (int) get_varint(&cur);
+	if (cur.bad || nchanged < 0 || nchanged > NET_MAX_ENTITIES)
+		return 0;
+
+	s->tick = 0; /* until it is complete */
+	s->n = 0;
+	last = 0;
+	for (int k = 0; k <= nchanged; k++) {
+		uint64_t key = UINT64_MAX;
+		int mask = 0;
+		if (k < nchanged) {
+			key = last + get_varint(&cur);
+			last = key;
+			if (cur.p < cur.end)
+				mask = *cur.p++;
+			else
+				cur.bad = 1;
+		}
+		/* Carry over unchanged entities which sort before this one */
+		while (base && i < base->n && base->e[i].key < key) {
+			if (r < nremoved && c->removed[r] == base->e[i].key)
+				r++;
+			else if (s->n < NET_MAX_ENTITIES)
+				s->e[s->n++] = base->e[i];
+			i++;
+		}
+		if (k == nchanged || cur.bad || s->n >= NET_MAX_ENTITIES)
+			break;
+		struct net_entity *e = &s->e[s->n++];
+		if (base && i < base->n && base->e[i].key == key)
+			*e = base->e[i++];
+		else
+			memset(e, 0, sizeof(*e));
+		e->key = key;
+		for (int f = 0; f < NET_FIELDS; f++)
+			if (mask & (1 << f))
+				e->f[f] = (int32_t) (e->f[f] + unzigzag(get_varint(&cur)));
+	}
+	if (cur.bad || cur.p != cur.end)
+		return 0;
+	s->tick = tick;
+	s->origin_cx = ocx;
+	s->origin_cz = ocz;
+	if ((int32_t) (tick - c->newest) > 0) {
+		c->newest = tick;
+		c->player = (int) player;
+		c->applied_seq = seq;
+	}
+	return tick;
+}
+
+/* Shows snapshot s in w, then replays the inputs the server has not yet
+ * applied on top of the player's position in it.
+ */
+static void net_apply(struct net_client *c, struct bz_world *w, const struct net_state *s)
+{
+	const struct net_state *prev = &c->state[c->applied % NET_HISTORY];
+	const int me = c->player;
+	struct camera *mine = &w->player[me].camera;
+	int was_dead = w->player[me].deaths;
+
+	if (s->origin_cx != w->chunks.origin_cx || s->origin_cz != w->chunks.origin_cz)
+		shift_origin(w, (int32_t) (s->origin_cx - w->chunks.origin_cx),
+				(int32_t) (s->origin_cz - w->chunks.origin_cz));
+
+	/* Tanks which have gone were most likely shot */
+	if (prev->tick == c->applied && prev->origin_cx == s->origin_cx && prev->origin_cz == s->origin_cz) {
+		for (int i = 0, j = 0; i < prev->n; i++) {
+			if (NET_KIND(prev->e[i].key) != NET_TANK)
+				continue;
+			while (j < s->n && s->e[j].key < prev->e[i].key)
+				j++;
+			if (j == s->n || s->e[j].key != prev->e[i].key)
+				explosion(w, prev->e[i].f[0], prev->e[i].f[1], prev->e[i].f[2],
+					SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
+		}
+	}
+	/* and shells which have appeared were just fired */
+	if (prev->tick == c->applied) {
+		for (int i = 0, j = 0; i < s->n; i++) {
+			if (NET_KIND(s->e[i].key) != NET_SHELL)
+				continue;
+			while (j < prev->n && prev->e[j].key < s->e[i].key)
+				j++;
+			if (j == prev->n || prev->e[j].key != s->e[i].key)
+				add_sound(w, SOUND_GUN, s->e[i].f[0], s->e[i].f[1], s->e[i].f[2]);
+		}
+	}
+
+	for (int p = 0; p < w->nplayers; p++)
+		w->player[p].active = 0;
+	w->tanks.n = 0;
+	w->nawake = 0;
+	w->shells.n = 0;
+	for (int i = 0; i < s->n; i++) {
+		const struct net_entity *e = &s->e[i];
+		int32_t id = NET_ID(e->key);
+		int n;
+
+		switch (NET_KIND(e->key)) {
+		case NET_PLAYER: {
+			struct bz_player *pl;
+			if (id < 0 || id >= MAX_PLAYERS)
+				break;
+			pl = &w->player[id];
+			if (!pl->camera.eyedist)
+				add_player(w, id, e->f[0], e->f[2]);
+			pl->active = 1;
+			pl->camera.x = e->f[0];
+			pl->camera.y = e->f[1];
+			pl->camera.z = e->f[2];
+			pl->camera.orientation = e->f[3];
+			pl->kills = e->f[4];
+			pl->deaths = e->f[5];
+			break;
+		}
+		case NET_TANK:
+			n = add_tank(w, e->f[0], e->f[1], e->f[2], e->f[3]);
+			if (n >= 0)
+				w->tanks.id[n] = id;
+			break;
+		case NET_SHELL:
+			n = w->shells.n;
+			if (n >= MAX_SHELLS)
+				break;
+			w->shells.x[n] = e->f[0];
+			w->shells.y[n] = e->f[1];
+			w->shells.z[n] = e->f[2];
+			w->shells.orientation[n] = e->f[3];
+			w->shells.parent[n] = e->f[4];
+			w->shells.id[n] = id;
+			w->shells.vx[n] = 0;
+			w->shells.vz[n] = 0;
+			w->shells.alive[n] = 1;
+			w->shells.timer[n] = -1;
+			w->shells.n++;
+			break;
+		}
+	}
+	c->applied = s->tick;
+	w->sim_tick = s->tick;
+	w->view_player = me;
+	w->player[me].has_been_hit = w->player[me].deaths > was_dead;
+
+	/* Check the prediction the server has caught up with, then predict again from there */
+	if (c->seq - c->applied_seq < NET_INPUT_HISTORY && c->applied_seq != 0) {
+		const struct camera *guess = &c->predicted[c->applied_seq % NET_INPUT_HISTORY];
+		/* Only steering is predicted, not being thrown by a hit */
+		if (guess->x != mine->x || guess->z != mine->z || guess->orientation != mine->orientation) {
+			if (mine->y == CAMERA_GROUND_LEVEL && guess->y == CAMERA_GROUND_LEVEL)
+				c->corrections++;
+			else
+				c->thrown++;
+		}
+		for (uint32_t seq = c->applied_seq + 1; (int32_t) (c->seq - seq) >= 0; seq++) {
+			w->player[me].keypress_latches = c->input[seq % NET_INPUT_HISTORY];
+			steer_player(w, me);
+			c->predicted[seq % NET_INPUT_HISTORY] = *mine;
+		}
 	}
-	if (button_pressed(BUTTON_UP)) {
-		keypress_latches &= ~BUTTON_UP;
-		/* This seems "off", but... works?  Something's screwy about the coord system
-		 * I think. */
-		int nx, nz;
-		nx = camera.x - sine(camera.orientation);
-		nz = camera.z - cosine(camera.orientation);
-		if (!player_obstacle_collision(nx, nz)) {
-			camera.x = nx;
-			camera.z = nz;
-		} else {
-			bump_player();
+	stream_chunks(w);
+}
+
+static int net_send(int fd, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+	if (net_loss_percent > 0 && (int) (xorshift(&net_loss_state) % 100) < net_loss_percent)
+		return 0;
+	return sendto(fd, buf, len, 0, (const struct sockaddr *) to, sizeof(*to)) < 0 ? -1 : 0;
+}
+
+/* Looks up host, and makes a non-blocking UDP socket, bound to host:port if
+ * bind_it is set.
+ */
+static int net_socket(const char *host, int port, struct sockaddr_in *addr, int bind_it)
+{
+	struct addrinfo hints, *res;
+	char service[16];
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = bind_it ? AI_PASSIVE : 0;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		fprintf(stderr, "Cannot find %s\n", host ? host : "local address");
+		return -1;
+	}
+	memcpy(addr, res->ai_addr, sizeof(*addr));
+	freeaddrinfo(res);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || (bind_it && bind(fd, (struct sockaddr *) addr, sizeof(*addr)) != 0) ||
+		fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+		fprintf(stderr, "Cannot open UDP port %d: %s\n", port, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static struct net_client *net_client_open(const char *host, int port)
+{
+	struct net_client *c = calloc(1, sizeof(*c));
+
+	if (!c || !(c->state = calloc(NET_HISTORY, sizeof(*c->state)))) {
+		fprintf(stderr, "Out of memory for a network client\n");
+		free(c);
+		return NULL;
+	}
+	c->player = -1;
+	c->fd = net_socket(host, port, &c->server, 0);
+	if (c->fd < 0) {
+		free(c->state);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void net_client_close(struct net_client *c)
+{
+	const unsigned char leave = 'L';
+
+	net_send(c->fd, &leave, 1, &c->server);
+	close(c->fd);
+	free(c->state);
+	free(c);
+}
+
+/* One tick of a networked client: take in what the server has sent, then
+ * send it input for the next tick and act on that at once.
+ */
+static void net_client_tick(struct net_client *c, struct bz_world *w, uint32_t input)
+{
+	unsigned char buf[NET_MAX_PACKET];
+	unsigned char *q = buf;
+	ssize_t len;
+
+	/* Until EAGAIN, an empty datagram being no reason to stop */
+	while ((len = recv(c->fd, buf, sizeof(buf), 0)) >= 0) {
+		if (len == 0)
+			continue;
+		c->bytes_in += len;
+		if (buf[0] == 'S' && net_decode(c, w, buf, len))
+			c->snapshots++;
+		else
+			c->discarded++; /* damaged, late or repeated */
+	}
+	/* There is no step_players() here to clear the last tick's sounds */
+	if (w->sounds)
+		w->sounds->n = 0;
+	if (c->player >= 0 && c->newest != c->applied)
+		net_apply(c, w, &c->state[c->newest % NET_HISTORY]);
+	move_particles(w);
+
+	if (c->player < 0) {
+		const unsigned char join = 'J';
+		net_send(c->fd, &join, 1, &c->server);
+		c->bytes_out++;
+		return;
+	}
+	input &= ~BUTTON_QUIT;
+	c->seq++;
+	c->input[c->seq % NET_INPUT_HISTORY] = input;
+	w->player[c->player].keypress_latches = input;
+	steer_player(w, c->player);
+	c->predicted[c->seq % NET_INPUT_HISTORY] = w->player[c->player].camera;
+
+	*q++ = 'I';
+	q += put_varint(q, c->newest);
+	q += put_varint(q, c->seq);
+	int n = c->seq < NET_INPUT_REDUNDANCY ? (int) c->seq : NET_INPUT_REDUNDANCY;
+	q += put_varint(q, n);
+	for (int i = 0; i < n; i++)
+		q += put_varint(q, c->input[(c->seq - i) % NET_INPUT_HISTORY]);
+	net_send(c->fd, buf, q - buf, &c->server);
+	c->bytes_out += q - buf;
+}
+
+/* The server itself */
+#ifdef BTSERVER
+struct net_peer {
+	int active;
+	struct sockaddr_in addr;
+	uint32_t last_heard; /* sim_tick */
+	uint32_t acked; /* newest snapshot tick the client has */
+	uint32_t queued_seq; /* sequence number of the newest input queued */
+	uint32_t applied_seq; /* and of the last one applied */
+	int head, nqueued;
+	uint32_t queue[NET_INPUT_QUEUE], queue_seq[NET_INPUT_QUEUE];
+	uint32_t held; /* input last applied */
+};
+
+struct net_server {
+	int fd;
+	struct net_peer peer[MAX_PLAYERS]; /* by player */
+	struct net_state *history; /* NET_HISTORY snapshots, by tick */
+	unsigned char packet[NET_PACKET_BUF];
+	uint64_t bytes_in, bytes_out, snapshots, whole_snapshots, oversize;
+	uint64_t ticks, tick_us, sim_us, snapshot_us;
+};
+
+static struct net_server *net_server_open(const char *host, int port, struct bz_world *w)
+{
+	struct net_server *srv = calloc(1, sizeof(*srv));
+	struct sockaddr_in addr;
+
+	if (!srv || !(srv->history = calloc(NET_HISTORY, sizeof(*srv->history)))) {
+		fprintf(stderr, "Out of memory for a network server\n");
+		free(srv);
+		return NULL;
+	}
+	srv->fd = net_socket(host, port, &addr, 1);
+	if (srv->fd < 0) {
+		free(srv->history);
+		free(srv);
+		return NULL;
+	}
+	for (int p = 0; p < w->nplayers; p++)
+		w->player[p].active = 0; /* players only come in over the network */
+	return srv;
+}
+
+/* The port srv is listening on */
+static int net_server_port(struct net_server *srv)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(srv->fd, (struct sockaddr *) &addr, &len) != 0)
+		return -1;
+	return ntohs(addr.sin_port);
+}
+
+static int net_find_peer(struct net_server *srv, const struct sockaddr_in *from)
+{
+	for (int p = 0; p < MAX_PLAYERS; p++)
+		if (srv->peer[p].active && srv->peer[p].addr.sin_port == from->sin_port &&
+			srv->peer[p].addr.sin_addr.s_addr == from->sin_addr.s_addr)
+			return p;
+	return -1;
+}
+
+static void net_join(struct net_server *srv, struct bz_world *w, const struct sockaddr_in *from)
+{
+	const struct camera *a = anchor_camera(w);
+	int32_t x = a->x, z = a->z;
+	int p;
+
+	for (p = 0; p < MAX_PLAYERS; p++)
+		if (!srv->peer[p].active)
+			break;
+	if (p == MAX_PLAYERS)
+		return; /* full, they will keep asking */
+	/* Somewhere clear, near everyone else */
+	for (int tries = 0; tries < 16; tries++) {
+		x = a->x + ((int) (xorshift(&w->xorshift_state) % 128) - 64) * 256;
+		z = a->z + ((int) (xorshift(&w->xorshift_state) % 128) - 64) * 256;
+		if (!player_obstacle_collision(w, x, z))
+			break;
+	}
+	memset(&srv->peer[p], 0, sizeof(srv->peer[p]));
+	srv->peer[p].active = 1;
+	srv->peer[p].addr = *from;
+	srv->peer[p].last_heard = w->sim_tick;
+	add_player(w, p, x, z);
+}
+
+static void net_leave(struct net_server *srv, struct bz_world *w, int p)
+{
+	srv->peer[p].active = 0;
+	w->player[p].active = 0;
+}
+
+static void net_take_input(struct net_peer *peer, struct cursor *c)
+{
+	uint32_t acked = (uint32_t) get_varint(c);
+	uint32_t seq = (uint32_t) get_varint(c);
+	int n = (int) get_varint(c);
+	uint32_t input[NET_INPUT_REDUNDANCY];
+
+	if (c->bad || n < 0 || n > NET_INPUT_REDUNDANCY)
+		return;
+	for (int i = 0; i < n; i++)
+		input[i] = (uint32_t) get_varint(c);
+	if (c->bad)
+		return;
+	if ((int32_t) (acked - peer->acked) > 0)
+		peer->acked = acked;
+	/* Oldest first, skipping any already queued */
+	for (int i = n - 1; i >= 0; i--) {
+		if ((int32_t) (seq - i - peer->queued_seq) <= 0)
+			continue;
+		if (peer->nqueued == NET_INPUT_QUEUE) { /* too far behind, drop the oldest */
+			peer->head = (peer->head + 1) % NET_INPUT_QUEUE;
+			peer->nqueued--;
 		}
+		int slot = (peer->head + peer->nqueued++) % NET_INPUT_QUEUE;
+		peer->queue[slot] = input[i] & ~BUTTON_QUIT;
+		peer->queue_seq[slot] = seq - i;
+		peer->queued_seq = seq - i;
 	}
-	if (button_pressed(BUTTON_DOWN)) {
-		keypress_latches &= ~BUTTON_DOWN;
-		/* This seems "off", but... works?  Something's screwy about the coord system
-		 * I think. */
-		int nx, nz;
-		nz = camera.z + cosine(camera.orientation);
-		nx = camera.x + sine(camera.orientation);
-		if (!player_obstacle_collision(nx, nz)) {
-			camera.x = nx;
-			camera.z = nz;
+}
+
+static void net_server_receive(struct net_server *srv, struct bz_world *w)
+{
+	unsigned char buf[256];
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	ssize_t len;
+
+	/* Until EAGAIN, an empty datagram being no reason to stop */
+	while ((len = recvfrom(srv->fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen)) >= 0) {
+		int p;
+		struct cursor c = { buf + 1, buf + len, 0 };
+
+		fromlen = sizeof(from);
+		if (len == 0)
+			continue;
+		p = net_find_peer(srv, &from);
+		srv->bytes_in += len;
+		if (p < 0) {
+			if (buf[0] == 'J')
+				net_join(srv, w, &from);
+			continue;
+		}
+		srv->peer[p].last_heard = w->sim_tick;
+		if (buf[0] == 'I')
+			net_take_input(&srv->peer[p], &c);
+		else if (buf[0] == 'L')
+			net_leave(srv, w, p);
+	}
+}
+
+/* One tick of the server: take in input, step the world and send everyone a
+ * snapshot.
+ */
+static void net_server_tick(struct net_server *srv, struct bz_world *w)
+{
+	uint64_t start = rtc_get_us_since_boot(), sim_start, snapshot_start;
+
+	net_server_receive(srv, w);
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		struct net_peer *peer = &srv->peer[p];
+
+		if (!peer->active)
+			continue;
+		if (w->sim_tick - peer->last_heard > NET_TIMEOUT_TICKS) {
+			net_leave(srv, w, p);
+			continue;
+		}
+		if (peer->nqueued) {
+			peer->held = peer->queue[peer->head];
+			peer->applied_seq = peer->queue_seq[peer->head];
+			peer->head = (peer->head + 1) % NET_INPUT_QUEUE;
+			peer->nqueued--;
+			w->player[p].keypress_latches = peer->held;
 		} else {
-			bump_player();
+			/* Nothing has come in time; keep on as before, but hold fire */
+			w->player[p].keypress_latches = peer->held & ~BUTTON_FIRE;
+		}
+	}
+
+	sim_start = rtc_get_us_since_boot();
+	step_players(w);
+	snapshot_start = rtc_get_us_since_boot();
+
+	struct net_state *s = &srv->history[w->sim_tick % NET_HISTORY];
+	net_capture(w, s);
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		struct net_peer *peer = &srv->peer[p];
+		const struct net_state *base = NULL;
+		size_t len;
+
+		if (!peer->active)
+			continue;
+		if (peer->acked && w->sim_tick - peer->acked < NET_HISTORY &&
+			srv->history[peer->acked % NET_HISTORY].tick == peer->acked)
+			base = &srv->history[peer->acked % NET_HISTORY];
+		len = net_encode(srv->packet, base, s, w->seed, p, peer->applied_seq);
+		if (len > NET_MAX_PACKET) {
+			srv->oversize++;
+			continue;
 		}
+		net_send(srv->fd, srv->packet, len, &peer->addr);
+		srv->bytes_out += len;
+		srv->snapshots++;
+		srv->whole_snapshots += !base;
 	}
-	if (button_pressed(BUTTON_QUIT))
-		battlezone_state = BATTLEZONE_EXIT;
+	srv->ticks++;
+	srv->sim_us += snapshot_start - sim_start;
+	srv->snapshot_us += rtc_get_us_since_boot() - snapshot_start;
+	srv->tick_us += rtc_get_us_since_boot() - start;
 }
 
-static void project_vertex(struct camera *c, struct bz_vertex *v, struct bz_object *o)
+static int net_server_players(const struct net_server *srv)
 {
-	int32_t x, y, z, a, nx, ny, nz;
+	int n = 0;
 
-	a = o->orientation;
-	a = -a;
-	if (a < 0)
-		a = a + 128;
-	if (a >= 128)
-		a = a - 128;
+	for (int p = 0; p < MAX_PLAYERS; p++)
+		n += srv->peer[p].active;
+	return n;
+}
 
-	/* Rotate for object orientation */
-	nx = ((-v->x * cosine(a)) / 256) - ((v->z * sine(a)) / 256);
-	ny = v->y;
-	nz = ((v->z * cosine(a)) / 256) - ((v->x * sine(a)) / 256); 
-	x = nx;
-	y = ny;
-	z = nz;
+static void net_server_report(struct net_server *srv)
+{
+	int players = net_server_players(srv);
+	double ticks = srv->ticks ? (double) srv->ticks : 1.0;
+	double per_client = srv->snapshots ? (double) srv->bytes_out / srv->snapshots : 0.0;
+
+	printf("%d players: server tick %.1f us (simulation %.1f, snapshots %.1f), %.0f bytes/tick in\n",
+		players, srv->tick_us / ticks, srv->sim_us / ticks, srv->snapshot_us / ticks,
+		srv->bytes_in / ticks);
+	printf("snapshots: %.0f bytes each, %.1f KB/s per client at %d ticks/sec, %llu sent whole, %llu too big\n",
+		per_client, per_client * TICKS_PER_SECOND / 1024.0, TICKS_PER_SECOND,
+		(unsigned long long) srv->whole_snapshots, (unsigned long long) srv->oversize);
+	srv->bytes_in = srv->bytes_out = srv->snapshots = srv->whole_snapshots = srv->oversize = 0;
+	srv->ticks = srv->tick_us = srv->sim_us = srv->snapshot_us = 0;
+}
+#endif
+#endif
 
-	/* Translate for +object position and -camera position */
-	x = x + o->x - c->x;
-	y = y + o->y - c->y;
-	z = z + o->z - c->z;
+#ifndef BTSERVER
+/* The frame profiler.  P toggles an overlay of bars along the bottom of the
+ * screen, one for each phase in enum profile_phase order and the total of
+ * them last: each bar runs to the median over the last PROFILE_WINDOW
+ * frames, with a tick at the 99th percentile and a dot at the worst, on a
+ * scale where a quarter of the screen is a tick's worth of time.
+ * --profile-csv streams every frame's phases to a file.
+ */
+#define PROFILE_WINDOW 256 /* frames, a power of two */
+
+static struct profiler {
+	int overlay;
+	FILE *csv;
+	uint32_t draw_us[NPHASES]; /* the phases of this frame timed while drawing */
+	const uint32_t *sim_us; /* of the tick this frame shows */
+	uint32_t frame_us[PROFILE_WINDOW][NPHASES + 1]; /* the last frames', their sum last */
+	uint64_t frames;
+} profiler = { .sim_us = sim_phase_us };
+
+static const char *profile_csv_path; /* --profile-csv */
+
+static void profile_update(void)
+{
+	atomic_store(&profiling, profiler.overlay || profiler.csv);
+}
 
-	/* Rotate for camera */
-	a = 128 - c->orientation;
-	if (a > 127)
-		a = a - 128;
+static int profile_open_csv(const char *path)
+{
+	profiler.csv = fopen(path, "w");
+	if (!profiler.csv) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(profiler.csv, "frame,tick");
+	for (int i = 0; i < NPHASES; i++)
+		fprintf(profiler.csv, ",%s_us", phase_name[i]);
+	fprintf(profiler.csv, ",sum_us\n");
+	profile_update();
+	return 0;
+}
 
-	nx = ((-x * cosine(a)) / 256) - ((z * sine(a)) / 256);
-	ny = y;
-	nz = ((z * cosine(a)) / 256) - ((x * sine(a)) / 256); 
-	x = nx;
-	y = ny;
-	z = nz;
+/* Files away the phases of the frame just presented, which showed w */
+static void profile_frame(const struct bz_world *w)
+{
+	uint32_t *f = profiler.frame_us[profiler.frames % PROFILE_WINDOW];
+	uint32_t total = 0;
 
-	if (z >= 0) {
-		v->px = -1;
-		v->py = -1;
+	if (!atomic_load_explicit(&profiling, memory_order_relaxed))
 		return;
+	for (int i = 0; i < NPHASES; i++) {
+		f[i] = i < NSIM_PHASES ? profiler.sim_us[i] : profiler.draw_us[i];
+		total += f[i];
 	}
+	f[NPHASES] = total;
+	memset(profiler.draw_us, 0, sizeof(profiler.draw_us));
+	if (profiler.csv) {
+		fprintf(profiler.csv, "%llu,%u", (unsigned long long) profiler.frames, w->sim_tick);
+		for (int i = 0; i <= NPHASES; i++)
+			fprintf(profiler.csv, ",%u", f[i]);
+		fprintf(profiler.csv, "\n");
+	}
+	profiler.frames++;
+}
 
-	v->px = (int) (((int64_t) c->eyedist * (int64_t) x) / -z);
-	v->py = (int) (((int64_t) c->eyedist * (int64_t) y) / -z);
-	v->px = v->px + ((SCREEN_XDIM / 2) * 256);
-	v->py = (SCREEN_YDIM * 256) - (v->py + ((SCREEN_YDIM / 2) * 256));
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
 }
 
-static int onscreen(int x, int y)
+/* The median, 99th percentile and worst of phase over the window */
+static void profile_percentiles(int phase, uint32_t *p50, uint32_t *p99, uint32_t *max)
 {
-	if (x < 0 || x >= SCREEN_XDIM)
-		return 0;
-	if (y < 0 || y >= SCREEN_YDIM)
-		return 0;
-	return 1;
+	uint32_t v[PROFILE_WINDOW];
+	int n = profiler.frames < PROFILE_WINDOW ? (int) profiler.frames : PROFILE_WINDOW;
+
+	*p50 = *p99 = *max = 0;
+	if (!n)
+		return;
+	for (int i = 0; i < n; i++)
+		v[i] = profiler.frame_us[i][phase];
+	qsort(v, n, sizeof(v[0]), compare_uint32);
+	*p50 = v[n / 2];
+	*p99 = v[(n * 99) / 100];
+	*max = v[n - 1];
 }
 
-static void draw_projected_line(struct bz_vertex *v1, struct bz_vertex *v2)
+static int profile_bar_x(uint32_t us)
 {
-	int x1, y1, x2, y2, onscreen1, onscreen2;
+	int x = (int) ((uint64_t) us * (SCREEN_XDIM / 4) * TICKS_PER_SECOND / 1000000);
 
-	x1 = v1->px / 256;
-	y1 = v1->py / 256;
-	x2 = v2->px / 256;
-	y2 = v2->py / 256;
-	onscreen1 = onscreen(x1, y1);
-	onscreen2 = onscreen(x2, y2);
-	if (!onscreen1 && !onscreen2)
+	return x < SCREEN_XDIM - 1 ? x : SCREEN_XDIM - 1;
+}
+
+static void draw_profile(void)
+{
+	const int y0 = SCREEN_YDIM - 8 - 6 * (NPHASES + 1);
+
+	if (!profiler.overlay)
 		return;
-	if (!onscreen1 || !onscreen2)
-		ClippedLine(x1, y1, x2, y2);
-	else
-		Line(x1, y1, x2, y2);
+	FgColor(RED);
+	VerticalLine(profile_bar_x(1000000 / TICKS_PER_SECOND), y0 - 2, 0, y0 + 6 * (NPHASES + 1));
+	for (int i = 0; i <= NPHASES; i++) {
+		uint32_t p50, p99, max;
+		int y = y0 + 6 * i;
+
+		profile_percentiles(i, &p50, &p99, &max);
+		FgColor(i == NPHASES ? WHITE : i < NSIM_PHASES ? GREEN : YELLOW);
+		HorizontalLine(0, y, profile_bar_x(p50), y);
+		HorizontalLine(0, y + 1, profile_bar_x(p50), y + 1);
+		VerticalLine(profile_bar_x(p99), y - 1, 0, y + 2);
+		Point(profile_bar_x(max), y);
+		Point(profile_bar_x(max), y + 1);
+	}
 }
 
-static inline void FgColor(int c)
+static void profile_toggle_overlay(void)
 {
-	SDL_SetRenderDrawColor(renderer, color[c].r, color[c].g, color[c].b, color[c].a);
+	profiler.overlay = !profiler.overlay;
+	profile_update();
 }
 
-static void draw_object(struct camera *c, int n)
+static void profile_report(void)
 {
-	struct bz_model *m = (struct bz_model *) bz_model[bzo[n].model];
-	int v1, v2;
+	int n = profiler.frames < PROFILE_WINDOW ? (int) profiler.frames : PROFILE_WINDOW;
 
-	FgColor(bzo[n].color);
+	if (profiler.csv) {
+		fclose(profiler.csv);
+		profiler.csv = NULL;
+	}
+	if (!n)
+		return;
+	printf("%-10s %8s %8s %8s  (us, over the last %d frames)\n", "phase", "p50", "p99", "max", n);
+	for (int i = 0; i <= NPHASES; i++) {
+		uint32_t p50, p99, max;
+		profile_percentiles(i, &p50, &p99, &max);
+		printf("%-10s %8u %8u %8u\n", i < NPHASES ? phase_name[i] : "sum", p50, p99, max);
+	}
+}
 
-	for (int i = 0; i < m->nvertices; i++)
-		project_vertex(c, &m->vert[i], &bzo[n]);
+static int screen_changed = 0;
 
-	for (int i = 0; i < m->nsegs - 1;) {
-		v1 = m->vlist[i];
-		v2 = m->vlist[i + 1];
-		if (v2 == -1) {
-			i = i + 2;
-			continue;
+static void draw_screen(struct bz_world *w)
+{
+	struct bz_player *pl = &w->player[w->view_player];
+	uint32_t *us = profiler.draw_us;
+	uint64_t t;
+
+	trace_begin("frame");
+	FgColor(BLACK);
+	SDL_RenderClear(renderer);
+
+	if (pl->has_been_hit) {
+		FgColor(WHITE);
+		SDL_RenderClear(renderer);
+		t = profile_begin(PHASE_PRESENT);
+		SDL_RenderPresent(renderer);
+		profile_end(us, PHASE_PRESENT, t);
+		profile_frame(w);
+		trace_end("frame");
+		return;
+	}
+
+	t = profile_begin(PHASE_CULL);
+	cull_objects(w, &pl->camera);
+	profile_end(us, PHASE_CULL, t);
+	t = profile_begin(PHASE_PROJECT);
+	project_objects(&pl->camera);
+	project_debris(w, &pl->camera);
+	project_sparks(w, &pl->camera);
+	profile_end(us, PHASE_PROJECT, t);
+	t = profile_begin(PHASE_RASTER);
+	draw_horizon();
+	draw_mountains(w, &pl->camera);
+	draw_screen_lines();
+	draw_sparks(w, &pl->camera);
+	draw_radar(w, &pl->camera);
+	draw_reticle();
+	draw_profile();
+#if 0
+	FgColor(WHITE);
+	snprintf(buf, sizeof(buf), "%d %d %d", pl->camera.orientation, pl->camera.x / 256, pl->camera.z / 256);	
+	FbMove(0, 150);
+	FbWriteString(buf);
+#endif
+	FgColor(GREEN);
+#if 0
+	snprintf(buf, sizeof(buf), "%d/%d", pl->kills, pl->deaths);
+	FbMove(0, 0);
+	FbWriteString(buf);
+#endif
+	flush_points();
+	profile_end(us, PHASE_RASTER, t);
+	t = profile_begin(PHASE_PRESENT);
+	SDL_RenderPresent(renderer);
+	profile_end(us, PHASE_PRESENT, t);
+	profile_frame(w);
+	trace_end("frame");
+}
+
+#ifndef BTWASM
+#define REGULATE_FRAMERATE 1
+#endif
+
+/* Replays.  A replay file records a session as its input, one BUTTON_* mask
+ * per tick, which is all step_world() needs to re-run it, plus a copy of the
+ * whole world every keyframe_interval ticks so that a reader can start from
+ * any point without re-running everything before it.
+ *
+ * The file is a header, then records each made of a tag byte, a varint
+ * payload length and the payload:
+ *
+ *	'K' keyframe: varint tick, 8 byte checksum, the world as packed by pack_world()
+ *	'I' input: varint first tick, varint tick count, then for each change of
+ *	    input a varint count of ticks before it with the input unchanged and a
+ *	    varint of the bits which changed
+ *	'X' index: varint count, then the varint tick and varint file offset of
+ *	    each keyframe
+ *
+ * and ends with the 8 byte offset of the index.  Each input block starts
+ * from no keys held, so decoding can begin at any block.  Multi-byte fixed
+ * size fields are little endian.
+ */
+#define REPLAY_MAGIC "BZREPLAY"
+#define REPLAY_VERSION 2
+#define REPLAY_BLOCK_TICKS 1024
+#define REPLAY_BLOCK_BYTES (REPLAY_BLOCK_TICKS * 8) /* a change every tick costs at most 8 */
+#define PACKED_WORLD_MAX (sizeof(struct bz_world) + sizeof(struct bz_world) / 2 + 64)
+
+struct replay_keyframe {
+	uint32_t tick;
+	uint64_t offset;
+};
+
+struct replay_writer {
+	FILE *f;
+	uint32_t keyframe_interval;
+	uint32_t next_keyframe;
+	int started;
+	/* The input block being built */
+	uint32_t first_tick;
+	int nticks;
+	uint32_t last_input;
+	uint32_t run; /* ticks since the input last changed */
+	int len;
+	unsigned char block[REPLAY_BLOCK_BYTES + 16];
+	unsigned char *pack; /* keyframe payload */
+	int nkeyframes, max_keyframes;
+	struct replay_keyframe *keyframe;
+	uint64_t us; /* spent recording, for the benchmark */
+};
+
+struct replay_reader {
+	FILE *f;
+	uint32_t keyframe_interval;
+	int nkeyframes;
+	struct replay_keyframe *keyframe;
+	unsigned char *buf; /* payload of the last record read */
+	size_t buf_size;
+};
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint64_t get_u64(struct cursor *c)
+{
+	uint64_t v = 0;
+
+	if (c->end - c->p < 8) {
+		c->bad = 1;
+		return 0;
+	}
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t) c->p[i] << (8 * i);
+	c->p += 8;
+	return v;
+}
+
+/* Parts of a world which pack_world() does not simply zero run pack, in order
+ * of offset.  Only the first n entries of a table column, or of the nav
+ * queue, are live, so only those are kept, and state which is rebuilt from
+ * scratch every tick, or on demand, is not kept at all.  The timer wheel is
+ * dropped here and only its live timers packed after everything else (see
+ * pack_timers()), its free list being most of it.
+ */
+struct pack_region {
+	size_t offset, size;
+	size_t elem_size; /* of a column entry, or 0 if the region is dropped */
+	size_t count; /* offset of the int counting the live entries */
+};
+
+#define WORLD_MEMBER_SIZE(m) sizeof(((struct bz_world *) 0)->m)
+#define PACK_PREFIX(m, count) { offsetof(struct bz_world, m), WORLD_MEMBER_SIZE(m), \
+				WORLD_MEMBER_SIZE(m[0]), offsetof(struct bz_world, count) }
+#define PACK_COLUMN(t, c) PACK_PREFIX(t.c, t.n)
+#define PACK_DROP(m) { offsetof(struct bz_world, m), WORLD_MEMBER_SIZE(m), 0, 0 }
+
+static const struct pack_region pack_region[] = {
+	PACK_COLUMN(statics, x), PACK_COLUMN(statics, z), PACK_COLUMN(statics, y),
+	PACK_COLUMN(statics, orientation), PACK_COLUMN(statics, color),
+	PACK_COLUMN(statics, model), PACK_COLUMN(statics, chunk),
+	PACK_COLUMN(tanks, x), PACK_COLUMN(tanks, z), PACK_COLUMN(tanks, orientation),
+	PACK_COLUMN(tanks, alive), PACK_COLUMN(tanks, id), PACK_COLUMN(tanks, resume),
+	PACK_COLUMN(tanks, counter), PACK_COLUMN(tanks, wake_tick), PACK_COLUMN(tanks, ai_tick),
+	PACK_COLUMN(tanks, timer), PACK_COLUMN(tanks, y), PACK_COLUMN(tanks, color),
+	PACK_COLUMN(tanks, awake_slot),
+	PACK_COLUMN(shells, x), PACK_COLUMN(shells, z), PACK_COLUMN(shells, vx),
+	PACK_COLUMN(shells, vz), PACK_COLUMN(shells, alive), PACK_COLUMN(shells, timer),
+	PACK_COLUMN(shells, parent), PACK_COLUMN(shells, id), PACK_COLUMN(shells, y),
+	PACK_COLUMN(shells, orientation),
+	PACK_COLUMN(sparks, x), PACK_COLUMN(sparks, y), PACK_COLUMN(sparks, z),
+	PACK_COLUMN(sparks, vx), PACK_COLUMN(sparks, vy), PACK_COLUMN(sparks, vz),
+	PACK_COLUMN(sparks, expiry),
+	PACK_COLUMN(debris, x), PACK_COLUMN(debris, y), PACK_COLUMN(debris, z),
+	PACK_COLUMN(debris, vx), PACK_COLUMN(debris, vy), PACK_COLUMN(debris, vz),
+	PACK_COLUMN(debris, expiry), PACK_COLUMN(debris, orientation), PACK_COLUMN(debris, spin),
+	PACK_COLUMN(debris, color), PACK_COLUMN(debris, model),
+	PACK_DROP(timers.slot), PACK_DROP(timers.free), PACK_DROP(timers.timer),
+	PACK_DROP(static_grid), /* static_grid_dirty is set on unpacking */
+	PACK_DROP(tank_grid), PACK_DROP(tank_snapshot_x), PACK_DROP(tank_snapshot_z),
+	PACK_PREFIX(nav_build.queue, nav_build.tail), PACK_PREFIX(awake, nawake),
+	PACK_DROP(ai_period), PACK_DROP(ai_due), PACK_DROP(ai_fired), PACK_DROP(shell_hit),
+	PACK_DROP(serial_scratch),
+};
+
+/* Packs len bytes at src as alternating varint counts of zero words and of
+ * literal words, each literal run followed by its words.  Leftover bytes
+ * beyond the last whole word are copied as they are.
+ */
+static unsigned char *pack_zero_runs(unsigned char *p, const unsigned char *src, size_t len)
+{
+	const size_t n = len / 4;
+	size_t i = 0;
+	uint32_t v;
+
+	while (i < n) {
+		size_t start = i;
+		while (i < n && (memcpy(&v, src + 4 * i, 4), v == 0))
+			i++;
+		p += put_varint(p, i - start);
+		start = i;
+		while (i < n && (memcpy(&v, src + 4 * i, 4), v != 0))
+			i++;
+		p += put_varint(p, i - start);
+		memcpy(p, src + 4 * start, (i - start) * 4);
+		p += (i - start) * 4;
+	}
+	memcpy(p, src + 4 * n, len % 4);
+	return p + len % 4;
+}
+
+static int unpack_zero_runs(struct cursor *c, unsigned char *dst, size_t len)
+{
+	const size_t n = len / 4;
+	size_t i = 0;
+
+	while (i < n && !c->bad) {
+		uint64_t zeros = get_varint(c);
+		if (zeros > n - i)
+			return -1;
+		memset(dst + 4 * i, 0, zeros * 4);
+		i += zeros;
+		uint64_t literals = get_varint(c);
+		if (literals > n - i || (uint64_t) (c->end - c->p) < literals * 4)
+			return -1;
+		memcpy(dst + 4 * i, c->p, literals * 4);
+		c->p += literals * 4;
+		i += literals;
+	}
+	if (c->bad || (size_t) (c->end - c->p) < len % 4)
+		return -1;
+	memcpy(dst + 4 * n, c->p, len % 4);
+	c->p += len % 4;
+	return 0;
+}
+
+/* Number of live entries in a pack_region prefix of w */
+static size_t live_entries(const struct bz_world *w, const struct pack_region *r)
+{
+	int n;
+
+	memcpy(&n, (const unsigned char *) w + r->count, sizeof(n));
+	if (n < 0)
+		return 0;
+	return (size_t) n < r->size / r->elem_size ? (size_t) n : r->size / r->elem_size;
+}
+
+/* Packs the timers in w's wheel as a varint count and then each timer, slot
+ * by slot in the order its slot runs them, so that they fire in the same
+ * order once unpacked.
+ */
+static unsigned char *pack_timers(const struct bz_world *w, unsigned char *p)
+{
+	const struct bz_timer_wheel *tw = &w->timers;
+	int n = 0;
+
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		for (int t = tw->slot[i]; t >= 0; t = tw->timer[t].next)
+			n++;
+	p += put_varint(p, n);
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		for (int t = tw->slot[i]; t >= 0; t = tw->timer[t].next) {
+			p += put_varint(p, t);
+			p += put_varint(p, tw->timer[t].expiry);
+			p += put_varint(p, tw->timer[t].target);
+			*p++ = tw->timer[t].event;
 		}
-		draw_projected_line(&m->vert[v1], &m->vert[v2]);
-		i++;
 	}
+	return p;
+}
+
+/* The inverse of pack_timers(), which rebuilds the slots and the free list
+ * of w's wheel around the timers unpacked.  The tables they refer to must
+ * already be in place.
+ */
+static int unpack_timers(struct bz_world *w, struct cursor *c)
+{
+	struct bz_timer_wheel *tw = &w->timers;
+	int32_t last[TIMER_WHEEL_SLOTS]; /* of each slot, so far */
+	uint64_t n = get_varint(c);
+
+	init_timers(w);
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		last[i] = -1;
+	for (int i = 0; i < MAX_TIMERS; i++)
+		tw->timer[i].prev = -2; /* not in use */
+	if (n > MAX_TIMERS)
+		return -1;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t t = get_varint(c);
+		uint32_t expiry = (uint32_t) get_varint(c);
+		uint64_t target = get_varint(c);
+		int event = c->p < c->end ? *c->p++ : -1;
+		int slot = expiry % TIMER_WHEEL_SLOTS;
+
+		if (c->bad || t >= MAX_TIMERS || tw->timer[t].prev != -2 ||
+			(event == TIMER_SHELL_EXPIRED && target >= MAX_SHELLS) ||
+			(event == TIMER_TANK_WAKE && target >= MAX_TANKS) ||
+			(event != TIMER_SHELL_EXPIRED && event != TIMER_TANK_WAKE))
+			return -1;
+		tw->timer[t] = (struct bz_timer) { expiry, (int32_t) target, -1, last[slot], (unsigned char) event };
+		if (last[slot] >= 0)
+			tw->timer[last[slot]].next = (int32_t) t;
+		else
+			tw->slot[slot] = (int32_t) t;
+		last[slot] = (int32_t) t;
+	}
+	/* Everything else is free */
+	tw->free = -1;
+	for (int i = MAX_TIMERS - 1; i >= 0; i--) {
+		if (tw->timer[i].prev != -2)
+			continue;
+		tw->timer[i] = (struct bz_timer) { 0, 0, tw->free, -1, 0 };
+		tw->free = i;
+	}
+	return 0;
 }
 
-static void draw_mountains(void)
+/* Packs the state of w: each pack_region prefix as a varint entry count and
+ * the live entries, everything else zero run packed, and then the timers;
+ * most of a world is unused table space or scratch, which packs away to
+ * nothing.  Returns the packed size, at most PACKED_WORLD_MAX.
+ */
+static size_t pack_world(const struct bz_world *w, unsigned char *out)
 {
-	int x1 = 0;
-	int y1, x2, y2;
-	int j;
-
-#define HORIZ_ANGLE_OF_VIEW 26
+	const unsigned char *src = (const unsigned char *) w;
+	unsigned char *p = out;
+	size_t pos = 0;
+
+	for (size_t i = 0; i < ARRAYSIZE(pack_region); i++) {
+		const struct pack_region *r = &pack_region[i];
+
+		p = pack_zero_runs(p, src + pos, r->offset - pos);
+		if (r->elem_size) {
+			size_t n = live_entries(w, r);
+			size_t len = n * r->elem_size;
+			p += put_varint(p, n);
+			memcpy(p, src + r->offset, len);
+			p += len;
+		}
+		pos = r->offset + r->size;
+	}
+	p = pack_zero_runs(p, src + pos, sizeof(*w) - pos);
+	p = pack_timers(w, p);
+	return p - out;
+}
 
-	FgColor(TERRAIN_COLOR);
-	for (int i = 0; i < HORIZ_ANGLE_OF_VIEW; i++) {
-		j = i + camera.orientation;
-		if (j > 127)
-			j -= 128;
-		y1 = mountain[j];
-		j++;
-		if (j > 127)
-			j -= 128;
-		y2 = mountain[j];
-		x2 = x1 + (SCREEN_XDIM * 256) / HORIZ_ANGLE_OF_VIEW;
-		ClippedLine(x1 >> 8, y1, x2 >> 8, y2);
-		x1 = x2;
-		y1 = y2;
+/* The inverse of pack_world().  w keeps its own pool and sounds. */
+static int unpack_world(struct bz_world *w, struct cursor *c)
+{
+	struct worker_pool *pool = w->pool;
+	struct sound_events *sounds = w->sounds;
+	unsigned char *dst = (unsigned char *) w;
+	size_t pos = 0;
+	int rc = 0;
+
+	for (size_t i = 0; i < ARRAYSIZE(pack_region) && rc == 0; i++) {
+		const struct pack_region *r = &pack_region[i];
+		size_t len = 0;
+
+		rc = unpack_zero_runs(c, dst + pos, r->offset - pos);
+		if (rc == 0 && r->elem_size) {
+			uint64_t n = get_varint(c);
+			if (c->bad || n > r->size / r->elem_size ||
+				(size_t) (c->end - c->p) < n * r->elem_size) {
+				rc = -1;
+				break;
+			}
+			len = n * r->elem_size;
+			memcpy(dst + r->offset, c->p, len);
+			c->p += len;
+		}
+		memset(dst + r->offset + len, 0, r->size - len);
+		pos = r->offset + r->size;
 	}
+	if (rc == 0)
+		rc = unpack_zero_runs(c, dst + pos, sizeof(*w) - pos);
+	if (rc == 0)
+		rc = unpack_timers(w, c);
+	w->pool = pool;
+	w->sounds = sounds;
+	w->static_grid_dirty = 1;
+	return rc;
 }
 
-static void draw_horizon(void)
+static void write_record(FILE *f, int tag, const unsigned char *payload, size_t len)
 {
-	FgColor(TERRAIN_COLOR);
-	HorizontalLine(0, 80, 128, 80);
+	unsigned char head[16];
+	int n = 0;
+
+	head[n++] = (unsigned char) tag;
+	n += put_varint(head + n, len);
+	fwrite(head, 1, n, f);
+	fwrite(payload, 1, len, f);
 }
 
-static int inside_view_frustum(struct camera *c, struct bz_object *o)
+static void flush_input_block(struct replay_writer *r)
 {
-	int dx, dz;
-	signed short sdx, sdz;
+	unsigned char head[16];
+	int n = 0;
 
-	dx = o->x - c->x;
-	dz = o->z - c->z;
+	if (r->nticks == 0)
+		return;
+	n += put_varint(head + n, r->first_tick);
+	n += put_varint(head + n, r->nticks);
+	memmove(r->block + n, r->block, r->len);
+	memcpy(r->block, head, n);
+	write_record(r->f, 'I', r->block, r->len + n);
+	r->nticks = 0;
+	r->len = 0;
+}
 
-	if (abs(dx) > 32000 || abs(dz) > 32000) {
-		dx = dx >> 8;
-		dz = dz >> 8;
+static void write_keyframe(struct replay_writer *r, struct bz_world *w)
+{
+	unsigned char *p = r->pack;
+
+	flush_input_block(r);
+	if (r->nkeyframes == r->max_keyframes) {
+		int max = r->max_keyframes ? 2 * r->max_keyframes : 64;
+		struct replay_keyframe *k = realloc(r->keyframe, max * sizeof(*k));
+		if (!k) {
+			fprintf(stderr, "Out of memory, replay keyframe dropped\n");
+			return;
+		}
+		r->keyframe = k;
+		r->max_keyframes = max;
 	}
-	sdx = (signed short) dx;
-	sdz = (signed short) dz;
-	int a = arctan2(-sdx, -sdz);
-	if (a < 0)
-		a += 128;
-	if (a > 127)
-		a -= 128;
-	a = a - c->orientation;
-	if (a < 0)
-		a += 128;
-	if (a > 127)
-		a -= 128;
-	return (a < 18 && a >= 0) || (a > 128 - 18 && a < 128);
+	r->keyframe[r->nkeyframes].tick = w->sim_tick;
+	r->keyframe[r->nkeyframes].offset = (uint64_t) ftell(r->f);
+	r->nkeyframes++;
+
+	p += put_varint(p, w->sim_tick);
+	put_u64(p, world_checksum(w));
+	p += 8;
+	p += pack_world(w, p);
+	write_record(r->f, 'K', r->pack, p - r->pack);
 }
 
-static void draw_objects(struct camera *c)
+static struct replay_writer *replay_create(const char *path, uint32_t keyframe_interval)
 {
-	for (int i = 0; i < nbz_objects; i++)
-		if (inside_view_frustum(c, &bzo[i]))
-			draw_object(c, i);
+	struct replay_writer *r = calloc(1, sizeof(*r));
+	unsigned char head[24];
+
+	if (!r)
+		return NULL;
+	r->pack = malloc(PACKED_WORLD_MAX + 32);
+	r->f = fopen(path, "wb");
+	if (!r->pack || !r->f) {
+		fprintf(stderr, "Cannot create replay %s: %s\n", path, strerror(errno));
+		if (r->f)
+			fclose(r->f);
+		free(r->pack);
+		free(r);
+		return NULL;
+	}
+	r->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+	memcpy(head, REPLAY_MAGIC, 8);
+	put_u64(head + 8, REPLAY_VERSION | (uint64_t) sizeof(struct bz_world) << 16);
+	put_u64(head + 16, TRIG_STEPS | (uint64_t) r->keyframe_interval << 32);
+	fwrite(head, 1, sizeof(head), r->f);
+	return r;
 }
 
-static void draw_spark(struct camera *c, struct bz_spark *s)
+/* Record that input is about to be applied to w with step_world() */
+static void replay_record(struct replay_writer *r, struct bz_world *w, uint32_t input)
 {
-	int x, y, z, nx, ny, nz, a;
-	int64_t sx, sy;
+	uint64_t start = rtc_get_us_since_boot();
 
-	/* Translate for +object position and -camera position */
-	x = s->x - c->x;
-	y = s->y - c->y;
-	z = s->z - c->z;
+	if (!r->started || w->sim_tick >= r->next_keyframe) {
+		write_keyframe(r, w);
+		r->next_keyframe = w->sim_tick + r->keyframe_interval;
+		r->started = 1;
+	}
+	if (r->nticks == 0) {
+		r->first_tick = w->sim_tick + 1;
+		r->last_input = 0;
+		r->run = 0;
+	}
+	if (input != r->last_input) {
+		r->len += put_varint(r->block + r->len, r->run);
+		r->len += put_varint(r->block + r->len, input ^ r->last_input);
+		r->last_input = input;
+		r->run = 0;
+	} else {
+		r->run++;
+	}
+	if (++r->nticks == REPLAY_BLOCK_TICKS)
+		flush_input_block(r);
+	r->us += rtc_get_us_since_boot() - start;
+}
 
-	/* Rotate for camera */
-	a = 128 - c->orientation;
-	if (a > 127)
-		a = a - 128;
+static void replay_close(struct replay_writer *r)
+{
+	unsigned char *p = r->pack;
+	unsigned char tail[8];
+	uint64_t index_offset;
+
+	flush_input_block(r);
+	index_offset = (uint64_t) ftell(r->f);
+	p += put_varint(p, r->nkeyframes);
+	for (int i = 0; i < r->nkeyframes; i++) {
+		p += put_varint(p, r->keyframe[i].tick);
+		p += put_varint(p, r->keyframe[i].offset);
+	}
+	write_record(r->f, 'X', r->pack, p - r->pack);
+	put_u64(tail, index_offset);
+	fwrite(tail, 1, sizeof(tail), r->f);
+	if (fclose(r->f) != 0)
+		fprintf(stderr, "Error writing replay: %s\n", strerror(errno));
+	free(r->keyframe);
+	free(r->pack);
+	free(r);
+}
 
-	nx = ((-x * cosine(a)) / 256) - ((z * sine(a)) / 256);
-	ny = y;
-	nz = ((z * cosine(a)) / 256) - ((x * sine(a)) / 256); 
-	x = nx;
-	y = ny;
-	z = nz;
+/* Reads the record at the current position into r->buf.  Returns its tag, or -1. */
+static int read_record(struct replay_reader *r, struct cursor *c)
+{
+	unsigned char b;
+	uint64_t len = 0;
+	int tag = fgetc(r->f);
 
-	// if (z >= 0)
-	//	return;
-	if (z == 0)
-		return;
+	if (tag == EOF)
+		return -1;
+	for (int shift = 0;; shift += 7) {
+		if (shift >= 64 || fread(&b, 1, 1, r->f) != 1)
+			return -1;
+		len |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			break;
+	}
+	if (len > PACKED_WORLD_MAX + 32 + (uint64_t) r->nkeyframes * 20)
+		return -1;
+	if (len > r->buf_size) {
+		unsigned char *buf = realloc(r->buf, len);
+		if (!buf)
+			return -1;
+		r->buf = buf;
+		r->buf_size = len;
+	}
+	if (fread(r->buf, 1, len, r->f) != len)
+		return -1;
+	c->p = r->buf;
+	c->end = r->buf + len;
+	c->bad = 0;
+	return tag;
+}
 
-	sx = (int64_t) c->eyedist * (int64_t) x / -z;
-	sy = (int64_t) c->eyedist * (int64_t) y / -z;
-	// sx = sx + ((SCREEN_XDIM / 2) * 256);
-	// sy = (SCREEN_YDIM * 256) - (sy + ((SCREEN_YDIM / 2) * 256));
-	sx = sx / 256;
-	sy = sy / 256;
-	sx += SCREEN_XDIM / 2;
-	sy += SCREEN_YDIM / 2;
-	if (onscreen(sx, sy))
-		Point(sx, sy);
-	if (onscreen(sx + 1, sy))
-		Point(sx + 1, sy);
-	if (onscreen(sx, sy + 1))
-		Point(sx, sy + 1);
-	if (onscreen(sx + 1, sy + 1))
-		Point(sx + 1, sy + 1);
-}
-
-static void draw_sparks(struct camera *c)
+static void replay_free(struct replay_reader *r)
 {
-	FgColor(SPARK_COLOR);
-	for (int i = 0; i < nsparks; i++)
-		draw_spark(c, &spark[i]);
+	if (r->f)
+		fclose(r->f);
+	free(r->keyframe);
+	free(r->buf);
+	free(r);
 }
 
-static void draw_radar(void)
+static struct replay_reader *replay_open(const char *path)
 {
-	static int radar_angle = 0;
-	const int rx = SCREEN_XDIM / 2;
-	const int ry = SCREEN_YDIM / 10;
-	const int radius = SCREEN_YDIM / 16;
+	struct replay_reader *r = calloc(1, sizeof(*r));
+	unsigned char head[24];
+	struct cursor c = { head + 8, head + sizeof(head), 0 };
+	uint64_t version, format;
+
+	if (!r)
+		return NULL;
+	r->f = fopen(path, "rb");
+	if (!r->f) {
+		fprintf(stderr, "Cannot open replay %s: %s\n", path, strerror(errno));
+		replay_free(r);
+		return NULL;
+	}
+	if (fread(head, 1, sizeof(head), r->f) != sizeof(head) || memcmp(head, REPLAY_MAGIC, 8) != 0)
+		goto bad;
+	version = get_u64(&c);
+	format = get_u64(&c);
+	if (version != (REPLAY_VERSION | (uint64_t) sizeof(struct bz_world) << 16) ||
+		(format & 0xffffffff) != TRIG_STEPS) {
+		fprintf(stderr, "%s was recorded by an incompatible build\n", path);
+		replay_free(r);
+		return NULL;
+	}
+	r->keyframe_interval = format >> 32;
+
+	/* The index is found through the offset at the very end */
+	unsigned char tail[8];
+	if (fseek(r->f, -8, SEEK_END) != 0 || fread(tail, 1, 8, r->f) != 8)
+		goto bad;
+	c.p = tail;
+	c.end = tail + 8;
+	if (fseek(r->f, (long) get_u64(&c), SEEK_SET) != 0 || read_record(r, &c) != 'X')
+		goto bad;
+	r->nkeyframes = (int) get_varint(&c);
+	if (r->nkeyframes <= 0 || (size_t) r->nkeyframes > (size_t) (c.end - c.p))
+		goto bad;
+	r->keyframe = calloc(r->nkeyframes, sizeof(*r->keyframe));
+	if (!r->keyframe)
+		goto bad;
+	for (int i = 0; i < r->nkeyframes; i++) {
+		r->keyframe[i].tick = (uint32_t) get_varint(&c);
+		r->keyframe[i].offset = get_varint(&c);
+	}
+	if (c.bad)
+		goto bad;
+	return r;
+bad:
+	fprintf(stderr, "%s is not a complete replay\n", path);
+	replay_free(r);
+	return NULL;
+}
 
-	radar_angle++;
-	if (radar_angle >= 128)
-		radar_angle = 0;
-	int x = (cosine(radar_angle) * radius) >> 8;
-	int y = (sine(radar_angle) * radius) >> 8;
-	FgColor(RADAR_COLOR);
-	Line(rx, ry, rx + x, ry + y);
-	VerticalLine(SCREEN_XDIM / 2, ry - radius, SCREEN_XDIM / 2, ry - radius + 2);
-	VerticalLine(SCREEN_XDIM / 2, ry + radius -2, SCREEN_XDIM / 2, ry + radius);
-	HorizontalLine(rx - radius - 2, ry, rx - radius, ry);
-	HorizontalLine(rx + radius - 2, ry, rx + radius, ry);
+/* Load keyframe k into w and leave the file positioned just after it */
+static int replay_load_keyframe(struct replay_reader *r, int k, struct bz_world *w)
+{
+	struct cursor c;
+	uint64_t checksum;
 
-	if ((radar_angle & 0x03) == 0x03)
-		return; /* Make radar blips blink by not drawing them every few frames */
+	if (fseek(r->f, (long) r->keyframe[k].offset, SEEK_SET) != 0 || read_record(r, &c) != 'K')
+		return -1;
+	get_varint(&c);
+	checksum = get_u64(&c);
+	if (c.bad || unpack_world(w, &c) != 0 || world_checksum(w) != checksum)
+		return -1;
+	return 0;
+}
 
-	for (int i = 0; i < nbz_objects; i++) {
-		if (bzo[i].model != TANK_MODEL)
-			continue;
-		int dx, dz, d, tx, tz;
-		dx = (bzo[i].x - camera.x) >> 8;
-		dz = (bzo[i].z - camera.z) >> 8;
+/* Step w through the recorded input until it reaches tick until or the end of
+ * the replay, checking it against each keyframe passed on the way.  Returns
+ * the number of keyframes which did not match, or -1 if the file is damaged.
+ */
+static int replay_run(struct replay_reader *r, struct bz_world *w, uint32_t until, int *checked)
+{
+	struct cursor c;
+	int tag, mismatches = 0;
 
-		d = ((dx * dx >> 8)) + ((dz * dz) >> 8);
-		if (d > 200)
+	while (w->sim_tick < until && (tag = read_record(r, &c)) >= 0) {
+		if (tag == 'X')
+			break;
+		if (tag == 'K') {
+			uint32_t tick = (uint32_t) get_varint(&c);
+			uint64_t checksum = get_u64(&c);
+			if (tick == w->sim_tick) {
+				mismatches += world_checksum(w) != checksum;
+				(*checked)++;
+			}
 			continue;
-		/* Rotate for camera */
-		int a = 128 - camera.orientation;
-		if (a > 127)
-			a = a - 128;
-		int nx = ((-dx * cosine(a)) / 256) - ((dz * sine(a)) / 256);
-		int nz = ((dz * cosine(a)) / 256) - ((dx * sine(a)) / 256);
-		tx = (SCREEN_XDIM * nx / 20) >> 8;
-		tz = (SCREEN_XDIM * nz / 20) >> 8;
-		FgColor(RADAR_BLIP_COLOR);
-		Point(rx + tx, ry + tz);
-		Point(rx + tx + 1, ry + tz + 1);
-		Point(rx + tx + 1, ry + tz);
-		Point(rx + tx, ry + tz + 1);
+		}
+		if (tag != 'I')
+			return -1;
+		uint32_t tick = (uint32_t) get_varint(&c);
+		int nticks = (int) get_varint(&c);
+		uint32_t input = 0;
+		int done = 0;
+		if (c.bad || tick != w->sim_tick + 1)
+			return -1;
+		while (done < nticks && w->sim_tick < until) {
+			uint64_t run = c.p < c.end ? get_varint(&c) : (uint64_t) (nticks - done - 1);
+			uint32_t change = c.p < c.end ? (uint32_t) get_varint(&c) : 0;
+			if (c.bad)
+				return -1;
+			for (uint64_t i = 0; i < run && done < nticks && w->sim_tick < until; i++, done++)
+				step_world(w, input);
+			input ^= change;
+			if (done < nticks && w->sim_tick < until) {
+				step_world(w, input);
+				done++;
+			}
+		}
 	}
+	return mismatches;
 }
 
-static void draw_reticle(void)
+/* Play a replay back headless as fast as possible, from the start, or to
+ * tick seek by way of the nearest keyframe before it.
+ */
+static int replay_benchmark(const char *path, uint32_t seek)
 {
-	int xo = SCREEN_XDIM / 24;
-	int yo = SCREEN_YDIM / 24;
-	int x = SCREEN_XDIM / 2;
-	int y = SCREEN_YDIM / 2;
-
-	FgColor(RETICLE_COLOR);
-	Line(x - 2 * xo, y, x - xo, y);
-	Line(x + xo, y, x + 2 * xo, y);
-	Line(x, y - 2 * yo, x, y - yo);
-	Line(x, y + yo, x, y + 2 * yo);
+	struct replay_reader *r = replay_open(path);
+	struct bz_world *w = create_world(&pool, 0, 0);
+	uint64_t start, elapsed;
+	int k = 0, checked = 0, mismatches = -1;
+
+	if (!r || !w)
+		goto out;
+	start = rtc_get_us_since_boot();
+	if (seek)
+		while (k + 1 < r->nkeyframes && r->keyframe[k + 1].tick <= seek)
+			k++;
+	if (replay_load_keyframe(r, k, w) != 0) {
+		fprintf(stderr, "%s: keyframe at tick %u is damaged\n", path, r->keyframe[k].tick);
+		goto out;
+	}
+	mismatches = replay_run(r, w, seek ? seek : UINT32_MAX, &checked);
+	elapsed = rtc_get_us_since_boot() - start;
+	if (mismatches < 0) {
+		fprintf(stderr, "%s is damaged after tick %u\n", path, w->sim_tick);
+		goto out;
+	}
+	if (seek)
+		printf("seek to tick %u from keyframe at tick %u: %.2f ms\n",
+			w->sim_tick, r->keyframe[k].tick, elapsed / 1000.0);
+	else
+		printf("%u ticks replayed in %.2f ms (%.0f ticks/sec), %d keyframes checked, %d mismatched\n",
+			w->sim_tick, elapsed / 1000.0, elapsed ? (1e6 * w->sim_tick) / elapsed : 0.0,
+			checked, mismatches);
+	printf("checksum at tick %u: %016llx\n", w->sim_tick, (unsigned long long) world_checksum(w));
+out:
+	if (r)
+		replay_free(r);
+	free(w);
+	return mismatches < 0 ? -1 : mismatches ? 1 : 0;
 }
 
-static void explosion(int x, int y, int z, int count, int chunks)
-{
+/* Rewind buffer.  The last REWIND_SLOTS packed snapshots of the world, one
+ * every REWIND_INTERVAL ticks, so that play can be wound back a few seconds
+ * at once.  Snapshots are paid for out of a time budget, a percentage of the
+ * time each tick is allowed.  A snapshot is only started once the budget
+ * saved up covers what the last one cost, and is put off rather than go into
+ * debt, so a rewind buffer costs a tick no more than budget_percent on
+ * average, give or take how much one snapshot's cost differs from the last.
+ */
+#define REWIND_SLOTS 16
+#define REWIND_INTERVAL (TICKS_PER_SECOND / 2)
+#define REWIND_TICKS (3 * TICKS_PER_SECOND) /* how far back a rewind goes */
+#define REWIND_MAX_CREDIT_US 100000 /* budget that can be saved up */
+
+struct rewind_ring {
+	int budget_percent; /* 0 turns snapshots off */
+	int head, count; /* next slot written, and slots in use */
+	uint32_t next_tick; /* sim_tick of the next snapshot */
+	int64_t credit; /* budget not yet spent, in hundredths of a us */
+	int64_t last_us; /* what the last snapshot cost */
+	struct rewind_slot {
+		uint32_t tick;
+		size_t len;
+		unsigned char *data; /* PACKED_WORLD_MAX bytes, allocated when first used */
+	} slot[REWIND_SLOTS];
+	uint64_t us, taken; /* for the benchmark */
+};
 
-	for (int i = 0; i < count; i++) {
-		int vx, vy, vz, life;
+static void rewind_free(struct rewind_ring *r)
+{
+	for (int i = 0; i < REWIND_SLOTS; i++)
+		free(r->slot[i].data);
+	memset(r, 0, sizeof(*r));
+}
 
-		vx = ((int) (xorshift(&xorshift_state) % 600) - 300);
-		vy = -((int) (xorshift(&xorshift_state) % 600));
-		vz = ((int) (xorshift(&xorshift_state) % 600) - 300);
+/* Called after each tick.  tick_us is the time the tick is allowed: its
+ * period when running in real time, or what it took when running flat out.
+ */
+static void rewind_tick(struct rewind_ring *r, const struct bz_world *w, uint64_t tick_us)
+{
+	struct rewind_slot *s = &r->slot[r->head];
+	uint64_t start, elapsed;
 
-		life = ((int) (xorshift(&xorshift_state) % 30) + 50);
-		add_spark(x, y, z, vx, vy, vz, life); 
+	if (r->budget_percent <= 0)
+		return;
+	/* Kept in hundredths, or short ticks would earn nothing at all */
+	r->credit += (int64_t) tick_us * r->budget_percent;
+	if (r->credit > REWIND_MAX_CREDIT_US * 100)
+		r->credit = REWIND_MAX_CREDIT_US * 100;
+	if (w->sim_tick < r->next_tick)
+		return;
+	if (r->credit < r->last_us * 100 || r->credit <= 0)
+		return; /* late rather than over budget */
+	if (!s->data) {
+		s->data = malloc(PACKED_WORLD_MAX);
+		if (!s->data) {
+			fprintf(stderr, "Out of memory, rewind buffer turned off\n");
+			r->budget_percent = 0;
+			return;
+		}
 	}
+	start = rtc_get_us_since_boot();
+	s->tick = w->sim_tick;
+	s->len = pack_world(w, s->data);
+	elapsed = rtc_get_us_since_boot() - start;
+	r->head = (r->head + 1) % REWIND_SLOTS;
+	if (r->count < REWIND_SLOTS)
+		r->count++;
+	r->next_tick = w->sim_tick + REWIND_INTERVAL;
+	r->credit -= (int64_t) elapsed * 100;
+	r->last_us = (int64_t) elapsed;
+	r->us += elapsed;
+	r->taken++;
+}
 
-	for (int i = 0; i < chunks; i++) {
-		int n, vx, vy, vz, life, c;
-
-		vx = ((int) (xorshift(&xorshift_state) % 600) - 300);
-		vy = ((int) (xorshift(&xorshift_state) % 600));
-		vz = ((int) (xorshift(&xorshift_state) % 600) - 300);
-		life = ((int) (xorshift(&xorshift_state) % 30) + 150);
-		c = ((int) (xorshift(&xorshift_state) % 3)) + CHUNK0_MODEL;
+/* Winds w back to the newest snapshot at least REWIND_TICKS old, or the
+ * oldest there is, and forgets the snapshots after it.  w keeps its pool.
+ * Returns -1 if there is nothing to go back to.
+ */
+static int rewind_world(struct rewind_ring *r, struct bz_world *w)
+{
+	struct cursor c;
+	int back = 1;
 
-		n = add_object(x, y, z, 0, c, TANK_COLOR);
-		if (n < 0)
-			return;
-		bzo[n].vx = vx;
-		bzo[n].vy = vy;
-		bzo[n].vz = vz;
-		bzo[n].alive = life;
+	if (r->count == 0)
+		return -1;
+	while (back < r->count &&
+		r->slot[(r->head - back + REWIND_SLOTS) % REWIND_SLOTS].tick + REWIND_TICKS > w->sim_tick)
+		back++;
+	r->head = (r->head - back + REWIND_SLOTS) % REWIND_SLOTS;
+	c.p = r->slot[r->head].data;
+	c.end = c.p + r->slot[r->head].len;
+	c.bad = 0;
+	if (unpack_world(w, &c) != 0) {
+		fprintf(stderr, "Rewind snapshot at tick %u is damaged\n", r->slot[r->head].tick);
+		exit(1); /* w is half overwritten */
 	}
+	w->checksum = world_checksum(w);
+	/* Keep the snapshot wound back to, so the next rewind goes further */
+	r->head = (r->head + 1) % REWIND_SLOTS;
+	r->count -= back - 1;
+	r->next_tick = w->sim_tick + REWIND_INTERVAL;
+	return 0;
 }
 
-#if DEBUG_MARKERS
-static int find_debug_marker(void)
+/* Snapshot files hold a world exactly as it is in memory, after a header,
+ * so that resuming is an mmap() and one copy.  They are only good for the
+ * build which wrote them.
+ */
+#define SNAPSHOT_MAGIC "BZSNAPSH"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t trig_steps;
+	uint64_t world_size;
+	uint64_t pad[5]; /* the world starts on a 64 byte boundary */
+};
+
+static int save_snapshot(const char *path, const struct bz_world *w)
 {
-	for (int i = 0; i < nbz_objects; i++)
-		if (bzo[i].model == NARROW_PYRAMID_MODEL && bzo[i].color == RED)
-			return i;
+	struct snapshot_header h;
+	FILE *f = fopen(path, "wb");
+
+	if (!f) {
+		fprintf(stderr, "Cannot create snapshot %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.trig_steps = TRIG_STEPS;
+	h.world_size = sizeof(*w);
+	if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(w, sizeof(*w), 1, f) != 1 || fclose(f) != 0) {
+		fprintf(stderr, "Error writing snapshot %s: %s\n", path, strerror(errno));
+		return -1;
+	}
 	return 0;
 }
-#endif
 
-static void tank_mode_idle(__attribute__((unused)) struct bz_object *o)
+/* Replaces w with the world saved in path.  w keeps its pool and sounds. */
+static int load_snapshot(const char *path, struct bz_world *w)
 {
-#if DEBUG_MARKERS
-	static int debug_marker = -1;
-#endif
-	int x1, z1, x2, z2, a;
-	int dx1, dz1, dx2, dz2;
-
-	/* Maybe we are already close enough? */
-	dx1 = (camera.x - o->x);
-	dz1 = (camera.z - o->z);
-	int64_t dxsq, dzsq;
-	dxsq = (int64_t) dx1 * (int64_t) dx1;
-	dzsq = (int64_t) dz1 * (int64_t) dz1;
-	if (((dxsq/ 256) + (dzsq / 256) / 256) < (IDEAL_TARGET_DIST * IDEAL_TARGET_DIST)) {
-		tank_brain.mode = TANK_MODE_AIMING;
-		return;
+	struct worker_pool *pool = w->pool;
+	struct sound_events *sounds = w->sounds;
+	const struct snapshot_header *h;
+	size_t size = sizeof(*h) + sizeof(*w);
+	struct stat st;
+	void *map;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open snapshot %s: %s\n", path, strerror(errno));
+		return -1;
 	}
-
-	/* Pick two points off either flank of player tank and head for the closest one */
-	a = camera.orientation;
-	a = a + 32;
-	if (a >= 128)
-		a -= 128;
-	if (a < 0)
-		a += 128;
-	x1 = camera.x - ((IDEAL_TARGET_DIST * sine(a)));
-	z1 = camera.z - ((IDEAL_TARGET_DIST * cosine(a)));
-	x2 = camera.x + ((IDEAL_TARGET_DIST * sine(a)));
-	z2 = camera.z + ((IDEAL_TARGET_DIST * cosine(a)));
-	dx1 = x1 - o->x;
-	dz1 = z1 - o->z;
-	dx2 = x2 - o->x;
-	dz2 = z2 - o->z;
-	if (dx1 + dz1 < dx2 + dz2) {  /* pick the closest one by manhattan distance */
-		tank_brain.dest_x = x1;
-		tank_brain.dest_z = z1;
-	} else {
-		tank_brain.dest_x = x2;
-		tank_brain.dest_z = z2;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size != size) {
+		fprintf(stderr, "%s is not a snapshot from this build\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map snapshot %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	h = map;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != SNAPSHOT_VERSION ||
+		h->trig_steps != TRIG_STEPS || h->world_size != sizeof(*w)) {
+		fprintf(stderr, "%s is not a snapshot from this build\n", path);
+		munmap(map, size);
+		return -1;
 	}
+	memcpy(w, h + 1, sizeof(*w));
+	munmap(map, size);
+	w->pool = pool;
+	w->sounds = sounds;
+	w->battlezone_state = BATTLEZONE_RUN; /* saved on the way out */
+	return 0;
+}
 
-	tank_brain.mode = TANK_MODE_COMPUTE_STEERING;
+/* Sound.  The game never waits on the audio device.  After each tick the
+ * thread running the game turns the tick's sound events into commands on a
+ * lock-free ring with one producer, that thread, and one consumer, SDL's
+ * audio callback, which starts a voice for each command and mixes the
+ * voices.  Panning and attenuation are worked out as a sound is queued, from
+ * where it is relative to the camera of the player being shown.  The
+ * effects are synthesised into PCM at start up.  If there is no audio
+ * device the game runs silent; SDL_AUDIODRIVER=dummy runs the mixer with
+ * nowhere to play it.
+ */
+#define AUDIO_RATE 22050
+#define AUDIO_RING 256 /* commands, a power of two */
+#define AUDIO_VOICES 32
+#define AUDIO_NEAR (64 << 8) /* sounds closer than this are at full volume */
+#define AUDIO_QUIETEST 8 /* of 256, anything fainter isn't worth a voice */
+#define ENGINE_HZ 30
+
+struct audio_command {
+	int effect; /* enum sound_effect; SOUND_ENGINE sets the engine's volume */
+	int16_t gain[2]; /* left and right, 256 for full volume */
+};
 
-#if DEBUG_MARKERS
-	if (debug_marker == -1) {
-		debug_marker = add_object(tank_brain.dest_x, 0, tank_brain.dest_z, 0, NARROW_PYRAMID_MODEL, RED);
-	} else {
-		debug_marker = find_debug_marker();
-		if (debug_marker >= 0) {
-			bzo[debug_marker].x = tank_brain.dest_x;
-			bzo[debug_marker].y = 0;
-			bzo[debug_marker].z = tank_brain.dest_z;
+static struct audio {
+	SDL_AudioDeviceID device;
+	int16_t *pcm[NSOUND_EFFECTS];
+	int length[NSOUND_EFFECTS]; /* in samples */
+	struct audio_command ring[AUDIO_RING];
+	atomic_uint head, tail; /* advanced by the callback and the game */
+	unsigned int dropped; /* commands which found the ring full */
+	int engine_gain; /* as last sent */
+
+	/* The callback's alone */
+	struct voice {
+		int effect, pos;
+		int16_t gain[2];
+	} voice[AUDIO_VOICES];
+	int nvoices;
+	int16_t engine[2];
+	int engine_pos;
+} audio;
+
+/* Fills in the effects: a crack of gunfire, the rumble of an explosion and
+ * a loop of engine hum.
+ */
+static int synthesise_effects(void)
+{
+	static const float seconds[NSOUND_EFFECTS] = { 0.25f, 1.2f, 1.0f };
+	unsigned int noise = 0x9e3779b9;
+
+	for (int e = 0; e < NSOUND_EFFECTS; e++) {
+		int n = (int) (seconds[e] * AUDIO_RATE);
+		int32_t low = 0;
+
+		audio.pcm[e] = malloc(sizeof(*audio.pcm[e]) * n);
+		if (!audio.pcm[e])
+			return -1;
+		audio.length[e] = n;
+		for (int i = 0; i < n; i++) {
+			float t = (float) i / AUDIO_RATE;
+			int32_t white = (int32_t) (xorshift(&noise) & 0xffff) - 0x8000;
+			float v;
+
+			switch (e) {
+			case SOUND_GUN:
+				v = white * expf(-t * 30.0f);
+				break;
+			case SOUND_EXPLOSION:
+				low += (white - low) / 16; /* a crude low pass */
+				v = 3.0f * low * expf(-t * 3.5f);
+				break;
+			default: /* engine, a whole number of cycles so that it loops */
+				v = 0.3f * (((int64_t) i * ENGINE_HZ * 0x10000 / AUDIO_RATE & 0xffff) - 0x8000) +
+					0.2f * (((int64_t) i * ENGINE_HZ * 0x20000 / AUDIO_RATE & 0xffff) - 0x8000);
+				break;
+			}
+			audio.pcm[e][i] = v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t) v;
 		}
 	}
-#endif
+	return 0;
 }
 
-static void tank_mode_compute_steering(struct bz_object *o)
+static void start_voice(const struct audio_command *c)
 {
-	int dx, dz;
-	signed short sdx, sdz;
-
-	dx = tank_brain.dest_x - o->x;
-	dz = tank_brain.dest_z - o->z;
-
-	/* This prevents taking arctan2(0, 0); */
-	if (abs(dx) < TANK_DEST_ARRIVE_DIST && abs(dz) < TANK_DEST_ARRIVE_DIST) {
-		tank_brain.mode = TANK_MODE_AIMING;
+	if (c->effect == SOUND_ENGINE) {
+		audio.engine[0] = c->gain[0];
+		audio.engine[1] = c->gain[1];
 		return;
 	}
+	if (audio.nvoices == AUDIO_VOICES)
+		return; /* a crowd of explosions won't miss one more */
+	audio.voice[audio.nvoices++] = (struct voice) { c->effect, 0, { c->gain[0], c->gain[1] } };
+}
 
-	if (abs(dx) > 32000 || abs(dz) > 32000) {
-		dx = dx >> 8;
-		dz = dz >> 8;
+static void audio_callback(UNUSED void *userdata, Uint8 *stream, int len)
+{
+	int16_t *out = (int16_t *) stream;
+	int frames = len / (2 * sizeof(*out));
+	unsigned int head = atomic_load_explicit(&audio.head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&audio.tail, memory_order_acquire);
+
+	for (; head != tail; head++)
+		start_voice(&audio.ring[head % AUDIO_RING]);
+	atomic_store_explicit(&audio.head, head, memory_order_release);
+
+	for (int i = 0; i < frames; i++) {
+		int16_t hum = audio.pcm[SOUND_ENGINE][audio.engine_pos];
+		int32_t left = hum * audio.engine[0] / 256;
+		int32_t right = hum * audio.engine[1] / 256;
+
+		if (++audio.engine_pos == audio.length[SOUND_ENGINE])
+			audio.engine_pos = 0;
+		for (int v = 0; v < audio.nvoices; v++) {
+			struct voice *vc = &audio.voice[v];
+			int16_t x = audio.pcm[vc->effect][vc->pos++];
+			left += x * vc->gain[0] / 256;
+			right += x * vc->gain[1] / 256;
+		}
+		out[2 * i] = left > 32767 ? 32767 : left < -32768 ? -32768 : left;
+		out[2 * i + 1] = right > 32767 ? 32767 : right < -32768 ? -32768 : right;
+		for (int v = 0; v < audio.nvoices; v++) {
+			if (audio.voice[v].pos == audio.length[audio.voice[v].effect])
+				audio.voice[v--] = audio.voice[--audio.nvoices];
+		}
 	}
-	sdx = (signed short) dx;
-	sdz = (signed short) dz;
-	
-	int a = arctan2(-sdx, -sdz);
-	if (a < 0)
-		a += 128;
-	tank_brain.desired_orientation = a;
-	tank_brain.mode = TANK_MODE_STEERING;
 }
 
-static void tank_mode_steering(struct bz_object *o)
+static void audio_init(void)
 {
-	int turning_direction;
-
-	int da = tank_brain.desired_orientation - o->orientation;
+	SDL_AudioSpec want = { 0 }, have;
 
-	if (da == 0) {
-		tank_brain.mode = TANK_MODE_DRIVING;
+	if (synthesise_effects() != 0) {
+		fprintf(stderr, "Out of memory for the sound effects, running silent\n");
 		return;
 	}
-
-
-	if (da < -64 || (da > 0 && da <= 64))
-		turning_direction = 1;
-	else
-		turning_direction = -1;
-	o->orientation += turning_direction;
-	if (o->orientation < 0)
-		o->orientation += 128;
-	if (o->orientation >= 128)
-		o->orientation -= 128;
+	if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+		fprintf(stderr, "Unable to initialize SDL (Audio): %s, running silent\n", SDL_GetError());
+		return;
+	}
+	want.freq = AUDIO_RATE;
+	want.format = AUDIO_S16SYS;
+	want.channels = 2;
+	want.samples = 512;
+	want.callback = audio_callback;
+	audio.device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+	if (!audio.device) {
+		fprintf(stderr, "Unable to open audio: %s, running silent\n", SDL_GetError());
+		return;
+	}
+	SDL_PauseAudioDevice(audio.device, 0);
 }
 
-static void tank_mode_driving(struct bz_object *o)
+static void audio_send(int effect, int left, int right)
 {
-	static int steering_counter = 0;
+	unsigned int tail = atomic_load_explicit(&audio.tail, memory_order_relaxed);
 
-	int nx, nz;
-	int dx, dz;
-
-	dx = camera.x - o->x;
-	dz = camera.z - o->z;
-
-	int64_t dxsq, dzsq;
-
-	dxsq = (int64_t) dx * (int64_t) dx;
-	dzsq = (int64_t) dz * (int64_t) dz;
-
-	if (((dxsq / 256) + (dzsq / 256) / 256) < (IDEAL_TARGET_DIST * IDEAL_TARGET_DIST)) {
-		tank_brain.mode = TANK_MODE_AIMING;
+	if (tail - atomic_load_explicit(&audio.head, memory_order_acquire) == AUDIO_RING) {
+		audio.dropped++;
 		return;
 	}
+	audio.ring[tail % AUDIO_RING] = (struct audio_command) { effect, { left, right } };
+	atomic_store_explicit(&audio.tail, tail + 1, memory_order_release);
+}
 
-	dx = tank_brain.dest_x - o->x;
-	dz = tank_brain.dest_z - o->z;
-
-	if (abs(dx) < TANK_DEST_ARRIVE_DIST && abs(dz) < TANK_DEST_ARRIVE_DIST) {
-		tank_brain.mode = TANK_MODE_AIMING;
-		return;
-	}
+/* Where (x, z) is heard from c: gain falls off with distance, and pan is
+ * -256 for hard left to 256 for hard right, going by the radar's rotation
+ * (see draw_radar_blip()).
+ */
+static void audio_place(const struct camera *c, int32_t x, int32_t z, int *left, int *right)
+{
+	int64_t dx = x - c->x, dz = z - c->z;
+	int a = 128 - c->orientation;
+	int64_t d = llabs(dx) > llabs(dz) ? llabs(dx) : llabs(dz);
+	int64_t gain, pan;
 
-	nx = o->x - (sine(o->orientation));
-	nz = o->z - (cosine(o->orientation));
-	if (!tank_obstacle_collision(o, nx, nz)) {
-		o->x = nx;
-		o->z = nz;
-	} else {
-		tank_brain.mode = TANK_MODE_AVOIDING_OBSTACLE;
-		tank_brain.obstacle_timer = 20;
-		return;
-	}
+	if (a > 127)
+		a = a - 128;
+	int64_t nx = ((-dx * cosine(a)) / 256) - ((dz * sine(a)) / 256);
+	int64_t nz = ((dz * cosine(a)) / 256) - ((dx * sine(a)) / 256);
 
-	/* When we begin steering from far away, we might miss our destination
-	 * if we don't course correct every so often
-	 */
-	steering_counter++;
-	if (steering_counter == 10) {
-		steering_counter = 0;
-		tank_brain.mode = TANK_MODE_COMPUTE_STEERING;
-	}
+	gain = d < AUDIO_NEAR ? 256 : 256 * AUDIO_NEAR / d;
+	pan = 256 * nx / (llabs(nx) + llabs(nz) + 1);
+	*left = (int) (gain * (256 - pan) / 512);
+	*right = (int) (gain * (256 + pan) / 512);
 }
 
-static void tank_mode_avoiding_obstacle(__attribute__((unused)) struct bz_object *o)
+/* Passes the sounds w made in the last tick to the mixer, with the engine
+ * louder while the player's tank is on the move.
+ */
+static void queue_sounds(struct bz_world *w, uint32_t input)
 {
-	/* Move backwards, and turn */
-	o->x = o->x + (sine(o->orientation));
-	o->z = o->z + (cosine(o->orientation));
-	if (tank_brain.obstacle_timer & 0x01) {
-		o->orientation++;
-		if (o->orientation >= 128)
-			o->orientation -= 128;
+	const struct camera *c = &w->player[w->view_player].camera;
+	int engine = w->player[w->view_player].active &&
+			(input & (BUTTON_UP | BUTTON_DOWN | BUTTON_LEFT | BUTTON_RIGHT)) ? 96 : 32;
+	int left, right;
+
+	if (!audio.device || !w->sounds)
+		return;
+	for (int i = 0; i < w->sounds->n; i++) {
+		const struct sound_event *e = &w->sounds->e[i];
+		audio_place(c, e->x, e->z, &left, &right);
+		if (left + right >= AUDIO_QUIETEST)
+			audio_send(e->effect, left, right);
 	}
-	if (tank_brain.obstacle_timer > 0)
-		tank_brain.obstacle_timer--;
-	if (tank_brain.obstacle_timer <= 0) {
-		tank_brain.obstacle_timer = 0;
-		tank_brain.mode = TANK_MODE_IDLE;
+	if (engine != audio.engine_gain) {
+		audio_send(SOUND_ENGINE, engine, engine);
+		audio.engine_gain = engine;
 	}
 }
 
-static void tank_mode_aiming(__attribute__((unused)) struct bz_object *o)
+static void audio_close(void)
 {
-	int dx, dz;
-	signed short sdx, sdz;
-
-	dx = camera.x - o->x;
-	dz = camera.z - o->z;
-
-	/* This prevents taking arctan2(0, 0); */
-	if (abs(dx) < TANK_DEST_ARRIVE_DIST && abs(dz) < TANK_DEST_ARRIVE_DIST) {
-		tank_brain.mode = TANK_MODE_IDLE; /* FIXME... what to do here? */
+	if (!audio.device)
 		return;
-	}
+	SDL_CloseAudioDevice(audio.device);
+	audio.device = 0;
+	if (audio.dropped)
+		fprintf(stderr, "%u sounds dropped with the mixer behind\n", audio.dropped);
+}
 
-	if (abs(dx) > 32000 || abs(dz) > 32000) {
-		dx = dx >> 8;
-		dz = dz >> 8;
-	}
-	sdx = (signed short) dx;
-	sdz = (signed short) dz;
-	
-	int a = arctan2(-sdx, -sdz);
-	if (a < 0)
-		a += 128;
-	tank_brain.desired_orientation = a;
+/* Keyboard state between ticks.  Events only update this; the simulation
+ * sees it once per tick, in step_world().
+ */
+static struct key_input {
+	uint32_t held; /* BUTTON_* bits for keys which are down */
+	uint32_t pressed; /* and for keys which went down since the last tick */
+	int rewind; /* R went down since the last tick */
+} key_input;
+
+/* Input latency.  Each key press is stamped and numbered as it comes off
+ * SDL's event queue and waits here until the first frame drawn from a tick
+ * which took it as input is presented, when it goes into two histograms: the
+ * time until the tick took it, and the time until it was on the screen.  The
+ * ticks say when they took their input and how many presses had been handed
+ * to them by then, see input_shown().
+ */
+#define LATENCY_PENDING 64 /* presses not yet on the screen */
+#define LATENCY_BUCKETS 100 /* of 1 ms, the last for anything longer */
+
+struct latency_histogram {
+	uint64_t count, sum_us, max_us;
+	uint32_t bucket[LATENCY_BUCKETS];
+};
 
-	int turning_direction;
+static struct input_latency {
+	struct pending_press {
+		uint64_t us;
+		uint32_t number; /* counting from 0, see presses */
+	} pending[LATENCY_PENDING]; /* a ring, oldest first */
+	int head, n;
+	uint32_t presses; /* so far, dropped ones included */
+	uint64_t dropped; /* presses which found the ring full */
+	struct latency_histogram to_tick, to_screen;
+} input_latency;
+
+static const char *latency_path; /* --input-latency */
 
-	int da = tank_brain.desired_orientation - o->orientation;
+static void input_pressed(struct input_latency *l, uint64_t now)
+{
+	uint32_t number = l->presses++;
 
-	if (da == 0) {
-		tank_brain.mode = TANK_MODE_SHOOTING;
+	if (l->n == LATENCY_PENDING) {
+		l->dropped++;
 		return;
 	}
-
-	if (da < -64 || (da > 0 && da <= 64))
-		turning_direction = 1;
-	else
-		turning_direction = -1;
-	o->orientation += turning_direction;
-	if (o->orientation < 0)
-		o->orientation += 128;
-	if (o->orientation >= 128)
-		o->orientation -= 128;
+	l->pending[(l->head + l->n++) % LATENCY_PENDING] = (struct pending_press) { now, number };
 }
 
-static void tank_mode_shooting(struct bz_object *o)
+static void latency_add(struct latency_histogram *h, uint64_t us)
 {
-	int n;
-	n = add_object(o->x, camera.y, o->z, o->orientation, ARTILLERY_SHELL_MODEL, ORANGE);
-	if (n < 0) {
-		tank_brain.mode = TANK_MODE_SHOOTING_COOLDOWN;
-		tank_brain.cooldown = rtc_get_ms_since_boot() + TANK_SHOOT_COOLDOWN_TIME_MS;
-		return;
-	}
-	bzo[n].alive = SHELL_LIFETIME;
-	bzo[n].vx = -SHELL_SPEED * sine(o->orientation);
-	bzo[n].vz = -SHELL_SPEED * cosine(o->orientation);
-	bzo[n].vy = 0;
-	bzo[n].parent_obj = o - &bzo[0];
-	tank_brain.mode = TANK_MODE_SHOOTING_COOLDOWN;
-	tank_brain.cooldown = rtc_get_ms_since_boot() + TANK_SHOOT_COOLDOWN_TIME_MS;
+	uint64_t ms = us / 1000;
+
+	h->bucket[ms < LATENCY_BUCKETS ? ms : LATENCY_BUCKETS - 1]++;
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
 }
 
-static void tank_mode_shooting_cooldown(void)
+/* A frame from a tick which took its input at taken_us, by when the first
+ * presses key presses had been handed to the simulation, was presented at
+ * shown_us: that is when those presses reached the screen.
+ */
+static void input_shown(struct input_latency *l, uint32_t presses, uint64_t taken_us, uint64_t shown_us)
 {
-	int n = rtc_get_ms_since_boot();
-	if (n > tank_brain.cooldown) {
-		tank_brain.cooldown = 0;
-		tank_brain.mode = TANK_MODE_IDLE;
+	while (l->n > 0 && (int32_t) (l->pending[l->head].number - presses) < 0) {
+		const struct pending_press *p = &l->pending[l->head];
+
+		latency_add(&l->to_tick, taken_us - p->us);
+		latency_add(&l->to_screen, shown_us - p->us);
+		l->head = (l->head + 1) % LATENCY_PENDING;
+		l->n--;
 	}
 }
 
-static void move_tank(struct bz_object *o)
+/* The latency, in ms, within which fraction q of the presses in h came */
+static double latency_percentile(const struct latency_histogram *h, double q)
 {
-	switch (tank_brain.mode) {
-	case TANK_MODE_IDLE:
-		tank_mode_idle(o);
-		break;
-	case TANK_MODE_AVOIDING_OBSTACLE:
-		tank_mode_avoiding_obstacle(o);
-		break;
-	case TANK_MODE_DRIVING:
-		tank_mode_driving(o);
-		break;
-	case TANK_MODE_COMPUTE_STEERING:
-		tank_mode_compute_steering(o);
-		break;
-	case TANK_MODE_STEERING:
-		tank_mode_steering(o);
-		break;
-	case TANK_MODE_AIMING:
-		tank_mode_aiming(o);
-		break;
-	case TANK_MODE_SHOOTING:
-		tank_mode_shooting(o);
-		break;
-	case TANK_MODE_SHOOTING_COOLDOWN:
-		tank_mode_shooting_cooldown();
-		break;
-	default:
-		tank_brain.mode = TANK_MODE_IDLE;
-		break;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= q * h->count)
+			return i + 1;
 	}
+	return h->max_us / 1000.0;
 }
 
-static void move_object(struct bz_object *o)
+static void latency_report(struct input_latency *l)
 {
-	int n;
-
-	switch (o->model) {
-	case TANK_MODEL:
-		move_tank(o);
-		break;
-	case CHUNK0_MODEL:
-	case CHUNK1_MODEL:
-	case CHUNK2_MODEL:
-		o->x += o->vx;
-		o->y += o->vy;
-		o->z += o->vz;
-		o->vy += SPARK_GRAVITY; /* Why add here, but subtract in move_spark()??? */
-		if (o->alive > 0)
-			o->alive--;
-		if (o->y < 0)
-			o->alive = 0; 
-		n = ((o - &bzo[0]) % 6) - 3;
-		if (n == 0)
-			n = 1;
-		o->orientation = o->orientation + n;
-		if (o->orientation < 0)
-			o->orientation += 128;
-		if (o->orientation >= 128)
-			o->orientation -= 128;
-		break;
-	case ARTILLERY_SHELL_MODEL:
-		o->x += o->vx;
-		o->z += o->vz;
-		if (o->alive > 0)
-			o->alive--;
-		if ((n = shell_collision(o)) != 0) { /* shell_collision returns 0 if no collision,
-							object index + 1 if collision,
-							-1 if collision with player */
-			if (n < 0) { /* collision with player */
-				int direction = o->orientation;
-				direction += 64;
-				if (direction > 127)
-					direction -= 128;
-				o->alive = 0;
-				player_has_been_hit = 1;
-				explosion(camera.x, camera.y, camera.z, SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
-				camera.vx = (2 * sine(direction));
-				camera.vy = 2 << 8;
-				camera.vz = (2 * cosine(direction));
-				bump_player();
-				bz_deaths++;
-				break;
-			} else {
-				/* Collision with an object, subtract one to get index */
-				n--;
-				if (bzo[n].model == TANK_MODEL) { /* collision with tank */
-					explosion(o->x, o->y, o->z, SPARKS_PER_EXPLOSION, TANK_CHUNK_COUNT);
-					bzo[n].alive = 0;
-					bz_kills++;
-				} else { /* collision with obstacle */
-					explosion(o->x, o->y, o->z, SPARKS_PER_EXPLOSION, 0);
-				}
-			}
-			o->alive = 0;
-		}
-		break;
-	default:
+	const struct latency_histogram *h[] = { &l->to_tick, &l->to_screen };
+	const char *what[] = { "to the tick", "to the screen" };
+	FILE *f;
+
+	if (!l->to_screen.count)
+		return;
+	printf("input latency over %llu presses (%llu dropped):\n",
+		(unsigned long long) l->to_screen.count, (unsigned long long) l->dropped);
+	for (size_t i = 0; i < ARRAYSIZE(h); i++)
+		printf("  %-13s %.2f ms average, p50 <= %.0f ms, p99 <= %.0f ms, %.2f ms worst\n",
+			what[i], h[i]->sum_us / 1000.0 / h[i]->count, latency_percentile(h[i], 0.5),
+			latency_percentile(h[i], 0.99), h[i]->max_us / 1000.0);
+	if (!latency_path)
+		return;
+	f = fopen(latency_path, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s: %s\n", latency_path, strerror(errno));
 		return;
 	}
+	fprintf(f, "ms,to_tick,to_screen\n");
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		fprintf(f, "%d%s,%u,%u\n", i, i == LATENCY_BUCKETS - 1 ? "+" : "",
+			l->to_tick.bucket[i], l->to_screen.bucket[i]);
+	fclose(f);
 }
 
-static void regenerate_tank(void)
+static FILE *checksum_file; /* --checksums */
+static struct replay_writer *recorder; /* --record */
+static struct rewind_ring rewind_ring;
+static const char *save_path; /* --save */
+#ifndef BTWASM
+static struct net_client *net_client; /* --connect */
+#endif
+static struct autopilot *autopilot; /* --autopilot */
+
+/* Frame times and memory use over a long unattended run, see --duration */
+#define SOAK_REPORT_SECONDS 60
+static struct soak_stats {
+	uint64_t start_us, last_report_us;
+	uint64_t duration_us; /* 0 to run until told to stop */
+	uint64_t frames, frame_us, worst_frame_us, slow_frames;
+} soak;
+
+/* Resident and peak resident memory in KB, or 0 where unknown */
+static void memory_use(long *rss_kb, long *peak_kb)
 {
-	int x, z, orientation;
-
-	x = (((int) xorshift(&xorshift_state)) % 256);
-	z = (((int) xorshift(&xorshift_state)) % 256);
-	orientation = (((int) xorshift(&xorshift_state)) % 128);
-	if (orientation < 0)
-		orientation = - orientation;
-
-	add_object((x - 128) * 256, 0, (z - 128) * 256, orientation, TANK_MODEL, TANK_COLOR);
-	tank_brain.mode = TANK_MODE_IDLE;
-	tank_brain.cooldown = 0;
+	struct rusage ru;
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	*rss_kb = 0;
+	*peak_kb = 0;
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) == 1)
+			*rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+		fclose(f);
+	}
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		*peak_kb = ru.ru_maxrss;
 }
 
-static void move_objects(void)
+static void soak_report(struct bz_world *w)
 {
-	int tank_count = 0;
+	uint64_t now = rtc_get_us_since_boot();
+	long rss, peak;
+
+	memory_use(&rss, &peak);
+	printf("%.0f s, tick %u: frames %.2f ms average, %.2f ms worst, %llu over %d ms;"
+		" %ld KB resident, %ld KB peak; %d tanks, %d shells, %d sparks, %d debris;"
+		" %d kills, %d deaths\n",
+		(now - soak.start_us) / 1e6, w->sim_tick,
+		soak.frames ? soak.frame_us / 1000.0 / soak.frames : 0.0, soak.worst_frame_us / 1000.0,
+		(unsigned long long) soak.slow_frames, 1000 / TICKS_PER_SECOND, rss, peak,
+		w->tanks.n, w->shells.n, w->sparks.n, w->debris.n,
+		w->player[w->view_player].kills, w->player[w->view_player].deaths);
+	fflush(stdout);
+	soak.last_report_us = now;
+}
 
-	for (int i = 0; i < nbz_objects; i++) {
-		move_object(&bzo[i]);
-		if (bzo[i].model == TANK_MODEL)
-			tank_count++;
-	}
+static void write_checksum(struct bz_world *w)
+{
+	if (checksum_file)
+		fprintf(checksum_file, "%u %016llx\n", w->sim_tick, (unsigned long long) w->checksum);
+}
 
-	if (tank_count == 0)
-		regenerate_tank();
+/* Keys tapped between two ticks still count, even if already released */
+static uint32_t take_tick_input(struct key_input *k)
+{
+	uint32_t input = k->held | k->pressed;
 
-	/* If camera is above normal ground level, make it fall */
-	if (camera.y > CAMERA_GROUND_LEVEL) {
-		camera.vy -= (1 << 4);
-		camera.x += camera.vx;
-		camera.y += camera.vy;
-		camera.z += camera.vz;
-		if (camera.y <= CAMERA_GROUND_LEVEL) {
-			camera.y = CAMERA_GROUND_LEVEL;
-			camera.vx = 0;
-			camera.vy = 0;
-			camera.vz = 0;
-		}
-	}
+	k->pressed = 0;
+	return input;
 }
 
-static void remove_dead_objects(void)
+/* One tick of a game played here rather than on a server */
+static void local_tick(struct bz_world *w, uint32_t input, int rewind)
 {
-	for (int i = 0;;) {
-		if (i >= nbz_objects)
-			break;
-		struct bz_object *o = &bzo[i];
-		if (o->alive > 0) {
-			i++;
-			continue;
-		}
-		remove_object(i);
+	if (rewind && rewind_world(&rewind_ring, w) == 0 && recorder) {
+		/* A replay only runs forwards */
+		fprintf(stderr, "Rewound to tick %u, recording stopped\n", w->sim_tick);
+		replay_close(recorder);
+		recorder = NULL;
 	}
+	if (recorder)
+		replay_record(recorder, w, input);
+	step_world(w, input);
+	write_checksum(w);
+	rewind_tick(&rewind_ring, w, 1000000 / TICKS_PER_SECOND);
 }
 
-static void draw_screen(void)
+/* One tick of the game being played, here or on a server, with input from
+ * the keyboard, and rewind set if R was pressed.
+ */
+static void game_tick(struct bz_world *w, uint32_t input, int rewind)
 {
-	player_has_been_hit = 0;
-	move_objects();
-	remove_dead_objects();
-	move_sparks();
-	remove_dead_sparks();
-
-	FgColor(BLACK);
-	SDL_RenderClear(renderer);
-
-	if (player_has_been_hit) {
-		FgColor(WHITE);
-		SDL_RenderClear(renderer);
-		SDL_RenderPresent(renderer);
+	if (autopilot && w->player[w->view_player].active)
+		input = autopilot_input(w, w->view_player, autopilot) | (input & BUTTON_QUIT);
+#ifndef BTWASM
+	if (net_client) {
+		/* The server runs the world, so there is no rewinding it */
+		if (input & BUTTON_QUIT)
+			w->battlezone_state = BATTLEZONE_EXIT;
+		net_client_tick(net_client, w, input);
+		queue_sounds(w, input);
 		return;
 	}
-
-	draw_horizon();
-	draw_mountains();
-	draw_objects(&camera);
-	draw_sparks(&camera);
-	draw_radar();
-	draw_reticle();
-#if 0
-	FgColor(WHITE);
-	snprintf(buf, sizeof(buf), "%d %d %d", camera.orientation, camera.x / 256, camera.z / 256);	
-	FbMove(0, 150);
-	FbWriteString(buf);
-#endif
-	FgColor(GREEN);
-#if 0
-	snprintf(buf, sizeof(buf), "%d/%d", bz_kills, bz_deaths);
-	FbMove(0, 0);
-	FbWriteString(buf);
 #endif
-	SDL_RenderPresent(renderer);
+	local_tick(w, input, rewind);
+	queue_sounds(w, input);
 }
 
-#ifndef BTWASM
-#define REGULATE_FRAMERATE 1
-#endif
+/* Counts a frame which started at frame_start and showed w, for soak runs.
+ * Returns 1 once the --duration is up.
+ */
+static int soak_frame(struct bz_world *w, uint64_t frame_start)
+{
+	uint64_t now = rtc_get_us_since_boot();
+
+	if (!autopilot && !soak.duration_us)
+		return 0;
+	soak.frames++;
+	soak.frame_us += now - frame_start;
+	if (now - frame_start > soak.worst_frame_us)
+		soak.worst_frame_us = now - frame_start;
+	if (now - frame_start > 1000000 / TICKS_PER_SECOND)
+		soak.slow_frames++;
+	if (now - soak.last_report_us >= SOAK_REPORT_SECONDS * 1000000ULL)
+		soak_report(w);
+	return soak.duration_us && now - soak.start_us >= soak.duration_us;
+}
 
-static void battlezone_run(void)
+static void battlezone_run(struct bz_world *w)
 {
 #if REGULATE_FRAMERATE
 	static uint64_t last_frame_time = (uint64_t) -1;
@@ -1823,34 +6674,301 @@ static void battlezone_run(void)
 	diff_time = rtc_get_ms_since_boot() - last_frame_time;
 	if (diff_time >= 33) {
 #endif
-		check_buttons();
-		draw_screen();
+		uint64_t frame_start = rtc_get_us_since_boot();
+		uint32_t input = take_tick_input(&key_input);
+		int rewind = key_input.rewind;
+
+		key_input.rewind = 0;
+		game_tick(w, input, rewind);
+		draw_screen(w);
+		input_shown(&input_latency, input_latency.presses, frame_start, rtc_get_us_since_boot());
+		if (soak_frame(w, frame_start))
+			w->battlezone_state = BATTLEZONE_EXIT;
 #if REGULATE_FRAMERATE
 		last_frame_time = rtc_get_ms_since_boot();
 	}
 #endif
 }
 
-static void battlezone_exit(void)
+static void battlezone_exit(struct bz_world *w)
 {
-	battlezone_state = BATTLEZONE_INIT; /* So that when we start again, we do not immediately exit */
+	if (autopilot || soak.duration_us)
+		soak_report(w);
+	latency_report(&input_latency);
+	profile_report();
+	audio_close();
+	w->battlezone_state = BATTLEZONE_INIT; /* So that when we start again, we do not immediately exit */
+	if (recorder)
+		replay_close(recorder);
+	if (save_path)
+		save_snapshot(save_path, w);
+#ifndef BTWASM
+	if (net_client)
+		net_client_close(net_client);
+#endif
 	exit(0);
 }
 
-static void process_events(SDL_Window *window);
+#ifndef BTWASM
+/* Pipelined play (--pipeline).  The simulation runs on a thread of its own,
+ * a tick ahead of the main thread, which keeps to input and drawing as SDL
+ * requires.  After each tick the simulation copies what there is to draw
+ * into a triple buffer: it fills the back buffer and swaps it with the
+ * middle one, and the main thread swaps the middle one for its front buffer
+ * whenever there is something new in it.  Neither thread ever waits for the
+ * other, and what is drawn is always the newest complete tick, so a frame
+ * costs the slower of simulating and drawing rather than both.
+ */
+#define TRIPLE_FRESH 4 /* set in middle when it holds what the reader has not seen */
+
+struct triple_buffer {
+	struct bz_world *buf[3];
+	atomic_int middle; /* index into buf, | TRIPLE_FRESH */
+	int back; /* the writer's */
+	int front; /* the reader's */
+};
+
+static void triple_publish(struct triple_buffer *t)
+{
+	t->back = atomic_exchange(&t->middle, t->back | TRIPLE_FRESH) & 3;
+}
+
+/* Returns 1 if t->front is newly published */
+static int triple_take(struct triple_buffer *t)
+{
+	if (!(atomic_load(&t->middle) & TRIPLE_FRESH))
+		return 0;
+	t->front = atomic_exchange(&t->middle, t->front) & 3;
+	return 1;
+}
+
+#define COPY_COLUMN(dst, src, table, column, n) \
+	memcpy((dst)->table.column, (src)->table.column, sizeof((src)->table.column[0]) * (n))
+
+/* Copies into dst, a world kept only to be drawn, what draw_screen() and
+ * soak_report() look at in src.
+ */
+static void copy_drawable(struct bz_world *dst, const struct bz_world *src)
+{
+	int nsparks = (src->sparks.n + SIMD_WIDTH - 1) & ~(SIMD_WIDTH - 1);
+
+	dst->battlezone_state = src->battlezone_state;
+	dst->sim_tick = src->sim_tick;
+	dst->view_player = src->view_player;
+	dst->nplayers = src->nplayers;
+	memcpy(dst->player, src->player, sizeof(src->player[0]) * src->nplayers);
+	memcpy(dst->mountain, src->mountain, sizeof(src->mountain));
+	if (dst->statics_version != src->statics_version) {
+		COPY_COLUMN(dst, src, statics, x, src->statics.n);
+		COPY_COLUMN(dst, src, statics, y, src->statics.n);
+		COPY_COLUMN(dst, src, statics, z, src->statics.n);
+		COPY_COLUMN(dst, src, statics, orientation, src->statics.n);
+		COPY_COLUMN(dst, src, statics, model, src->statics.n);
+		COPY_COLUMN(dst, src, statics, color, src->statics.n);
+		dst->statics.n = src->statics.n;
+		dst->statics_version = src->statics_version;
+	}
+	COPY_COLUMN(dst, src, tanks, x, src->tanks.n);
+	COPY_COLUMN(dst, src, tanks, y, src->tanks.n);
+	COPY_COLUMN(dst, src, tanks, z, src->tanks.n);
+	COPY_COLUMN(dst, src, tanks, orientation, src->tanks.n);
+	COPY_COLUMN(dst, src, tanks, color, src->tanks.n);
+	dst->tanks.n = src->tanks.n;
+	COPY_COLUMN(dst, src, shells, x, src->shells.n);
+	COPY_COLUMN(dst, src, shells, y, src->shells.n);
+	COPY_COLUMN(dst, src, shells, z, src->shells.n);
+	COPY_COLUMN(dst, src, shells, orientation, src->shells.n);
+	dst->shells.n = src->shells.n;
+	COPY_COLUMN(dst, src, sparks, x, nsparks);
+	COPY_COLUMN(dst, src, sparks, y, nsparks);
+	COPY_COLUMN(dst, src, sparks, z, nsparks);
+	dst->sparks.n = src->sparks.n;
+	COPY_COLUMN(dst, src, debris, x, src->debris.n);
+	COPY_COLUMN(dst, src, debris, y, src->debris.n);
+	COPY_COLUMN(dst, src, debris, z, src->debris.n);
+	COPY_COLUMN(dst, src, debris, orientation, src->debris.n);
+	COPY_COLUMN(dst, src, debris, model, src->debris.n);
+	COPY_COLUMN(dst, src, debris, color, src->debris.n);
+	dst->debris.n = src->debris.n;
+}
+
+static struct pipeline {
+	pthread_t thread;
+	int running;
+	struct bz_world *w; /* the simulation thread's alone while running */
+	struct triple_buffer frames;
+	uint32_t scripted_ticks; /* for frame_benchmark(): run this many flat out */
+	_Atomic uint64_t input; /* PIPELINE_*, for the simulation to take each tick */
+	atomic_int stop;
+	atomic_uint ticks; /* run so far */
+	uint64_t copy_us; /* spent in copy_drawable() */
+	uint64_t input_us[3]; /* when the tick in frames.buf[i] took its input */
+	uint32_t presses[3]; /* and how many key presses had been handed over by then */
+	uint32_t phase_us[3][NSIM_PHASES]; /* and what its phases took, while profiling */
+} pipeline;
+
+/* pipeline.input packs the keys down and whether R was pressed since the
+ * simulation last took them, with the number of key presses handed over so
+ * far, which the simulation takes along with the keys but leaves in place.
+ */
+#define PIPELINE_KEYS 0xffff /* BUTTON_* */
+#define PIPELINE_REWIND (1 << 16)
+#define PIPELINE_PRESSES_SHIFT 32
+
+static int pipelined; /* --pipeline */
+
+static void *simulation_thread(UNUSED void *arg)
+{
+	struct bz_world *w = pipeline.w;
+	uint64_t next_tick = rtc_get_us_since_boot();
+
+	trace_thread("simulation", -1);
+	while (!atomic_load(&pipeline.stop)) {
+		uint64_t now = rtc_get_us_since_boot(), taken = now;
+		uint64_t input = 0;
+
+		if (pipeline.scripted_ticks) {
+			if (atomic_load(&pipeline.ticks) == pipeline.scripted_ticks)
+				break;
+			step_world(w, scripted_player_input(w, 0, 1));
+		} else {
+			if (now < next_tick) {
+				trace_begin("wait for tick");
+				usleep(next_tick - now);
+				trace_end("wait for tick");
+				continue;
+			}
+			/* Keep time, but don't race to catch up after a stall */
+			next_tick = now - next_tick > 100000 ? now : next_tick + 1000000 / TICKS_PER_SECOND;
+			input = atomic_fetch_and(&pipeline.input, ~(uint64_t) 0 << PIPELINE_PRESSES_SHIFT);
+			game_tick(w, input & PIPELINE_KEYS, !!(input & PIPELINE_REWIND));
+		}
+		now = rtc_get_us_since_boot();
+		trace_begin("publish");
+		copy_drawable(pipeline.frames.buf[pipeline.frames.back], w);
+		pipeline.input_us[pipeline.frames.back] = taken;
+		pipeline.presses[pipeline.frames.back] = (uint32_t) (input >> PIPELINE_PRESSES_SHIFT);
+		memcpy(pipeline.phase_us[pipeline.frames.back], sim_phase_us, sizeof(sim_phase_us));
+		triple_publish(&pipeline.frames);
+		trace_end("publish");
+		pipeline.copy_us += rtc_get_us_since_boot() - now;
+		atomic_fetch_add(&pipeline.ticks, 1);
+		if (w->battlezone_state == BATTLEZONE_EXIT)
+			break;
+	}
+	return NULL;
+}
+
+/* Starts the simulation of w on a thread of its own.  If scripted_ticks is
+ * non-zero, it runs that many ticks of scripted input as fast as it can.
+ */
+static int start_pipeline(struct bz_world *w, uint32_t scripted_ticks)
+{
+	for (int i = 0; i < 3; i++) {
+		if (!pipeline.frames.buf[i])
+			pipeline.frames.buf[i] = calloc(1, sizeof(*w));
+		if (!pipeline.frames.buf[i]) {
+			fprintf(stderr, "Out of memory for the frame buffers\n");
+			return -1;
+		}
+		pipeline.frames.buf[i]->statics_version = w->statics_version - 1;
+	}
+	pipeline.frames.back = 0;
+	atomic_store(&pipeline.frames.middle, 1);
+	pipeline.frames.front = 2;
+	pipeline.w = w;
+	pipeline.scripted_ticks = scripted_ticks;
+	atomic_store(&pipeline.input, (uint64_t) input_latency.presses << PIPELINE_PRESSES_SHIFT);
+	memset(pipeline.presses, 0, sizeof(pipeline.presses));
+	atomic_store(&pipeline.stop, 0);
+	atomic_store(&pipeline.ticks, 0);
+	pipeline.copy_us = 0;
+	if (pthread_create(&pipeline.thread, NULL, simulation_thread, NULL) != 0) {
+		fprintf(stderr, "Cannot start the simulation thread\n");
+		return -1;
+	}
+	pipeline.running = 1;
+	return 0;
+}
+
+/* Stops the simulation thread, after which its world is the caller's again */
+static void stop_pipeline(void)
+{
+	if (!pipeline.running)
+		return;
+	atomic_store(&pipeline.stop, 1);
+	pthread_join(pipeline.thread, NULL);
+	pipeline.running = 0;
+	profiler.sim_us = sim_phase_us;
+}
+
+/* The main thread's part in pipelined play: pass on input, and draw
+ * whatever the simulation has most recently finished.
+ */
+static void pipeline_frame(struct bz_world *w)
+{
+	uint64_t frame_start = rtc_get_us_since_boot();
+	uint64_t send = take_tick_input(&key_input) | (key_input.rewind ? PIPELINE_REWIND : 0);
+	uint64_t input = atomic_load(&pipeline.input);
+	struct bz_world *f;
+
+	/* The keys and the count of presses go over together, so that the
+	 * presses are credited to the tick which takes them.
+	 */
+	send |= (uint64_t) input_latency.presses << PIPELINE_PRESSES_SHIFT;
+	while (!atomic_compare_exchange_weak(&pipeline.input, &input,
+			(input & (PIPELINE_KEYS | PIPELINE_REWIND)) | send))
+		;
+	key_input.rewind = 0;
+	if (!triple_take(&pipeline.frames))
+		return;
+	f = pipeline.frames.buf[pipeline.frames.front];
+	profiler.sim_us = pipeline.phase_us[pipeline.frames.front];
+	draw_screen(f);
+	input_shown(&input_latency, pipeline.presses[pipeline.frames.front],
+		pipeline.input_us[pipeline.frames.front], rtc_get_us_since_boot());
+	if (soak_frame(f, frame_start) || f->battlezone_state == BATTLEZONE_EXIT) {
+		stop_pipeline();
+		w->battlezone_state = BATTLEZONE_EXIT;
+		battlezone_exit(w);
+	}
+}
+#endif
+
+static void process_events(struct key_input *k);
+
+static struct bz_world *world; /* the world shown in the window */
+static struct sound_events world_sounds; /* what world made in its last tick */
 
 void main_loop(void)
 {
-	process_events(window);
-	switch (battlezone_state) {
+	struct bz_world *w = world;
+
+	process_events(&key_input);
+#ifndef BTWASM
+	if (pipeline.running) {
+		pipeline_frame(w);
+		return;
+	}
+#endif
+	switch (w->battlezone_state) {
 	case BATTLEZONE_INIT:
-		battlezone_init();
+		battlezone_init(w);
+		SDL_RenderClear(renderer);
+		screen_changed = 1;
 		break;
 	case BATTLEZONE_RUN:
-		battlezone_run();
+#ifndef BTWASM
+		if (pipelined) {
+			if (start_pipeline(w, 0) == 0)
+				break;
+			pipelined = 0;
+		}
+#endif
+		battlezone_run(w);
 		break;
 	case BATTLEZONE_EXIT:
-		battlezone_exit();
+		battlezone_exit(w);
 		break;
 	default:
 		break;
@@ -1859,72 +6977,63 @@ void main_loop(void)
 
 /*------------------------------------------*/
 
-static void key_press_cb(SDL_Keysym *keysym)
+static uint32_t key_button(SDL_Keycode sym)
 {
-	switch (keysym->sym) {
+	switch (sym) {
 	case SDLK_UP:
-		keypress_latches |= BUTTON_UP;
-		break;
+		return BUTTON_UP;
 	case SDLK_DOWN:
-		keypress_latches |= BUTTON_DOWN;
-		break;
+		return BUTTON_DOWN;
 	case SDLK_LEFT:
-		keypress_latches |= BUTTON_LEFT;
-		break;
+		return BUTTON_LEFT;
 	case SDLK_RIGHT:
-		keypress_latches |= BUTTON_RIGHT;
-		break;
+		return BUTTON_RIGHT;
 	case SDLK_SPACE:
-		keypress_latches |= BUTTON_FIRE;
-		break;
+		return BUTTON_FIRE;
 	case SDLK_ESCAPE:
-		keypress_latches |= BUTTON_QUIT;
-		break;
+		return BUTTON_QUIT;
+	default:
+		return 0;
 	}
 }
 
-static void key_release_cb(SDL_Keysym *keysym)
+static void key_press_cb(struct key_input *k, SDL_KeyboardEvent *key)
 {
-	switch (keysym->sym) {
-	case SDLK_UP:
-		keypress_latches &= ~BUTTON_UP;
-		break;
-	case SDLK_DOWN:
-		keypress_latches &= ~BUTTON_DOWN;
-		break;
-	case SDLK_LEFT:
-		keypress_latches &= ~BUTTON_LEFT;
-		break;
-	case SDLK_RIGHT:
-		keypress_latches &= ~BUTTON_RIGHT;
-		break;
-	case SDLK_SPACE:
-		keypress_latches &= ~BUTTON_FIRE;
-		break;
-	case SDLK_ESCAPE:
-		keypress_latches &= ~BUTTON_QUIT;
-		break;
-	}
+	SDL_Keysym *keysym = &key->keysym;
+
+	if (!key->repeat && (key_button(keysym->sym) || keysym->sym == SDLK_r))
+		input_pressed(&input_latency, rtc_get_us_since_boot());
+	k->held |= key_button(keysym->sym);
+	k->pressed |= key_button(keysym->sym);
+	if (keysym->sym == SDLK_r)
+		k->rewind = 1;
+	if (keysym->sym == SDLK_p && !key->repeat)
+		profile_toggle_overlay();
 }
 
-static void process_events(UNUSED SDL_Window *window)
+static void key_release_cb(struct key_input *k, SDL_Keysym *keysym)
+{
+	k->held &= ~key_button(keysym->sym);
+}
+
+static void process_events(struct key_input *k)
 {
 	SDL_Event event;
 
 	while (SDL_PollEvent(&event)) {
 		switch (event.type) {
 		case SDL_KEYDOWN:
-			key_press_cb(&event.key.keysym);
+			key_press_cb(k, &event.key);
 			break;
 		case SDL_KEYUP:
-			key_release_cb(&event.key.keysym);
+			key_release_cb(k, &event.key.keysym);
 			break;
 		case SDL_QUIT:
 			/* Handle quit requests (like Ctrl-c). */
-			battlezone_state = BATTLEZONE_EXIT;
+			k->pressed |= BUTTON_QUIT;
 			break;
 		}
-        }
+	}
 }
 
 static int init_sdl2(void)
@@ -1949,11 +7058,391 @@ static int init_sdl2(void)
 	return 0;
 }
 
-int main(UNUSED int argc, UNUSED char *argv[])
+/* Sets up w for tick_benchmark(), with the player at the origin among
+ * nobstacles obstacles and ntanks tanks.
+ */
+static void bench_arena(struct bz_world *w, int nobstacles, int ntanks)
 {
-	if (init_sdl2())
+	battlezone_init(w);
+	for (int i = 0; i < nobstacles; i++) {
+		int x = (int) (xorshift(&w->xorshift_state) % 2048) - 1024;
+		int z = (int) (xorshift(&w->xorshift_state) % 2048) - 1024;
+		int type = (int) (xorshift(&w->xorshift_state) % 4);
+		if (abs(x) < 20 && abs(z) < 20) /* leave the player some room */
+			continue;
+		add_static(w, x * 256, 0, z * 256, 0, type, OBSTACLE_COLOR);
+	}
+	for (int i = 1; i < ntanks; i++) {
+		int x = (int) (xorshift(&w->xorshift_state) % 2048) - 1024;
+		int z = (int) (xorshift(&w->xorshift_state) % 2048) - 1024;
+		add_tank(w, x * 256, 0, z * 256, (int) (xorshift(&w->xorshift_state) % 128));
+	}
+}
+
+/* Runs the simulation without a window at a high entity count and reports
+ * the cost of a tick.  See scripted_player_input() for what the player does,
+ * unless the autopilot is flying.
+ */
+static void tick_benchmark(struct bz_world *w, int nticks, int drive)
+{
+	uint64_t start, elapsed, worst = 0;
+	int ntanks = w->tanks.n;
+
+	memset(&w->ai_stats, 0, sizeof(w->ai_stats));
+	w->timers.fired = 0;
+	pool.timing = 1;
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < nticks; i++) {
+		uint64_t tick_start = rtc_get_us_since_boot();
+		uint32_t input = autopilot ? autopilot_input(w, 0, autopilot) : scripted_player_input(w, 0, drive);
+		if (recorder)
+			replay_record(recorder, w, input);
+		step_world(w, input);
+		write_checksum(w);
+		rewind_tick(&rewind_ring, w, rtc_get_us_since_boot() - tick_start);
+		if (rtc_get_us_since_boot() - tick_start > worst)
+			worst = rtc_get_us_since_boot() - tick_start;
+	}
+	elapsed = rtc_get_us_since_boot() - start;
+
+	printf("%d ticks, %d obstacles, %d tanks, %d threads: %.2f us/tick (%.0f ticks/sec)\n",
+		nticks, w->statics.n, ntanks, world_workers(w), (double) elapsed / nticks,
+		elapsed ? (1e6 * nticks) / elapsed : 0.0);
+	printf("worst tick %llu us, tank AI updates per tick: %.1f average, %d max\n",
+		(unsigned long long) worst,
+		w->ai_stats.ticks ? (double) w->ai_stats.updates / w->ai_stats.ticks : 0.0,
+		w->ai_stats.max_updates);
+	printf("timers fired per tick: %.2f\n", (double) w->timers.fired / nticks);
+	printf("at exit: %d tanks, %d shells, %d debris, %d sparks, %d kills, %d deaths\n",
+		w->tanks.n, w->shells.n, w->debris.n, w->sparks.n, w->player[0].kills, w->player[0].deaths);
+	printf("player in chunk (%lld, %lld): %d chunks loaded, %d evicted, %d resident, %d rebases\n",
+		(long long) w->chunks.player_cx, (long long) w->chunks.player_cz,
+		w->chunks.loaded, w->chunks.evicted, w->chunks.n, w->chunks.rebased);
+	printf("checksum at tick %u: %016llx\n", w->sim_tick, (unsigned long long) w->checksum);
+	if (recorder)
+		printf("recording: %.3f us/tick (%.2f%% of a tick)\n", (double) recorder->us / nticks,
+			elapsed ? 100.0 * recorder->us / elapsed : 0.0);
+	if (rewind_ring.budget_percent > 0)
+		printf("rewind snapshots: %llu taken, one every %.0f ticks, %.3f us/tick (%.2f%% of a tick, budget %d%%)\n",
+			(unsigned long long) rewind_ring.taken,
+			rewind_ring.taken ? (double) nticks / rewind_ring.taken : 0.0,
+			(double) rewind_ring.us / nticks, elapsed ? 100.0 * rewind_ring.us / elapsed : 0.0,
+			rewind_ring.budget_percent);
+	job_report(&pool);
+}
+
+#ifndef BTWASM
+/* Runs nframes ticks of the benchmark arena, drawing each one, first with
+ * the simulation and drawing taking turns and then with them pipelined, and
+ * reports the throughput of each.  The scripted player drives.
+ */
+static void frame_benchmark(struct bz_world *w, int nframes)
+{
+	struct bz_world *start = malloc(sizeof(*w));
+	uint64_t t0, t1, elapsed, sim_us = 0, draw_us = 0;
+	uint64_t serial_checksum;
+	int drawn = 0;
+
+	if (!start) {
+		fprintf(stderr, "Out of memory for the frame benchmark\n");
+		return;
+	}
+	memcpy(start, w, sizeof(*w));
+
+	t0 = rtc_get_us_since_boot();
+	for (int i = 0; i < nframes; i++) {
+		t1 = rtc_get_us_since_boot();
+		step_world(w, scripted_player_input(w, 0, 1));
+		sim_us += rtc_get_us_since_boot() - t1;
+		t1 = rtc_get_us_since_boot();
+		draw_screen(w);
+		draw_us += rtc_get_us_since_boot() - t1;
+	}
+	elapsed = rtc_get_us_since_boot() - t0;
+	serial_checksum = w->checksum;
+	printf("%d frames, %d tanks, %d sparks at the end, one after the other:"
+		" %.1f us/frame (simulation %.1f, drawing %.1f), %.0f frames/sec\n",
+		nframes, w->tanks.n, w->sparks.n, (double) elapsed / nframes, (double) sim_us / nframes,
+		(double) draw_us / nframes, elapsed ? 1e6 * nframes / elapsed : 0.0);
+
+	memcpy(w, start, sizeof(*w));
+	free(start);
+	if (start_pipeline(w, nframes) != 0)
+		return;
+	t0 = rtc_get_us_since_boot();
+	while (atomic_load(&pipeline.ticks) < (unsigned int) nframes) {
+		if (!triple_take(&pipeline.frames)) {
+			sched_yield();
+			continue;
+		}
+		profiler.sim_us = pipeline.phase_us[pipeline.frames.front];
+		draw_screen(pipeline.frames.buf[pipeline.frames.front]);
+		drawn++;
+	}
+	elapsed = rtc_get_us_since_boot() - t0;
+	stop_pipeline();
+	printf("pipelined: %.1f us/tick (%.2f copying it out), %.0f ticks/sec, %d frames drawn, %.0f frames/sec\n",
+		(double) elapsed / nframes, (double) pipeline.copy_us / nframes,
+		elapsed ? 1e6 * nframes / elapsed : 0.0, drawn, elapsed ? 1e6 * drawn / elapsed : 0.0);
+	printf("checksum at tick %u: %016llx, %s\n", w->sim_tick, (unsigned long long) w->checksum,
+		w->checksum == serial_checksum ? "the same both ways" : "NOT the same both ways");
+}
+#endif
+
+/* Reports how far the trig tables are from libm, and what they cost */
+static void trig_benchmark(void)
+{
+	const int ncalls = 10000000;
+	unsigned int state = 0xa5a5a5a5;
+	double max_err = 0.0, sum_err = 0.0, max_game_err = 0.0;
+	int nvectors = 1000000, exact = 0;
+	uint64_t start, elapsed;
+	volatile int64_t isink = 0;
+	volatile double dsink = 0.0;
+
+	for (int a = 0; a < TRIG_STEPS; a++) {
+		double err = fabs(sine_fine(a) - sin(2.0 * M_PI * a / TRIG_STEPS) * TRIG_ONE);
+		if (err > max_err)
+			max_err = err;
+	}
+	for (int a = 0; a < ANGLE_STEPS; a++) {
+		double err = fabs(sine(a) - sin(2.0 * M_PI * a / ANGLE_STEPS) * 256.0);
+		if (err > max_game_err)
+			max_game_err = err;
+	}
+	printf("%d steps per turn: sine_fine() max error %.3f / %d, sine() max error %.3f / 256\n",
+		TRIG_STEPS, max_err, TRIG_ONE, max_game_err);
+
+	max_err = 0.0;
+	for (int i = 0; i < nvectors; i++) {
+		/* Vectors of every length, up to the longest int32_t can hold */
+		int shift = xorshift(&state) % 31;
+		int32_t y = (int32_t) xorshift(&state) >> shift;
+		int32_t x = (int32_t) xorshift(&state) >> shift;
+		double want = atan2(y, x) * TRIG_STEPS / (2.0 * M_PI);
+		double err = fabs(arctan2_fine(y, x) - want);
+		if (err > TRIG_STEPS / 2)
+			err = TRIG_STEPS - err; /* either side of the +/- half turn seam */
+		if (err > max_err)
+			max_err = err;
+		sum_err += err;
+		int game = arctan2(y, x);
+		int want_game = (int) lround(atan2(y, x) * ANGLE_STEPS / (2.0 * M_PI));
+		exact += game == want_game || abs(game - want_game) == ANGLE_STEPS;
+	}
+	printf("arctan2_fine() max error %.3f steps (%.4f degrees), mean %.3f steps; arctan2() nearest in %.2f%% of cases\n",
+		max_err, max_err * 360.0 / TRIG_STEPS, sum_err / nvectors, 100.0 * exact / nvectors);
+
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < ncalls; i++)
+		isink += sine_fine(i * 7);
+	elapsed = rtc_get_us_since_boot() - start;
+	printf("sine_fine(): %.2f ns/call", 1000.0 * elapsed / ncalls);
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < ncalls; i++)
+		dsink += sin(i * 0.001);
+	elapsed = rtc_get_us_since_boot() - start;
+	printf(", libm sin(): %.2f ns/call\n", 1000.0 * elapsed / ncalls);
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < ncalls; i++)
+		isink += arctan2_fine(i * 7 - ncalls, ncalls - i * 3);
+	elapsed = rtc_get_us_since_boot() - start;
+	printf("arctan2_fine(): %.2f ns/call", 1000.0 * elapsed / ncalls);
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < ncalls; i++)
+		dsink += atan2(i * 7 - ncalls, ncalls - i * 3);
+	elapsed = rtc_get_us_since_boot() - start;
+	printf(", libm atan2(): %.2f ns/call\n", 1000.0 * elapsed / ncalls);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--seed n] [--tanks n] [--threads n]\n"
+		"	[--bench ticks] [--bench-obstacles n] [--bench-tanks n] [--bench-drive]\n"
+		"	[--bench-trig] [--checksums file]\n"
+		"	[--record file] [--keyframe-interval ticks] [--replay file] [--seek tick]\n"
+		"	[--save file] [--resume file] [--rewind-budget percent]\n"
+		"	[--connect host:port] [--scenario file] [--autopilot seed] [--duration seconds]\n"
+		"	[--pipeline] [--bench-frames n] [--input-latency file] [--profile-csv file]\n"
+		"	[--trace file]\n", program);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int bench_ticks = 0, bench_obstacles = 1000, bench_tanks = 100, bench_drive = 0;
+	int bench_trig = 0;
+	const char *checksum_path = NULL, *record_path = NULL, *replay_path = NULL;
+	const char *resume_path = NULL, *scenario_path = NULL;
+	const char *trace_path = NULL;
+	int rewind_budget = 2; /* percent */
+	int keyframe_interval = 30 * TICKS_PER_SECOND;
+	uint32_t seek = 0;
+	unsigned int seed = 0xa5a5a5a5;
+	unsigned int pilot_seed = 0;
+	int use_pilot = 0; /* --autopilot, whatever its seed */
+	int ntanks = 1; /* enemy tanks to keep in the arena */
+#ifdef BTWASM
+	int nthreads = 1;
+#else
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int bench_frames = 0;
+	const char *connect_to = NULL;
+#endif
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "--tanks") == 0 && i + 1 < argc)
+			ntanks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			nthreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+			bench_ticks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-obstacles") == 0 && i + 1 < argc)
+			bench_obstacles = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-tanks") == 0 && i + 1 < argc)
+			bench_tanks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-drive") == 0)
+			bench_drive = 1;
+		else if (strcmp(argv[i], "--bench-trig") == 0)
+			bench_trig = 1;
+		else if (strcmp(argv[i], "--checksums") == 0 && i + 1 < argc)
+			checksum_path = argv[++i];
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			record_path = argv[++i];
+		else if (strcmp(argv[i], "--keyframe-interval") == 0 && i + 1 < argc)
+			keyframe_interval = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			replay_path = argv[++i];
+		else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc)
+			seek = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+			save_path = argv[++i];
+		else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc)
+			resume_path = argv[++i];
+		else if (strcmp(argv[i], "--rewind-budget") == 0 && i + 1 < argc)
+			rewind_budget = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc)
+			scenario_path = argv[++i];
+		else if (strcmp(argv[i], "--autopilot") == 0 && i + 1 < argc) {
+			pilot_seed = strtoul(argv[++i], NULL, 0);
+			use_pilot = 1;
+		} else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+			soak.duration_us = strtoull(argv[++i], NULL, 0) * 1000000ULL;
+#ifndef BTWASM
+		else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+			connect_to = argv[++i];
+		else if (strcmp(argv[i], "--input-latency") == 0 && i + 1 < argc)
+			latency_path = argv[++i];
+		else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc)
+			profile_csv_path = argv[++i];
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace_path = argv[++i];
+		else if (strcmp(argv[i], "--pipeline") == 0)
+			pipelined = 1;
+		else if (strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc)
+			bench_frames = atoi(argv[++i]);
+#endif
+		else
+			usage(argv[0]);
+	}
+
+	if (use_pilot) {
+		static struct autopilot pilot;
+		autopilot_init(&pilot, pilot_seed);
+		autopilot = &pilot;
+	}
+	if (bench_trig) {
+		rtc_init();
+		trig_benchmark();
+		return 0;
+	}
+	if (checksum_path) {
+		checksum_file = fopen(checksum_path, "w");
+		if (!checksum_file) {
+			fprintf(stderr, "Cannot open %s: %s\n", checksum_path, strerror(errno));
+			return -1;
+		}
+	}
+	if (profile_csv_path && profile_open_csv(profile_csv_path))
+		return -1;
+	if (trace_path && trace_open(trace_path))
 		return -1;
+	if (scenario_path) {
+		scenario = load_scenario(scenario_path);
+		if (!scenario)
+			return -1;
+	}
+	pool_init(nthreads);
+	prescale_models();
+	if (replay_path) {
+		rtc_init();
+		return replay_benchmark(replay_path, seek);
+	}
+	if (record_path) {
+		recorder = replay_create(record_path, keyframe_interval);
+		if (!recorder)
+			return -1;
+	}
+	world = create_world(&pool, seed, ntanks);
+	if (!world)
+		return -1;
+	world->sounds = &world_sounds;
 	rtc_init();
+	if (resume_path) {
+		uint64_t start = rtc_get_us_since_boot();
+		if (load_snapshot(resume_path, world) != 0)
+			return -1;
+		printf("resumed at tick %u in %.2f ms\n", world->sim_tick,
+			(rtc_get_us_since_boot() - start) / 1000.0);
+	}
+	rewind_ring.budget_percent = rewind_budget;
+	soak.start_us = soak.last_report_us = rtc_get_us_since_boot();
+	if (bench_ticks > 0) {
+		if (scenario && !resume_path)
+			battlezone_init(world);
+		else if (!resume_path)
+			bench_arena(world, bench_obstacles, bench_tanks);
+		tick_benchmark(world, bench_ticks, bench_drive);
+		if (checksum_file)
+			fclose(checksum_file);
+		if (recorder)
+			replay_close(recorder);
+		if (save_path && save_snapshot(save_path, world) != 0)
+			return -1;
+		rewind_free(&rewind_ring);
+		free_scenario(scenario);
+		free(world);
+		return 0;
+	}
+
+#ifndef BTWASM
+	if (bench_frames > 0) {
+		if (init_sdl2())
+			return -1;
+		if (scenario)
+			battlezone_init(world);
+		else
+			bench_arena(world, bench_obstacles, bench_tanks);
+		frame_benchmark(world, bench_frames);
+		return 0;
+	}
+	if (connect_to) {
+		char host[256];
+		const char *colon = strrchr(connect_to, ':');
+		if (!colon || colon == connect_to || (size_t) (colon - connect_to) >= sizeof(host))
+			usage(argv[0]);
+		memcpy(host, connect_to, colon - connect_to);
+		host[colon - connect_to] = '\0';
+		net_client = net_client_open(host, atoi(colon + 1));
+		if (!net_client)
+			return -1;
+	}
+#endif
+	if (init_sdl2())
+		return -1;
+	audio_init();
 #ifdef BTWASM
 	emscripten_set_main_loop(main_loop, 30, 1);
 #else
@@ -1963,4 +7452,260 @@ int main(UNUSED int argc, UNUSED char *argv[])
 	} while (1);
 #endif
 }
+#else
+
+/* The headless server hosts many arenas, each a world of its own with a
+ * scripted player, and steps them all one tick at a time on the pool.  The
+ * arenas differ in cost as tanks die and respawn, which is what the work
+ * stealing in parallel_for() evens out.  Each arena runs its own loops
+ * serially, so arenas are the only unit of parallelism.
+ */
+static struct autopilot *pilot; /* --autopilot, one for each arena or client */
+
+static void step_arena_range(void *arg, int begin, int end, UNUSED int worker)
+{
+	struct bz_world **arena = arg;
+
+	for (int i = begin; i < end; i++) {
+		if (pilot)
+			step_world(arena[i], autopilot_input(arena[i], 0, &pilot[i]));
+		else
+			step_world(arena[i], scripted_player_input(arena[i], 0, 0));
+	}
+}
+
+static void run_server(int narenas, int nticks, unsigned int seed, int ntanks)
+{
+	struct bz_world **arena = calloc(narenas, sizeof(*arena));
+	uint64_t start, elapsed, worst = 0;
+	int kills = 0, deaths = 0;
+	uint64_t checksum = 0;
+
+	if (!arena) {
+		fprintf(stderr, "Out of memory allocating %d arenas\n", narenas);
+		exit(1);
+	}
+	for (int i = 0; i < narenas; i++) {
+		arena[i] = create_world(NULL, seed + i, ntanks);
+		if (!arena[i])
+			exit(1);
+		battlezone_init(arena[i]);
+	}
+
+	atomic_store(&pool.steals, 0);
+	pool.timing = 1;
+	start = rtc_get_us_since_boot();
+	for (int i = 0; i < nticks; i++) {
+		uint64_t tick_start = rtc_get_us_since_boot();
+		parallel_for(&pool, "step arenas", narenas, 1, step_arena_range, arena);
+		if (rtc_get_us_since_boot() - tick_start > worst)
+			worst = rtc_get_us_since_boot() - tick_start;
+	}
+	elapsed = rtc_get_us_since_boot() - start;
+
+	double ticks_per_sec = elapsed ? (1e6 * narenas * nticks) / elapsed : 0.0;
+	printf("%d arenas, %d ticks, %d tanks each, %d threads: %.0f arena ticks/sec, %.0f per core\n",
+		narenas, nticks, arena[0]->enemy_tank_count, pool.nthreads, ticks_per_sec,
+		ticks_per_sec / pool.nthreads);
+	printf("%.2f us per arena tick, slowest round %llu us, %u steals, room for %.0f arenas at %d ticks/sec\n",
+		ticks_per_sec > 0.0 ? 1e6 / ticks_per_sec : 0.0, (unsigned long long) worst,
+		atomic_load(&pool.steals), ticks_per_sec / TICKS_PER_SECOND, TICKS_PER_SECOND);
+	for (int i = 0; i < narenas; i++) {
+		kills += arena[i]->player[0].kills;
+		deaths += arena[i]->player[0].deaths;
+		checksum = HASH_FIELD(checksum, arena[i]->checksum);
+		free(arena[i]);
+	}
+	printf("at exit: %d kills, %d deaths, checksum of all arenas %016llx\n",
+		kills, deaths, (unsigned long long) checksum);
+	job_report(&pool);
+	free(arena);
+}
+
+/* Hosts one arena for clients to join over the network, in real time */
+static void run_net_server(int port, unsigned int seed, int ntanks)
+{
+	struct bz_world *w = create_world(&pool, seed, ntanks);
+	struct net_server *srv;
+	uint64_t next_tick, last_report;
+
+	if (!w)
+		exit(1);
+	battlezone_init(w);
+	srv = net_server_open(NULL, port, w);
+	if (!srv)
+		exit(1);
+	printf("listening on UDP port %d\n", net_server_port(srv));
+	next_tick = last_report = rtc_get_us_since_boot();
+	for (;;) {
+		uint64_t now = rtc_get_us_since_boot();
+		if (now < next_tick) {
+			usleep(next_tick - now);
+			continue;
+		}
+		next_tick += 1000000 / TICKS_PER_SECOND;
+		net_server_tick(srv, w);
+		if (now - last_report >= 10000000) {
+			net_server_report(srv);
+			last_report = now;
+		}
+	}
+}
+
+/* Runs a server and nclients scripted clients in this process, talking over
+ * loopback as fast as they can, and checks that every snapshot each client
+ * decodes is the one the server sent.
+ */
+static void net_benchmark(int nclients, int nticks, unsigned int seed, int ntanks)
+{
+	struct bz_world *w = create_world(&pool, seed, ntanks);
+	struct bz_world **cw = calloc(nclients, sizeof(*cw));
+	struct net_client **client = calloc(nclients, sizeof(*client));
+	struct net_server *srv;
+	uint64_t mismatches = 0, checked = 0, corrections = 0, thrown = 0, up = 0, start, client_us;
+	int port;
+
+	if (!w || !cw || !client) {
+		fprintf(stderr, "Out of memory for %d clients\n", nclients);
+		exit(1);
+	}
+	battlezone_init(w);
+	srv = net_server_open("127.0.0.1", 0, w);
+	if (!srv)
+		exit(1);
+	port = net_server_port(srv);
+	for (int i = 0; i < nclients; i++) {
+		cw[i] = create_world(NULL, 0, 0);
+		client[i] = net_client_open("127.0.0.1", port);
+		if (!cw[i] || !client[i])
+			exit(1);
+		battlezone_init(cw[i]);
+	}
+
+	client_us = 0;
+	for (int t = 0; t < nticks; t++) {
+		net_server_tick(srv, w);
+		start = rtc_get_us_since_boot();
+		for (int i = 0; i < nclients; i++) {
+			struct net_client *c = client[i];
+			int p = c->player < 0 ? 0 : c->player;
+			uint32_t input = pilot ? autopilot_input(cw[i], p, &pilot[i]) : scripted_player_input(cw[i], p, 1);
+			net_client_tick(c, cw[i], input);
+			const struct net_state *mine = &c->state[c->newest % NET_HISTORY];
+			const struct net_state *theirs = &srv->history[c->newest % NET_HISTORY];
+			if (!c->newest || mine->tick != c->newest || theirs->tick != c->newest)
+				continue;
+			checked++;
+			if (mine->n != theirs->n || mine->origin_cx != theirs->origin_cx ||
+				mine->origin_cz != theirs->origin_cz ||
+				memcmp(mine->e, theirs->e, mine->n * sizeof(mine->e[0])) != 0)
+				mismatches++;
+		}
+		client_us += rtc_get_us_since_boot() - start;
+	}
+
+	for (int i = 0; i < nclients; i++) {
+		corrections += client[i]->corrections;
+		thrown += client[i]->thrown;
+		up += client[i]->bytes_out;
+	}
+	printf("%d clients, %d ticks, %d tanks, %d%% packet loss, clients took %.1f us/tick each\n",
+		nclients, nticks, ntanks, net_loss_percent, (double) client_us / nticks / nclients);
+	printf("%.0f bytes/tick up from each client\n", (double) up / nticks / nclients);
+	net_server_report(srv);
+	printf("checked %llu snapshots, %llu did not match the server's, %llu predictions corrected"
+		" (and %llu while thrown by a hit)\n", (unsigned long long) checked,
+		(unsigned long long) mismatches, (unsigned long long) corrections, (unsigned long long) thrown);
+	for (int i = 0; i < nclients; i++) {
+		net_client_close(client[i]);
+		free(cw[i]);
+	}
+	free(client);
+	free(cw);
+	close(srv->fd);
+	free(srv->history);
+	free(srv);
+	free(w);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--arenas n] [--ticks n] [--tanks n] [--seed n] [--threads n]\n"
+		"	[--listen port] [--net-bench clients] [--net-loss percent] [--scenario file]\n"
+		"	[--autopilot seed] [--trace file]\n",
+		program);
+	exit(1);
+}
 
+int main(int argc, char *argv[])
+{
+	int narenas = 100, nticks = 1000;
+	unsigned int seed = 0xa5a5a5a5;
+	int ntanks = 4; /* enemy tanks to keep in each arena */
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int listen_port = -1, net_clients = 0;
+	const char *scenario_path = NULL, *trace_path = NULL;
+	unsigned int pilot_seed = 0;
+	int use_pilot = 0; /* --autopilot, whatever its seed */
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--arenas") == 0 && i + 1 < argc)
+			narenas = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc)
+			nticks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--tanks") == 0 && i + 1 < argc)
+			ntanks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			nthreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+			listen_port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--net-bench") == 0 && i + 1 < argc)
+			net_clients = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--net-loss") == 0 && i + 1 < argc)
+			net_loss_percent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc)
+			scenario_path = argv[++i];
+		else if (strcmp(argv[i], "--autopilot") == 0 && i + 1 < argc) {
+			pilot_seed = strtoul(argv[++i], NULL, 0);
+			use_pilot = 1;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace_path = argv[++i];
+		else
+			usage(argv[0]);
+	}
+	if (narenas < 1 || nticks < 1 || net_clients < 0 || net_clients > MAX_PLAYERS)
+		usage(argv[0]);
+
+	if (scenario_path) {
+		scenario = load_scenario(scenario_path);
+		if (!scenario)
+			return 1;
+	}
+	if (use_pilot) {
+		int npilots = narenas > MAX_PLAYERS ? narenas : MAX_PLAYERS;
+		pilot = calloc(npilots, sizeof(*pilot));
+		if (!pilot) {
+			fprintf(stderr, "Out of memory for %d autopilots\n", npilots);
+			return 1;
+		}
+		for (int i = 0; i < npilots; i++)
+			autopilot_init(&pilot[i], pilot_seed + i);
+	}
+	if (trace_path && trace_open(trace_path))
+		return 1;
+	pool_init(nthreads);
+	prescale_models();
+	rtc_init();
+	if (listen_port >= 0)
+		run_net_server(listen_port, seed, ntanks);
+	else if (net_clients > 0)
+		net_benchmark(net_clients, nticks, seed, ntanks);
+	else
+		run_server(narenas, nticks, seed, ntanks);
+	free_scenario(scenario);
+	free(pilot);
+	return 0;
+}
+#endif
@@ -0,0 +1,114 @@
+/*
+	Copyright (C) 2023 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of Browzer-Tanx.
+
+	Browzer-Tanx is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	Browzer-Tanx is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Browzer-Tanx; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Writes a stress scenario for browzer-tanx --scenario to stdout: obstacles
+ * and tanks scattered at random over a square arena, with the load settings
+ * given.
+ *
+ *	usage: gen-scenario [--obstacles n] [--tanks n] [--radius units]
+ *		[--respawn ticks] [--continuous-fire] [--explosions n]
+ *		[--terrain] [--seed n]
+ *
+ * Defaults are 10000 obstacles and 1000 tanks within 1024 units (of 256) of
+ * the centre, on otherwise empty ground.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *model[] = { "cube", "short-cube", "pyramid", "narrow-pyramid" };
+
+/* The same xorshift as the game's, see browzer-tanx.c */
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [--obstacles n] [--tanks n] [--radius units]\n"
+		"	[--respawn ticks] [--continuous-fire] [--explosions n]\n"
+		"	[--terrain] [--seed n]\n", program);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int nobstacles = 10000, ntanks = 1000, radius = 1024, respawn = 0, explosions = 0;
+	int continuous_fire = 0, terrain = 0;
+	unsigned int seed = 0xa5a5a5a5;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--obstacles") == 0 && i + 1 < argc)
+			nobstacles = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--tanks") == 0 && i + 1 < argc)
+			ntanks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+			radius = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--respawn") == 0 && i + 1 < argc)
+			respawn = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--continuous-fire") == 0)
+			continuous_fire = 1;
+		else if (strcmp(argv[i], "--explosions") == 0 && i + 1 < argc)
+			explosions = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--terrain") == 0)
+			terrain = 1;
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else
+			usage(argv[0]);
+	}
+	if (nobstacles < 0 || ntanks < 0 || radius < 32 || respawn < 0 || explosions < 0 || seed == 0)
+		usage(argv[0]);
+
+	printf("# Generated by gen-scenario --obstacles %d --tanks %d --radius %d --respawn %d%s"
+		" --explosions %d%s --seed %u\n", nobstacles, ntanks, radius, respawn,
+		continuous_fire ? " --continuous-fire" : "", explosions, terrain ? " --terrain" : "", seed);
+	printf("tanks %d\n", ntanks);
+	printf("respawn %d\n", respawn);
+	if (continuous_fire)
+		printf("tank-cooldown 1\n");
+	printf("explosions %d\n", explosions);
+	printf("terrain %s\n", terrain ? "procedural" : "none");
+
+	for (int i = 0; i < nobstacles; i++) {
+		int x = (int) (xorshift(&seed) % (2 * radius)) - radius;
+		int z = (int) (xorshift(&seed) % (2 * radius)) - radius;
+		int m = xorshift(&seed) % 4;
+		if (abs(x) < 20 && abs(z) < 20) { /* leave the player some room */
+			i--;
+			continue;
+		}
+		printf("obstacle %s %d %d\n", model[m], x, z);
+	}
+	for (int i = 0; i < ntanks; i++) {
+		int x = (int) (xorshift(&seed) % (2 * radius)) - radius;
+		int z = (int) (xorshift(&seed) % (2 * radius)) - radius;
+		printf("tank %d %d %d\n", x, z, xorshift(&seed) % 128);
+	}
+	return 0;
+}
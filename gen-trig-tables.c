@@ -0,0 +1,84 @@
+/*
+	Copyright (C) 2023 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of Browzer-Tanx.
+
+	Browzer-Tanx is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	Browzer-Tanx is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Browzer-Tanx; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Writes trig-tables.h, the fixed point sine and arctangent tables used by
+ * browzer-tanx, to stdout.
+ *
+ *	usage: gen-trig-tables [steps]
+ *
+ * steps is the number of angle units in a full turn, a power of two from 128
+ * to 65536 (default 1024).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define TRIG_ONE_SHIFT 14 /* sine table is scaled by 1 << 14 */
+#define ATAN_SHIFT 8 /* arctangent table has 1 << 8 intervals over [0, 1] */
+#define ATAN_FRAC_SHIFT 16 /* and fractional bits in each entry */
+
+int main(int argc, char *argv[])
+{
+	long steps = 1024;
+	int shift = 0;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [steps]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2)
+		steps = strtol(argv[1], NULL, 0);
+	while ((1L << shift) < steps)
+		shift++;
+	if ((1L << shift) != steps || shift < 7 || shift > 16) {
+		fprintf(stderr, "%s: steps must be a power of two from 128 to 65536\n", argv[0]);
+		return 1;
+	}
+
+	printf("/* Generated by gen-trig-tables %ld, do not edit */\n\n", steps);
+	printf("#define TRIG_SHIFT %d\n", shift);
+	printf("#define TRIG_STEPS (1 << TRIG_SHIFT) /* angle units in a full turn */\n");
+	printf("#define TRIG_MASK (TRIG_STEPS - 1)\n");
+	printf("#define TRIG_ONE_SHIFT %d\n", TRIG_ONE_SHIFT);
+	printf("#define TRIG_ONE (1 << TRIG_ONE_SHIFT) /* sine of a quarter turn */\n");
+	printf("#define ATAN_SHIFT %d\n", ATAN_SHIFT);
+	printf("#define ATAN_STEPS (1 << ATAN_SHIFT)\n");
+	printf("#define ATAN_FRAC_SHIFT %d\n\n", ATAN_FRAC_SHIFT);
+
+	printf("/* sin(2 * pi * i / TRIG_STEPS) * TRIG_ONE */\n");
+	printf("static const int16_t trig_sine_table[TRIG_STEPS] = {");
+	for (long i = 0; i < steps; i++) {
+		double s = sin(2.0 * M_PI * (double) i / (double) steps);
+		printf("%s%ld,", (i % 12) ? " " : "\n\t", lround(s * (1 << TRIG_ONE_SHIFT)));
+	}
+	printf("\n};\n\n");
+
+	printf("/* atan(i / ATAN_STEPS) in angle units, with ATAN_FRAC_SHIFT bits of fraction */\n");
+	printf("static const uint32_t trig_atan_table[ATAN_STEPS + 1] = {");
+	for (int i = 0; i <= (1 << ATAN_SHIFT); i++) {
+		double a = atan((double) i / (1 << ATAN_SHIFT)) * (double) steps / (2.0 * M_PI);
+		printf("%s%lu,", (i % 8) ? " " : "\n\t",
+			(unsigned long) llround(a * (double) (1L << ATAN_FRAC_SHIFT)));
+	}
+	printf("\n};\n");
+	return 0;
+}